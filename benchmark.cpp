@@ -0,0 +1,357 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Micro-benchmarks of the QCL hot paths. The benchmarks are run on each
+// device of a global context, and the results are written to stdout as CSV
+// with the columns
+//   device_index,device,driver,benchmark,parameter,value,unit
+// such that results of different drivers, devices and QCL versions can
+// easily be compared. Progress messages are written to stderr.
+//
+// Usage: qcl_benchmark [platform keyword]
+// If no keyword is given, NVIDIA, AMD and Intel platforms are preferred
+// in this order.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#include "qcl.hpp"
+#include "qcl_module.hpp"
+#include "qcl_array.hpp"
+#include "qcl_algorithm.hpp"
+
+template<class T>
+QCL_STANDALONE_MODULE(benchmark_module)
+QCL_ENTRYPOINT(empty_kernel)
+QCL_ENTRYPOINT(vector_add)
+QCL_ENTRYPOINT(fma_loop)
+QCL_STANDALONE_SOURCE
+(
+  QCL_IMPORT_TYPE(T)
+  R"(
+  __kernel void empty_kernel(__global T* data)
+  {}
+
+  __kernel void vector_add(__global const T* a,
+                           __global const T* b,
+                           __global T* c,
+                           uint n)
+  {
+    uint gid = get_global_id(0);
+    if(gid < n)
+      c[gid] = a[gid] + b[gid];
+  }
+
+  // 2 * 4 * 128 = 1024 floating point operations per work item
+  __kernel void fma_loop(__global T* data, uint n)
+  {
+    uint gid = get_global_id(0);
+    if(gid >= n)
+      return;
+
+    T x = data[gid];
+    T y = (T)1.0001f;
+    T z = (T)0.9999f;
+    T w = x;
+    for(int i = 0; i < 128; ++i)
+    {
+      x = fma(x, y, z);
+      y = fma(y, z, w);
+      z = fma(z, w, x);
+      w = fma(w, x, y);
+    }
+    data[gid] = x + y + z + w;
+  }
+  )"
+)
+
+class result_writer
+{
+public:
+  explicit result_writer(std::ostream& out)
+    : _out(out)
+  {
+    _out << "device_index,device,driver,benchmark,parameter,value,unit\n";
+  }
+
+  void set_device(std::size_t index, const qcl::device_context_ptr& ctx)
+  {
+    _device_index = index;
+    _device_name = quote(ctx->get_device_name());
+    _driver = quote(ctx->get_driver_version());
+  }
+
+  void write(const std::string& benchmark,
+             const std::string& parameter,
+             double value,
+             const std::string& unit)
+  {
+    _out << _device_index << ","
+         << _device_name << ","
+         << _driver << ","
+         << benchmark << ","
+         << quote(parameter) << ","
+         << value << ","
+         << unit << std::endl;
+  }
+private:
+  static std::string quote(const std::string& s)
+  {
+    std::string result = "\"";
+    for(char c : s)
+    {
+      if(c == '"')
+        result += '"';
+      result += c;
+    }
+    return result + "\"";
+  }
+
+  std::ostream& _out;
+  std::size_t _device_index = 0;
+  std::string _device_name;
+  std::string _driver;
+};
+
+using timer_clock = std::chrono::steady_clock;
+
+double get_seconds_since(const timer_clock::time_point& start)
+{
+  return std::chrono::duration<double>(timer_clock::now() - start).count();
+}
+
+/// \return The median of the run times of a function in seconds
+template<class Function>
+double time_median(std::size_t num_runs, Function f)
+{
+  std::vector<double> times;
+  for(std::size_t i = 0; i < num_runs; ++i)
+  {
+    timer_clock::time_point start = timer_clock::now();
+    f();
+    times.push_back(get_seconds_since(start));
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+std::string format_bytes(std::size_t num_bytes)
+{
+  std::stringstream sstr;
+  if(num_bytes >= (1 << 20))
+    sstr << (num_bytes >> 20) << "MiB";
+  else
+    sstr << (num_bytes >> 10) << "KiB";
+  return sstr.str();
+}
+
+void benchmark_launch_latency(const qcl::device_context_ptr& ctx,
+                              result_writer& results)
+{
+  qcl::device_array<float> data{ctx, 1024};
+  cl::CommandQueue& queue = ctx->get_command_queue();
+
+  // The first launch includes compiling the module and creating the kernel
+  timer_clock::time_point start = timer_clock::now();
+  qcl::check_cl_error(benchmark_module<float>::empty_kernel(ctx, cl::NDRange{1024},
+                                                            cl::NullRange)(data),
+                      "Could not enqueue kernel!");
+  queue.finish();
+  results.write("launch_latency", "cold", 1.e6 * get_seconds_since(start), "us");
+
+  const std::size_t num_launches = 1000;
+  double synchronous = time_median(num_launches, [&](){
+    benchmark_module<float>::empty_kernel(ctx, cl::NDRange{1024}, cl::NullRange)(data);
+    queue.finish();
+  });
+  results.write("launch_latency", "warm_synchronous", 1.e6 * synchronous, "us");
+
+  // The enqueue overhead on the host, without waiting for each kernel
+  start = timer_clock::now();
+  for(std::size_t i = 0; i < num_launches; ++i)
+    benchmark_module<float>::empty_kernel(ctx, cl::NDRange{1024}, cl::NullRange)(data);
+  double enqueue_time = get_seconds_since(start) / num_launches;
+  queue.finish();
+  results.write("launch_latency", "warm_enqueue", 1.e6 * enqueue_time, "us");
+}
+
+void benchmark_compilation(const qcl::device_context_ptr& ctx,
+                           result_writer& results)
+{
+  // A unique comment prevents hits in the program cache
+  std::stringstream unique_id;
+  unique_id << timer_clock::now().time_since_epoch().count();
+
+  std::string source = "// " + unique_id.str() + "\n" +
+      benchmark_module<float>::_qcl_source();
+  std::string program_name = "qcl_benchmark_program_" + unique_id.str();
+  std::vector<std::string> kernels{"vector_add", "fma_loop"};
+
+  timer_clock::time_point start = timer_clock::now();
+  ctx->register_source_code(source, kernels, program_name, program_name);
+  results.write("register_source_code", "uncached", 1.e3 * get_seconds_since(start), "ms");
+
+  // Registering the program under a different scope only creates the kernels
+  start = timer_clock::now();
+  ctx->register_source_code(source, kernels, program_name, program_name + "_cached");
+  results.write("register_source_code", "cached", 1.e3 * get_seconds_since(start), "ms");
+}
+
+void benchmark_transfers(const qcl::device_context_ptr& ctx,
+                         result_writer& results)
+{
+  const std::size_t num_runs = 10;
+  for(std::size_t num_bytes = 4 << 10; num_bytes <= (64 << 20); num_bytes *= 4)
+  {
+    std::size_t n = num_bytes / sizeof(float);
+    qcl::device_array<float> device_data{ctx, n};
+    std::vector<float> pageable(n, 1.f);
+    qcl::pinned_host_array<float> pinned{ctx, n};
+    std::fill(pinned.begin(), pinned.end(), 1.f);
+
+    double gigabytes = static_cast<double>(num_bytes) / 1.e9;
+
+    double t = time_median(num_runs, [&](){ device_data.write(pageable); });
+    results.write("h2d_bandwidth", "pageable_" + format_bytes(num_bytes), gigabytes / t, "GB/s");
+
+    t = time_median(num_runs, [&](){ device_data.read(pageable); });
+    results.write("d2h_bandwidth", "pageable_" + format_bytes(num_bytes), gigabytes / t, "GB/s");
+
+    t = time_median(num_runs, [&](){
+      cl::Event evt;
+      device_data.write_async(pinned, &evt);
+      evt.wait();
+    });
+    results.write("h2d_bandwidth", "pinned_" + format_bytes(num_bytes), gigabytes / t, "GB/s");
+
+    t = time_median(num_runs, [&](){
+      cl::Event evt;
+      device_data.read_async(pinned, &evt);
+      evt.wait();
+    });
+    results.write("d2h_bandwidth", "pinned_" + format_bytes(num_bytes), gigabytes / t, "GB/s");
+  }
+}
+
+void benchmark_allocation(const qcl::device_context_ptr& ctx,
+                          result_writer& results)
+{
+  const std::size_t num_runs = 100;
+  for(std::size_t num_bytes = 4 << 10; num_bytes <= (64 << 20); num_bytes *= 16)
+  {
+    double t = time_median(num_runs, [&](){
+      cl::Buffer buff;
+      ctx->create_buffer<float>(buff, num_bytes / sizeof(float));
+    });
+    results.write("create_buffer", format_bytes(num_bytes), 1.e6 * t, "us");
+  }
+}
+
+void benchmark_kernels(const qcl::device_context_ptr& ctx,
+                       result_writer& results)
+{
+  const std::size_t num_runs = 20;
+  const std::size_t n = 16 << 20;
+  cl::CommandQueue& queue = ctx->get_command_queue();
+
+  qcl::device_array<float> a{ctx, std::vector<float>(n, 1.f)};
+  qcl::device_array<float> b{ctx, std::vector<float>(n, 2.f)};
+  qcl::device_array<float> c{ctx, n};
+  // Warm up, i.e. compile the kernels
+  benchmark_module<float>::vector_add(ctx, cl::NDRange{n}, cl::NullRange)(
+        qcl::read_only(a), qcl::read_only(b), c, static_cast<cl_uint>(n));
+  benchmark_module<float>::fma_loop(ctx, cl::NDRange{n}, cl::NullRange)(
+        c, static_cast<cl_uint>(n));
+  qcl::reduce(a);
+  queue.finish();
+
+  double t = time_median(num_runs, [&](){
+    benchmark_module<float>::vector_add(ctx, cl::NDRange{n}, cl::NullRange)(
+          qcl::read_only(a), qcl::read_only(b), c, static_cast<cl_uint>(n));
+    queue.finish();
+  });
+  results.write("vector_add", "16M_float", 3. * n * sizeof(float) / t / 1.e9, "GB/s");
+
+  t = time_median(num_runs, [&](){
+    benchmark_module<float>::fma_loop(ctx, cl::NDRange{n}, cl::NullRange)(
+          c, static_cast<cl_uint>(n));
+    queue.finish();
+  });
+  results.write("fma_loop", "16M_float", 1024. * n / t / 1.e9, "GFLOP/s");
+
+  t = time_median(num_runs, [&](){ qcl::reduce(a); });
+  results.write("reduce", "16M_float", n * sizeof(float) / t / 1.e9, "GB/s");
+}
+
+int main(int argc, char** argv)
+{
+  qcl::environment env;
+
+  std::vector<std::string> preferred_platforms{"NVIDIA", "AMD", "Intel"};
+  if(argc > 1)
+    preferred_platforms = std::vector<std::string>{argv[1]};
+
+  cl::Platform platform = env.get_platform_by_preference(preferred_platforms);
+  qcl::global_context_ptr global_ctx = env.create_global_context(platform);
+
+  if(global_ctx->get_num_devices() == 0)
+  {
+    std::cerr << "No OpenCL devices available!" << std::endl;
+    return -1;
+  }
+
+  result_writer results{std::cout};
+
+  for(std::size_t i = 0; i < global_ctx->get_num_devices(); ++i)
+  {
+    qcl::device_context_ptr ctx = global_ctx->device(i);
+    results.set_device(i, ctx);
+
+    std::cerr << "Benchmarking device " << i << ": "
+              << ctx->get_device_name() << std::endl;
+
+    try
+    {
+      benchmark_launch_latency(ctx, results);
+      benchmark_compilation(ctx, results);
+      benchmark_transfers(ctx, results);
+      benchmark_allocation(ctx, results);
+      benchmark_kernels(ctx, results);
+    }
+    catch(std::exception& e)
+    {
+      std::cerr << "Benchmarking device " << i << " failed: "
+                << e.what() << std::endl;
+    }
+  }
+}
@@ -29,8 +29,14 @@
 #ifndef QCL_HPP
 #define QCL_HPP
 
+// The targeted OpenCL version can be raised by defining these macros
+// before including QCL, e.g. to 200 for shared virtual memory (qcl_svm.hpp)
+#ifndef CL_HPP_TARGET_OPENCL_VERSION
 #define CL_HPP_TARGET_OPENCL_VERSION 120
+#endif
+#ifndef CL_HPP_MINIMUM_OPENCL_VERSION
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#endif
 
 
 #include <CL/cl2.hpp>
@@ -55,12 +61,29 @@
 
 #include <sstream>
 #include <fstream>
+#include <iomanip>
 #include <memory>
 #include <string>
 #include <vector>
 #include <stdexcept>
 #include <map>
+#include <unordered_map>
+#include <list>
+#include <deque>
 #include <cassert>
+#include <thread>
+#include <exception>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <type_traits>
+#include <limits>
+#include <random>
+#include <algorithm>
 
 #include <boost/algorithm/string.hpp>
 
@@ -79,63 +102,436 @@ static void remove_zeros(std::string& s)
     s.erase(pos, 1);
 }
 
+/// Registry of the modules that can be included in the source of other
+/// modules. Modules are included via the \c $include$ meta command, which
+/// refers to modules by the id assigned in this registry. Thread-safe.
+class module_registry
+{
+public:
+  /// A function returning the source of a module, which may itself
+  /// contain meta commands
+  using source_function = std::string (*)();
+
+  struct entry
+  {
+    /// The name of the module
+    std::string name;
+    /// Returns the complete source of the module
+    source_function source;
+    /// Returns the interface of the module (see \c QCL_MODULE_INTERFACE()),
+    /// or \c nullptr if the module has no interface
+    source_function interface;
+  };
+
+  /// \return The global registry
+  static module_registry& get()
+  {
+    static module_registry registry;
+    return registry;
+  }
+
+  /// Registers a module.
+  /// \return The id of the module
+  /// \param name The name of the module
+  /// \param source The function returning the source of the module
+  /// \param interface The function returning the interface of the module,
+  /// or \c nullptr if the module has no interface
+  std::size_t add(const std::string& name,
+                  source_function source,
+                  source_function interface = nullptr)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _modules.push_back(entry{name, source, interface});
+    return _modules.size() - 1;
+  }
+
+  /// Looks up a module.
+  /// \return Whether a module with the given id exists
+  /// \param id The id of the module
+  /// \param module Will be set to the registered module
+  bool find(std::size_t id, entry& module) const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    if(id >= _modules.size())
+      return false;
+
+    module = _modules[id];
+    return true;
+  }
+private:
+  mutable std::mutex _mutex;
+  std::deque<entry> _modules;
+};
+
 /// The processor for the QCL meta language. This
 /// is particularly useful in conjunction with modules.
+/// Supported commands are
+/// * <tt>$pp command arguments$</tt>, which is turned into the preprocessor
+///   directive <tt>#command arguments</tt>
+/// * <tt>$include id$</tt>, which is replaced by the processed source of the
+///   module with the given id in the \c module_registry. Each module is
+///   emitted only once, at its first inclusion. Cyclic dependencies
+///   between modules are reported as error.
+/// The source is processed in a single pass, with included modules being
+/// expanded in place.
 class meta_source_processor
 {
 public:
-  std::string operator()(const std::string& source) const
+  /// Processes a source.
+  /// \return The processed source
+  /// \param source The source
+  /// \param separate_modules If not \c nullptr, included modules that have
+  /// an interface are replaced by their interface instead of their
+  /// complete source, and their ids are appended to this vector. These
+  /// modules must then be compiled separately and linked to the program.
+  std::string operator()(const std::string& source,
+                         std::vector<std::size_t>* separate_modules = nullptr) const
   {
     std::string result;
+    result.reserve(2 * source.size());
+
+    expansion_state state;
+    state.separate_modules = separate_modules;
+    process(source, state, result);
+    return result;
+  }
+private:
+  struct expansion_state
+  {
+    /// Receives the modules that are replaced by their interface,
+    /// \c nullptr if all modules are expanded completely
+    std::vector<std::size_t>* separate_modules = nullptr;
+    /// The ids of the modules that have already been emitted
+    std::vector<bool> emitted;
+    /// The modules currently being expanded, as pairs of id and name
+    std::vector<std::pair<std::size_t, std::string>> stack;
+  };
+
+  void process(const std::string& source,
+               expansion_state& state,
+               std::string& result) const
+  {
+    std::vector<std::string> elements;
 
     for(std::size_t i = 0; i < source.size();)
     {
-      if(source[i] == '$')
+      std::size_t command_begin = source.find('$', i);
+      if(command_begin == std::string::npos)
       {
-        // Find terminating $
-        std::size_t terminating_char = source.find('$', i+1);
-        if(terminating_char == std::string::npos)
-          throw std::invalid_argument{"Error processing QCL source: "
-                                      "Expected terminating $ for $ starting at ...\""
-                                      +source.substr(i)+"\""};
-        std::string command_string = source.substr(i+1, terminating_char-i-1);
-
-        std::vector<std::string> elements;
-        boost::algorithm::split(elements, command_string, boost::algorithm::is_any_of(" \t\n"));
-
-        if(elements.size() > 0)
+        result.append(source, i, std::string::npos);
+        break;
+      }
+      result.append(source, i, command_begin - i);
+
+      // Find terminating $
+      std::size_t terminating_char = source.find('$', command_begin+1);
+      if(terminating_char == std::string::npos)
+        throw std::invalid_argument{"Error processing QCL source: "
+                                    "Expected terminating $ for $ starting at ...\""
+                                    +source.substr(command_begin)+"\""};
+
+      split_command(source, command_begin + 1, terminating_char, elements);
+
+      if(elements.empty())
+        throw std::invalid_argument{"Error processing QCL source: Encountered "
+                                    "empty QCL meta command"};
+
+      if(elements[0] == "pp")
+      {
+        result += "\n#";
+        for(std::size_t j = 1; j < elements.size(); ++j)
         {
-          if(elements[0] == "pp")
-          {
-            result += "\n#";
-            for(std::size_t j = 1; j < elements.size(); ++j)
-            {
-              result += " ";
-              result += elements[j];
-            }
-            result += "\n";
-          }
-          else
-          {
-            throw std::invalid_argument{"Error processing QCL source: Encountered "
-                                        "invalid QCL meta command: "+elements[0]+
-                                        " (command string: "+command_string+")"};
-          }
+          result += " ";
+          result += elements[j];
         }
-
-        i = terminating_char + 1;
+        result += "\n";
       }
+      else if(elements[0] == "include" && elements.size() == 2)
+        include_module(elements[1], state, result);
       else
-      {
-        result += source[i];
+        throw std::invalid_argument{"Error processing QCL source: Encountered "
+                                    "invalid QCL meta command: "+elements[0]+
+                                    " (command string: "+
+                                    source.substr(command_begin + 1,
+                                                  terminating_char - command_begin - 1)+")"};
+
+      i = terminating_char + 1;
+    }
+  }
+
+  /// Splits the command in the range [begin, end) of the source
+  /// into its whitespace-separated elements
+  static void split_command(const std::string& source,
+                            std::size_t begin, std::size_t end,
+                            std::vector<std::string>& elements)
+  {
+    elements.clear();
+    for(std::size_t i = begin; i < end;)
+    {
+      while(i < end && is_whitespace(source[i]))
+        ++i;
+
+      std::size_t element_begin = i;
+      while(i < end && !is_whitespace(source[i]))
         ++i;
+
+      if(i > element_begin)
+        elements.push_back(source.substr(element_begin, i - element_begin));
+    }
+  }
+
+  static bool is_whitespace(char c)
+  {
+    return c == ' ' || c == '\t' || c == '\n';
+  }
+
+  void include_module(const std::string& id_string,
+                      expansion_state& state,
+                      std::string& result) const
+  {
+    std::size_t id = 0;
+    module_registry::entry module;
+    try
+    {
+      id = static_cast<std::size_t>(std::stoul(id_string));
+    }
+    catch(std::exception&)
+    {
+      throw std::invalid_argument{"Error processing QCL source: Invalid module id "
+                                  +id_string};
+    }
+    if(!module_registry::get().find(id, module))
+      throw std::invalid_argument{"Error processing QCL source: Unknown module id "
+                                  +id_string};
+
+    for(std::size_t i = 0; i < state.stack.size(); ++i)
+    {
+      if(state.stack[i].first == id)
+      {
+        std::string cycle;
+        for(std::size_t j = i; j < state.stack.size(); ++j)
+          cycle += state.stack[j].second + " -> ";
+        throw std::invalid_argument{"Error processing QCL source: Cyclic module "
+                                    "dependency: "+cycle+module.name};
       }
     }
-    return result;
 
+    if(id < state.emitted.size() && state.emitted[id])
+      return;
+
+    bool is_separate = state.separate_modules && module.interface;
+
+    state.stack.push_back(std::make_pair(id, module.name));
+    process(is_separate ? module.interface() : module.source(), state, result);
+    state.stack.pop_back();
+
+    if(is_separate)
+      state.separate_modules->push_back(id);
+
+    if(id >= state.emitted.size())
+      state.emitted.resize(id + 1, false);
+    state.emitted[id] = true;
   }
 };
 
+/// Computes the 64 bit FNV-1a hash of a string. Unlike \c std::hash,
+/// the result is guaranteed to be the same across processes and
+/// standard library implementations, which makes it suitable
+/// for naming files of persistent caches.
+static std::uint64_t fnv1a_hash(const std::string& data)
+{
+  std::uint64_t hash = 14695981039346656037ull;
+  for(unsigned char c : data)
+  {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/// \return The hexadecimal representation of a 64 bit value
+static std::string to_hex_string(std::uint64_t value)
+{
+  std::stringstream sstr;
+  sstr << std::hex;
+  sstr.width(16);
+  sstr.fill('0');
+  sstr << value;
+  return sstr.str();
+}
+
+/// \return A name for a temporary file in the directory of a given file.
+/// The name combines a random number, the time and a counter, such that
+/// concurrent threads and processes writing the same file never use the
+/// same temporary file.
+/// \param filename The file which the temporary file will replace
+static std::string get_temporary_filename(const std::string& filename)
+{
+  static std::atomic<std::uint64_t> counter{0};
+
+  std::random_device random;
+  std::uint64_t nonce = (static_cast<std::uint64_t>(random()) << 32) ^ random();
+  std::uint64_t time = static_cast<std::uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+
+  return filename + "." + to_hex_string(nonce ^ time)
+      + "." + to_hex_string(counter++) + ".tmp";
+}
+
+/// \return A new process-wide unique id. These ids identify the entrypoints
+/// of QCL modules and are used as indices into the per-context entrypoint
+/// kernel tables. This function must not have internal linkage, otherwise
+/// ids allocated in different translation units would collide.
+inline std::size_t allocate_entrypoint_id()
+{
+  static std::atomic<std::size_t> next_id{0};
+  return next_id++;
+}
+
+/// Stores compiled program binaries in a directory on disk. Each entry
+/// is identified by a key string, which must contain everything that
+/// influences the compiled binary (e.g. the full source code, not just
+/// a hash of it). The file name of an entry is derived from a hash of the
+/// key, and the key is stored in the entry itself, such that hash
+/// collisions of file names and truncated or otherwise corrupt files are
+/// detected when the entry is loaded. Colliding keys overwrite each
+/// other's entries, which only causes cache misses.
+class program_binary_cache
+{
+public:
+  /// \param directory The directory in which the cache entries
+  /// are stored. The directory must already exist.
+  explicit program_binary_cache(const std::string& directory)
+    : _directory{directory}
+  {}
+
+  /// \return The cache directory
+  const std::string& get_directory() const
+  {
+    return _directory;
+  }
+
+  /// Looks up a cache entry.
+  /// \return Whether a valid entry for the key was found
+  /// \param key The key of the entry
+  /// \param binaries Will contain the program binaries (one per device),
+  /// if an entry was found.
+  bool load(const std::string& key,
+            std::vector<std::vector<unsigned char>>& binaries) const
+  {
+    std::ifstream file(get_entry_filename(key).c_str(), std::ios::binary);
+    if(!file.is_open())
+      return false;
+
+    const std::string expected_magic = get_magic();
+    std::string magic(expected_magic.size(), '\0');
+    file.read(&magic[0], magic.size());
+    if(!file || magic != expected_magic)
+      return false;
+
+    std::uint64_t key_size = 0;
+    file.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+    if(!file || key_size != key.size())
+      return false;
+
+    std::string stored_key(key.size(), '\0');
+    file.read(&stored_key[0], stored_key.size());
+    if(!file || stored_key != key)
+      return false;
+
+    std::uint64_t num_binaries = 0;
+    file.read(reinterpret_cast<char*>(&num_binaries), sizeof(num_binaries));
+    if(!file || num_binaries == 0)
+      return false;
+
+    binaries.clear();
+    for(std::uint64_t i = 0; i < num_binaries; ++i)
+    {
+      std::uint64_t binary_size = 0;
+      file.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size));
+      if(!file || binary_size == 0)
+        return false;
+
+      std::vector<unsigned char> binary(binary_size);
+      file.read(reinterpret_cast<char*>(binary.data()), binary.size());
+      if(!file)
+        return false;
+
+      binaries.push_back(std::move(binary));
+    }
+
+    return file.peek() == std::ifstream::traits_type::eof();
+  }
+
+  /// Stores a cache entry. The entry is first written to a temporary
+  /// file and then moved to its final location, such that concurrently
+  /// running processes never observe partially written entries.
+  /// Failures to write the entry are ignored, since they only
+  /// cause a cache miss later on.
+  /// \param key The key of the entry
+  /// \param binaries The program binaries (one per device)
+  void store(const std::string& key,
+             const std::vector<std::vector<unsigned char>>& binaries) const
+  {
+    if(binaries.empty())
+      return;
+    for(const std::vector<unsigned char>& binary : binaries)
+      if(binary.empty())
+        return;
+
+    std::string filename = get_entry_filename(key);
+    std::string temp_filename = get_temporary_filename(filename);
+    {
+      std::ofstream file(temp_filename.c_str(), std::ios::binary | std::ios::trunc);
+      if(!file.is_open())
+        return;
+
+      const std::string magic = get_magic();
+      std::uint64_t key_size = key.size();
+      std::uint64_t num_binaries = binaries.size();
+
+      file.write(magic.data(), magic.size());
+      file.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+      file.write(key.data(), key.size());
+      file.write(reinterpret_cast<const char*>(&num_binaries), sizeof(num_binaries));
+      for(const std::vector<unsigned char>& binary : binaries)
+      {
+        std::uint64_t binary_size = binary.size();
+        file.write(reinterpret_cast<const char*>(&binary_size), sizeof(binary_size));
+        file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+      }
+
+      if(!file)
+      {
+        file.close();
+        std::remove(temp_filename.c_str());
+        return;
+      }
+    }
+
+    if(std::rename(temp_filename.c_str(), filename.c_str()) != 0)
+      std::remove(temp_filename.c_str());
+  }
+
+private:
+  std::string get_entry_filename(const std::string& key) const
+  {
+    std::string filename = _directory;
+    if(!filename.empty() && filename.back() != '/')
+      filename += "/";
+    return filename + "qcl_" + to_hex_string(fnv1a_hash(key)) + ".bin";
+  }
+
+  /// Identifies files as QCL binary cache entries and versions
+  /// the file format.
+  static std::string get_magic()
+  {
+    return "QCLBIN02";
+  }
+
+  std::string _directory;
+};
+
 }
 
 /// Class representing OpenCL errors that are encountered by QCL.
@@ -232,169 +628,1890 @@ private:
 template<class T>
 class device_array;
 
-namespace detail {
+template<class T, std::size_t Dim>
+class device_array_nd;
 
+template<class T, std::size_t Dim>
+class device_image_nd;
 
-/// Set of overloads to allow passing
-/// QCL memory wrapper objects directly as kernel arguments
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
 template<class T>
-cl_int set_kernel_arg(std::size_t pos,
-                      const kernel_ptr& kernel,
-                      const T& data)
-{ return kernel->setArg(pos, data); }
+class svm_array;
+#endif
 
+/// Marks a \c device_array kernel argument as only being read by the kernel.
+/// By default, kernels are assumed to read and write all \c device_array
+/// arguments. Kernels that only read an array can run concurrently with other
+/// commands reading the array. Example:
+/// \code
+/// my_module::my_kernel(ctx, work, group)(qcl::read_only(input), output);
+/// \endcode
 template<class T>
-cl_int set_kernel_arg(std::size_t pos,
-                      const kernel_ptr& kernel,
-                      const local_memory<T>& local_mem)
-{ return kernel->setArg(pos, local_mem.get_size(), nullptr); }
+class read_only_array
+{
+public:
+  explicit read_only_array(const device_array<T>& array)
+    : _array(array)
+  {}
 
-template<class T>
-cl_int set_kernel_arg(std::size_t pos,
-                      const kernel_ptr &kernel,
-                      const raw_memory<T> &mem)
-{ return kernel->setArg(pos, mem.get_data(), mem.get_size()); }
+  const device_array<T>& get_array() const
+  {
+    return _array;
+  }
+private:
+  const device_array<T>& _array;
+};
 
+/// \return A kernel argument that marks an array as only being read by
+/// the kernel, see \c read_only_array.
 template<class T>
-cl_int set_kernel_arg(std::size_t pos,
-                      const kernel_ptr& kernel,
-                      const device_array<T>& array);
+read_only_array<T> read_only(const device_array<T>& array)
+{
+  return read_only_array<T>{array};
+}
 
-} // detail
+namespace detail {
 
-/// This class simplifies passing arguments to kernels
-/// by counting the argument index automatically.
-class kernel_argument_list
+/// Tracks the commands accessing a buffer: The commands writing to
+/// the buffer and the commands reading it since then. New commands can
+/// thereby wait for exactly the commands they conflict with. A tracker
+/// can also be created for a range of a buffer tracked by another tracker
+/// (e.g. for a view of an array). Commands tracked by such trackers only
+/// conflict with each other if their ranges overlap. Thread-safe.
+class access_tracker
 {
 public:
-  /// Construct object
-  /// \param kernel The kernel for which the arguments shall
-  /// be set
-  explicit kernel_argument_list(const kernel_ptr& kernel)
-    : _kernel(kernel), _num_arguments()
-  {
-    assert(kernel != nullptr);
-  }
+  /// Creates a tracker for a whole buffer
+  access_tracker()
+    : _domain{std::make_shared<domain>()},
+      _begin{0},
+      _end{std::numeric_limits<std::size_t>::max()}
+  {}
 
-  /// Pass argument to the kernel.
-  /// \return The OpenCL error code
-  /// \param data The kernel argument
-  template<class T>
-  cl_int push(const T& data)
+  /// Creates a tracker for a range of the buffer tracked by another tracker.
+  /// \param parent The tracker of the buffer
+  /// \param begin The beginning of the range, relative to the tracker of the
+  /// whole buffer. The unit (e.g. bytes or elements) is arbitrary, but must
+  /// be the same for all trackers of the buffer.
+  /// \param end The end of the range
+  access_tracker(const access_tracker& parent,
+                 std::size_t begin,
+                 std::size_t end)
+    : _domain{parent._domain}, _begin{begin}, _end{end}
   {
-    cl_int err = detail::set_kernel_arg(_num_arguments,
-                                        _kernel, data);
-
-    ++_num_arguments;
-    return err;
+    assert(begin < end);
   }
 
-  /// Pass argument to the kernel.
-  /// \return The OpenCL error code
-  /// \param data The kernel argument
-  /// \param size The size in bytes of the argument
-  cl_int push(const void* data, std::size_t size)
+  /// Appends the events a command reading the buffer must wait for
+  /// \param dependencies The events will be appended to this vector
+  void get_read_dependencies(std::vector<cl::Event>& dependencies) const
   {
-    cl_int err = _kernel->setArg(_num_arguments, size, data);
-
-    ++_num_arguments;
-    return err;
+    std::lock_guard<std::mutex> lock{_domain->mutex};
+    for(const access& a : _domain->accesses)
+      if(a.is_write && overlaps(a))
+        dependencies.push_back(a.evt);
   }
 
-  /// \return The number of arguments that have been set
-  unsigned get_num_pushed_arguments() const noexcept
+  /// Appends the events a command writing the buffer must wait for
+  /// \param dependencies The events will be appended to this vector
+  void get_write_dependencies(std::vector<cl::Event>& dependencies) const
   {
-    return _num_arguments;
+    std::lock_guard<std::mutex> lock{_domain->mutex};
+    for(const access& a : _domain->accesses)
+      if(overlaps(a))
+        dependencies.push_back(a.evt);
   }
 
-  /// Resets the argument counter, hence allowing to set
-  /// kernel arguments again.
-  void reset()
+  /// Registers a command reading the buffer
+  /// \param evt The event of the command
+  void record_read(const cl::Event& evt)
   {
-    _num_arguments = 0;
+    std::lock_guard<std::mutex> lock{_domain->mutex};
+    record(evt, false);
   }
 
-private:
-  kernel_ptr _kernel;
-  unsigned _num_arguments;
-};
-
-
+  /// Registers a command writing the buffer. Since the command waits
+  /// for all previous accesses of its range, accesses within the range
+  /// need not be tracked any longer.
+  /// \param evt The event of the command
+  void record_write(const cl::Event& evt)
+  {
+    std::lock_guard<std::mutex> lock{_domain->mutex};
 
+    std::vector<access>& accesses = _domain->accesses;
+    accesses.erase(std::remove_if(accesses.begin(), accesses.end(),
+                                  [this](const access& a)
+    {
+      return a.begin >= _begin && a.end <= _end;
+    }), accesses.end());
+    record(evt, true);
+  }
 
-/// Represents the OpenCL context of a device. This class contains everything
-/// that is needed to execute OpenCL commands on a device. It stores one cl::Context,
-/// at least one cl::CommandQueue and a number of kernels that have been compiled for the device.
-class device_context
-{
-public:
-  /// Create NULL object
-  device_context()
-  {}
-  
-  /// \param platform The OpenCL platform to which the device belongs
-  /// \param device The OpenCL device to which the instance shall be bound
-  device_context(const cl::Platform& platform, const cl::Device& device)
-  : _device(device)
+  /// Appends the events of all tracked commands
+  /// \param events The events will be appended to this vector
+  void get_pending_events(std::vector<cl::Event>& events) const
   {
-    cl_int err;
-    cl_context_properties cprops[3] = 
-      {CL_CONTEXT_PLATFORM, (cl_context_properties)platform(), 0};
-     
-    _context = cl::Context(
-       device, 
-       cprops,
-       NULL,
-       NULL,
-       &err);
-    
-    check_cl_error(err, "Could not spawn CL context!");
-    
-    init_device();
+    get_write_dependencies(events);
   }
-  
-  /// Create object from existing cl context and a given device
-  device_context(const cl::Context& context, const cl::Device& device)
-  : _context(context), _device(device)
+
+  /// Blocks until all tracked commands have completed
+  void wait() const
   {
-    init_device();
+    std::vector<cl::Event> events;
+    get_pending_events(events);
+    if(!events.empty())
+      check_cl_error(cl::Event::waitForEvents(events),
+                     "Could not wait for buffer accesses!");
   }
-  
-  device_context(const device_context& other) = delete;
-  device_context& operator=(const device_context& other) = delete;
-  
-  /// \return The device that is accessed by this context
-  const cl::Device& get_device() const
+private:
+  /// A tracked command
+  struct access
   {
-    return _device;
-  }
-  
-  /// \return The underlying OpenCL context
-  const cl::Context& get_context() const
+    cl::Event evt;
+    std::size_t begin;
+    std::size_t end;
+    bool is_write;
+  };
+
+  /// The accesses of a buffer, shared by all trackers of the buffer
+  struct domain
   {
-    return _context;
-  }
-  
-  /// \return The underlying OpenCL command queue
-  /// \param queue The id of the command queue. The id must be greater or
-  /// equal than 0 and smaller than \c get_num_command_queues().
-  const cl::CommandQueue& get_command_queue(command_queue_id queue) const
+    std::mutex mutex;
+    std::vector<access> accesses;
+  };
+
+  static std::size_t get_max_pending_accesses()
+  { return 16; }
+
+  bool overlaps(const access& a) const
   {
-    assert(queue < _queues.size());
-    return _queues[queue];
+    return a.begin < _end && _begin < a.end;
   }
 
-  /// \return The underlying OpenCL command queue
-  /// \param queue The id of the command queue. The id must be greater or
-  /// equal than 0 and smaller than \c get_num_command_queues().
-  cl::CommandQueue& get_command_queue(command_queue_id queue)
+  /// Must be called with the mutex of the domain held
+  void record(const cl::Event& evt, bool is_write)
   {
-    assert(queue < _queues.size());
-    return _queues[queue];
+    std::vector<access>& accesses = _domain->accesses;
+    if(accesses.size() >= get_max_pending_accesses())
+      remove_completed();
+    accesses.push_back(access{evt, _begin, _end, is_write});
   }
 
-  /// \return The underlying OpenCL command queue
-  const cl::CommandQueue& get_command_queue() const
+  /// Must be called with the mutex of the domain held
+  void remove_completed()
+  {
+    std::vector<access>& accesses = _domain->accesses;
+    accesses.erase(std::remove_if(accesses.begin(), accesses.end(),
+                                  [](const access& a)
+    {
+      cl_int status = CL_QUEUED;
+      a.evt.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &status);
+      return status == CL_COMPLETE;
+    }), accesses.end());
+  }
+
+  std::shared_ptr<domain> _domain;
+  std::size_t _begin;
+  std::size_t _end;
+};
+
+/// A tracked buffer accessed by a kernel
+struct tracked_access
+{
+  std::shared_ptr<access_tracker> tracker;
+  bool is_write;
+};
+
+/// Set of overloads that collect the tracked buffers among kernel arguments.
+/// Other arguments are not tracked.
+template<class T>
+void collect_tracked_access(const T&, std::vector<tracked_access>&)
+{}
+
+template<class T>
+void collect_tracked_access(const device_array<T>& array,
+                            std::vector<tracked_access>& accesses);
+
+template<class T>
+void collect_tracked_access(const read_only_array<T>& array,
+                            std::vector<tracked_access>& accesses);
+
+template<class T, std::size_t Dim>
+void collect_tracked_access(const device_array_nd<T, Dim>& array,
+                            std::vector<tracked_access>& accesses);
+
+template<class T, std::size_t Dim>
+void collect_tracked_access(const device_image_nd<T, Dim>& image,
+                            std::vector<tracked_access>& accesses);
+
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+template<class T>
+void collect_tracked_access(const svm_array<T>& array,
+                            std::vector<tracked_access>& accesses);
+#endif
+
+
+/// Set of overloads to allow passing
+/// QCL memory wrapper objects directly as kernel arguments
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr& kernel,
+                      const T& data)
+{ return kernel->setArg(pos, data); }
+
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr& kernel,
+                      const local_memory<T>& local_mem)
+{ return kernel->setArg(pos, local_mem.get_size(), nullptr); }
+
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr &kernel,
+                      const raw_memory<T> &mem)
+{ return kernel->setArg(pos, mem.get_data(), mem.get_size()); }
+
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr& kernel,
+                      const device_array<T>& array);
+
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr& kernel,
+                      const read_only_array<T>& array)
+{ return set_kernel_arg(pos, kernel, array.get_array()); }
+
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr& kernel,
+                      const svm_array<T>& array);
+#endif
+
+/// The value of a kernel argument as a sequence of bytes, see
+/// \c get_kernel_arg_identity()
+struct kernel_arg_identity
+{
+  std::vector<unsigned char> bytes;
+  /// The handle of the memory object of memory arguments, or \c nullptr.
+  /// Memory objects are retained by the \c kernel_argument_cache while
+  /// their identity is stored, such that a different memory object
+  /// cannot reuse the handle in the meantime.
+  cl_mem memory = nullptr;
+};
+
+/// Stores the bytes of an object as the identity of a kernel argument
+template<class T>
+void assign_kernel_arg_identity(const T& data, kernel_arg_identity& identity)
+{
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&data);
+  identity.bytes.assign(bytes, bytes + sizeof(T));
+  identity.memory = nullptr;
+}
+
+/// Memory objects are identified by their handle
+template<class T>
+bool get_plain_kernel_arg_identity(const T& data,
+                                   kernel_arg_identity& identity,
+                                   std::true_type /* is memory object */)
+{
+  assign_kernel_arg_identity(data(), identity);
+  identity.memory = data();
+  return true;
+}
+
+/// Scalars and vector types are identified by their bytes. Other
+/// objects, e.g. samplers, cannot be identified.
+template<class T>
+bool get_plain_kernel_arg_identity(const T& data,
+                                   kernel_arg_identity& identity,
+                                   std::false_type /* is memory object */)
+{
+  if(!std::is_trivially_copyable<T>::value)
+    return false;
+
+  assign_kernel_arg_identity(data, identity);
+  return true;
+}
+
+/// Set of overloads that describe the value of a kernel argument as
+/// a sequence of bytes (the identity), such that arguments which have
+/// already been set can be detected. Two arguments with the same identity
+/// result in the same kernel argument.
+/// \return Whether the argument could be identified. Arguments that
+/// cannot be identified must always be set.
+template<class T>
+bool get_kernel_arg_identity(const T& data,
+                             kernel_arg_identity& identity)
+{
+  return get_plain_kernel_arg_identity(data, identity,
+                                       typename std::is_base_of<cl::Memory, T>::type());
+}
+
+template<class T>
+bool get_kernel_arg_identity(const local_memory<T>& local_mem,
+                             kernel_arg_identity& identity)
+{
+  assign_kernel_arg_identity(local_mem.get_size(), identity);
+  return true;
+}
+
+template<class T>
+bool get_kernel_arg_identity(const raw_memory<T>& mem,
+                             kernel_arg_identity& identity)
+{
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(mem.get_data());
+  identity.bytes.assign(bytes, bytes + mem.get_size());
+  identity.memory = nullptr;
+  return true;
+}
+
+template<class T>
+bool get_kernel_arg_identity(const device_array<T>& array,
+                             kernel_arg_identity& identity);
+
+template<class T>
+bool get_kernel_arg_identity(const read_only_array<T>& array,
+                             kernel_arg_identity& identity)
+{ return get_kernel_arg_identity(array.get_array(), identity); }
+
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+template<class T>
+bool get_kernel_arg_identity(const svm_array<T>& array,
+                             kernel_arg_identity& identity);
+#endif
+
+/// Remembers the arguments that have last been set for a kernel object,
+/// such that \c kernel_argument_list can skip setting arguments that
+/// have not changed. Arguments must only be set through the
+/// \c kernel_argument_list using the cache, otherwise the cache
+/// becomes stale. Memory objects bound to the kernel are kept alive by
+/// the cache until their argument is replaced, hence their memory is only
+/// freed once the kernel uses a different argument.
+class kernel_argument_cache
+{
+public:
+  /// \return Whether the argument at a given position is known
+  /// to have been set to a value with the given identity
+  bool is_bound(std::size_t pos, const kernel_arg_identity& identity) const
+  {
+    return pos < _is_known.size() && _is_known[pos] && _values[pos] == identity.bytes;
+  }
+
+  /// Remembers that the argument at a given position has been set
+  /// to a value with the given identity. Memory objects are retained
+  /// until the argument is set to a different value.
+  void store(std::size_t pos, const kernel_arg_identity& identity)
+  {
+    if(pos >= _values.size())
+    {
+      _values.resize(pos + 1);
+      _memory.resize(pos + 1);
+      _is_known.resize(pos + 1, false);
+    }
+    _values[pos] = identity.bytes;
+    if(identity.memory)
+      _memory[pos] = cl::Memory(identity.memory, true);
+    else
+      _memory[pos] = cl::Memory();
+    _is_known[pos] = true;
+  }
+
+  /// Forgets the argument at a given position
+  void invalidate(std::size_t pos)
+  {
+    if(pos < _is_known.size())
+    {
+      _is_known[pos] = false;
+      _memory[pos] = cl::Memory();
+    }
+  }
+
+  /// Forgets all arguments
+  void clear()
+  {
+    _is_known.assign(_is_known.size(), false);
+    _memory.assign(_memory.size(), cl::Memory());
+  }
+
+  /// \return Storage that can be reused to compute identities
+  kernel_arg_identity& get_scratch()
+  {
+    return _scratch;
+  }
+
+  /// \return Storage for the tracked accesses of a launch of the kernel,
+  /// which is lent to \c kernel_call objects such that repeated launches
+  /// do not allocate memory
+  std::vector<tracked_access>& get_access_scratch()
+  {
+    return _access_scratch;
+  }
+
+  /// \return Storage for the dependencies of a launch of the kernel,
+  /// see \c get_access_scratch()
+  std::vector<cl::Event>& get_dependency_scratch()
+  {
+    return _dependency_scratch;
+  }
+private:
+  std::vector<std::vector<unsigned char>> _values;
+  /// The retained memory objects of memory arguments, which guarantees
+  /// that the handles stored in \c _values identify a unique object
+  std::vector<cl::Memory> _memory;
+  std::vector<bool> _is_known;
+  kernel_arg_identity _scratch;
+  std::vector<tracked_access> _access_scratch;
+  std::vector<cl::Event> _dependency_scratch;
+};
+
+/// A kernel object together with the cache of its arguments
+struct kernel_instance
+{
+  kernel_ptr kernel;
+  std::shared_ptr<kernel_argument_cache> arguments;
+  /// The scoped name of the kernel, or \c nullptr if unknown
+  std::shared_ptr<const std::string> name;
+};
+
+/// \return A new kernel instance with an empty argument cache
+/// \param kernel The kernel object
+/// \param name The scoped name of the kernel, or \c nullptr
+inline kernel_instance make_kernel_instance(const kernel_ptr& kernel,
+                                            const std::shared_ptr<const std::string>& name = nullptr)
+{
+  kernel_instance instance;
+  instance.kernel = kernel;
+  instance.arguments = std::make_shared<kernel_argument_cache>();
+  instance.name = name;
+  return instance;
+}
+
+/// Creates a new kernel object for the same kernel function and program as
+/// an existing kernel object. Kernel arguments are not copied, unless the
+/// kernel can be cloned with \c clCloneKernel (OpenCL 2.1).
+/// \return The new kernel object
+/// \param kernel The existing kernel
+inline kernel_ptr create_kernel_instance(const cl::Kernel& kernel)
+{
+  cl_int err;
+#if CL_HPP_TARGET_OPENCL_VERSION >= 210
+  kernel_ptr instance = kernel_ptr(new cl::Kernel(kernel.clone(&err)));
+  check_cl_error(err, "Could not clone kernel object!");
+#else
+  cl::Program program;
+  check_cl_error(kernel.getInfo(CL_KERNEL_PROGRAM, &program),
+                 "Could not query program of kernel!");
+
+  std::string kernel_name;
+  check_cl_error(kernel.getInfo(CL_KERNEL_FUNCTION_NAME, &kernel_name),
+                 "Could not query kernel name!");
+  remove_zeros(kernel_name);
+
+  kernel_ptr instance = kernel_ptr(new cl::Kernel(program, kernel_name.c_str(), &err));
+  check_cl_error(err, "Could not create kernel object!");
+#endif
+  return instance;
+}
+
+/// A pool of kernel objects of the same kernel function. Since the arguments
+/// of a kernel are stored in the kernel object, a kernel object cannot be used
+/// by several threads at the same time. Threads can instead acquire kernel
+/// objects from this pool. The pool grows until there is one instance for each
+/// concurrently running launch.
+class kernel_instance_pool
+{
+public:
+  /// \param prototype The kernel from which new instances are created
+  /// \param name The scoped name of the kernel, or \c nullptr
+  explicit kernel_instance_pool(const kernel_ptr& prototype,
+                                const std::shared_ptr<const std::string>& name = nullptr)
+    : _prototype{prototype}, _name{name}
+  {
+    assert(prototype != nullptr);
+  }
+
+  kernel_instance_pool(const kernel_instance_pool&) = delete;
+  kernel_instance_pool& operator=(const kernel_instance_pool&) = delete;
+
+  /// \return A kernel instance that is exclusively owned by the caller
+  /// until it is returned with \c release(). The argument cache of the
+  /// instance remembers the arguments of its previous use.
+  kernel_instance acquire()
+  {
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      if(!_idle.empty())
+      {
+        kernel_instance instance = std::move(_idle.back());
+        _idle.pop_back();
+        return instance;
+      }
+    }
+    return make_kernel_instance(create_kernel_instance(*_prototype), _name);
+  }
+
+  /// Returns a kernel instance to the pool
+  /// \param instance A kernel instance that has been obtained from \c acquire()
+  void release(kernel_instance instance)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _idle.push_back(std::move(instance));
+  }
+private:
+  kernel_ptr _prototype;
+  std::shared_ptr<const std::string> _name;
+
+  std::mutex _mutex;
+  std::vector<kernel_instance> _idle;
+};
+
+/// A module compiled into an object for separate compilation
+struct compiled_module
+{
+  /// The compiled, but not yet linked program
+  cl::Program object;
+  /// The ids of the separately compiled modules this module depends on
+  std::vector<std::size_t> dependencies;
+};
+
+/// The compiled programs of an OpenCL context, stored under their program
+/// names. Programs that are still being compiled are represented by futures
+/// that are not yet ready. A program cache can be shared by several device
+/// contexts that use the same \c cl::Context, in which case each program is
+/// built only once for all devices of the cache.
+struct program_cache
+{
+  explicit program_cache(const std::vector<cl::Device>& program_devices)
+    : devices{program_devices}
+  {}
+
+  /// The devices for which programs are built
+  const std::vector<cl::Device> devices;
+
+  /// Protects \c programs and \c modules
+  std::mutex mutex;
+  std::map<std::string, std::shared_future<cl::Program>> programs;
+  /// The separately compiled modules by module id and the key of the
+  /// specialization they have been compiled for (empty if unspecialized),
+  /// see \c specialization::get_key()
+  std::map<std::pair<std::size_t, std::string>,
+           std::shared_future<compiled_module>> modules;
+
+  /// The number of device contexts that hold each specialized program in
+  /// their cache of specializations, by program name. A specialized program
+  /// is only removed from \c programs once no device context uses it.
+  std::map<std::string, std::size_t> specialized_program_users;
+  /// The number of specialized programs held by device contexts for each
+  /// specialization key. Modules compiled for a specialization are only
+  /// removed from \c modules once no specialized program uses the key.
+  std::map<std::string, std::size_t> specialization_key_users;
+};
+
+/// The data stored in a device context for a module entrypoint
+struct entrypoint_kernel
+{
+  /// The kernel object shared by all calls. This is a private
+  /// instance of the registered kernel, such that its arguments
+  /// are only set by calls of the entrypoint.
+  kernel_ptr kernel;
+  /// The argument cache of \c kernel
+  std::shared_ptr<kernel_argument_cache> arguments;
+  /// The kernel instances used for thread-safe launches,
+  /// or \c nullptr if thread-safe launches are disabled.
+  std::shared_ptr<kernel_instance_pool> instances;
+  /// The scoped name of the kernel, used by the profiler and the autotuner
+  std::shared_ptr<const std::string> name;
+};
+
+} // detail
+
+/// This class simplifies passing arguments to kernels
+/// by counting the argument index automatically.
+class kernel_argument_list
+{
+public:
+  /// Construct object
+  /// \param kernel The kernel for which the arguments shall
+  /// be set
+  explicit kernel_argument_list(const kernel_ptr& kernel)
+    : _kernel(kernel), _num_arguments()
+  {
+    assert(kernel != nullptr);
+  }
+
+  /// Construct object that skips setting arguments which are
+  /// unchanged since the last time they have been set.
+  /// \param kernel The kernel for which the arguments shall
+  /// be set
+  /// \param arguments The cache of the arguments of \c kernel. All arguments
+  /// of the kernel must be set through argument lists using this cache.
+  /// If \c nullptr, all arguments are always set.
+  kernel_argument_list(const kernel_ptr& kernel,
+                       const std::shared_ptr<detail::kernel_argument_cache>& arguments)
+    : _kernel(kernel), _arguments(arguments), _num_arguments()
+  {
+    assert(kernel != nullptr);
+  }
+
+  /// Pass argument to the kernel. If the argument is known to be set
+  /// to the same value already, the kernel object is not modified.
+  /// \return The OpenCL error code
+  /// \param data The kernel argument
+  template<class T>
+  cl_int push(const T& data)
+  {
+    cl_int err = CL_SUCCESS;
+
+    if(_arguments &&
+       detail::get_kernel_arg_identity(data, _arguments->get_scratch()))
+    {
+      const detail::kernel_arg_identity& identity = _arguments->get_scratch();
+      if(!_arguments->is_bound(_num_arguments, identity))
+      {
+        err = detail::set_kernel_arg(_num_arguments, _kernel, data);
+        update_cache(err, identity);
+      }
+    }
+    else
+    {
+      err = detail::set_kernel_arg(_num_arguments, _kernel, data);
+      if(_arguments)
+        _arguments->invalidate(_num_arguments);
+    }
+
+    ++_num_arguments;
+    return err;
+  }
+
+  /// Pass argument to the kernel.
+  /// \return The OpenCL error code
+  /// \param data The kernel argument
+  /// \param size The size in bytes of the argument
+  cl_int push(const void* data, std::size_t size)
+  {
+    cl_int err = CL_SUCCESS;
+
+    if(_arguments)
+    {
+      detail::kernel_arg_identity& identity = _arguments->get_scratch();
+      const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+      if(data)
+      {
+        identity.bytes.assign(bytes, bytes + size);
+        identity.memory = nullptr;
+      }
+      else
+        detail::assign_kernel_arg_identity(size, identity);
+
+      if(!_arguments->is_bound(_num_arguments, identity))
+      {
+        err = _kernel->setArg(_num_arguments, size, data);
+        update_cache(err, identity);
+      }
+    }
+    else
+      err = _kernel->setArg(_num_arguments, size, data);
+
+    ++_num_arguments;
+    return err;
+  }
+
+  /// \return The number of arguments that have been set
+  unsigned get_num_pushed_arguments() const noexcept
+  {
+    return _num_arguments;
+  }
+
+  /// Resets the argument counter, hence allowing to set
+  /// kernel arguments again.
+  void reset()
+  {
+    _num_arguments = 0;
+  }
+
+  /// Sets the argument counter, such that the next pushed argument
+  /// is the argument with the given index.
+  /// \param argument_index The index of the next argument
+  void reset(unsigned argument_index)
+  {
+    _num_arguments = argument_index;
+  }
+
+private:
+  void update_cache(cl_int err, const detail::kernel_arg_identity& identity)
+  {
+    if(err == CL_SUCCESS)
+      _arguments->store(_num_arguments, identity);
+    else
+      _arguments->invalidate(_num_arguments);
+  }
+
+  kernel_ptr _kernel;
+  std::shared_ptr<detail::kernel_argument_cache> _arguments;
+  unsigned _num_arguments;
+};
+
+namespace detail {
+
+/// Set of overloads that push a kernel argument to an argument list.
+/// Most arguments occupy exactly one kernel argument, but some QCL objects
+/// expand to several kernel arguments, e.g. a \c device_array_nd is passed
+/// as buffer followed by its pitches.
+/// \return The OpenCL error code
+template<class T>
+cl_int push_kernel_argument(kernel_argument_list& args, const T& data)
+{ return args.push(data); }
+
+template<class T, std::size_t Dim>
+cl_int push_kernel_argument(kernel_argument_list& args,
+                            const device_array_nd<T, Dim>& array);
+
+template<class T, std::size_t Dim>
+cl_int push_kernel_argument(kernel_argument_list& args,
+                            const device_image_nd<T, Dim>& image);
+
+} // detail
+
+
+
+
+/// Statistics of a \c memory_pool
+struct memory_pool_statistics
+{
+  /// The number of allocation requests
+  std::size_t num_requests = 0;
+  /// The number of requests that could be served from cached buffers
+  std::size_t num_hits = 0;
+  /// The number of bytes held by buffers that are currently in use
+  std::size_t bytes_in_use = 0;
+  /// The number of bytes held by cached buffers that are not in use
+  std::size_t bytes_cached = 0;
+  /// The maximum number of bytes that the pool has held at any
+  /// time, i.e. the peak of \c bytes_in_use + \c bytes_cached
+  std::size_t high_water_mark = 0;
+
+  /// \return The fraction of requests that could be served from
+  /// cached buffers
+  double hit_rate() const
+  {
+    if(num_requests == 0)
+      return 0.0;
+    return static_cast<double>(num_hits) / static_cast<double>(num_requests);
+  }
+};
+
+/// A caching allocator for OpenCL buffers. Released buffers are not freed,
+/// but kept in a free list of their size class and handed out again for later
+/// requests of the same size class and memory flags. Size classes are spaced
+/// such that at most 25% of a buffer remain unused, which avoids both driver
+/// allocations for recurring temporaries and fragmentation due to many different
+/// buffer sizes. The pool is thread-safe.
+/// Memory pools must be managed by a \c std::shared_ptr, since buffers
+/// obtained from the pool refer back to it.
+class memory_pool : public std::enable_shared_from_this<memory_pool>
+{
+public:
+  /// \param context The OpenCL context in which buffers are allocated
+  explicit memory_pool(const cl::Context& context)
+    : _context{context},
+      _max_bytes_cached{std::numeric_limits<std::size_t>::max()}
+  {}
+
+  memory_pool(const memory_pool&) = delete;
+  memory_pool& operator=(const memory_pool&) = delete;
+
+  /// Allocates a buffer from the pool. When the last reference to the
+  /// returned pointer is released, the buffer is returned to the pool
+  /// instead of being freed. Note that the buffer may hence be handed out
+  /// again while copies of the \c cl::Buffer object still exist.
+  /// \return The allocated buffer. Its size may be larger than requested.
+  /// \param flags The OpenCL memory flags. Flags that refer to a host
+  /// pointer (\c CL_MEM_USE_HOST_PTR, \c CL_MEM_COPY_HOST_PTR) are not allowed.
+  /// \param num_bytes The requested size in bytes
+  buffer_ptr allocate(cl_mem_flags flags, std::size_t num_bytes)
+  {
+    return allocate(flags, num_bytes, [](std::size_t){});
+  }
+
+  /// Allocates a buffer from the pool as \c allocate(flags, num_bytes),
+  /// but calls a function before a new buffer is created because no
+  /// cached buffer is available.
+  /// \return The allocated buffer
+  /// \param flags The OpenCL memory flags
+  /// \param num_bytes The requested size in bytes
+  /// \param on_miss Called with the size in bytes of the new buffer before
+  /// it is created, e.g. to check a memory budget. May throw, in which case
+  /// no buffer is allocated.
+  template<class Miss_handler>
+  buffer_ptr allocate(cl_mem_flags flags, std::size_t num_bytes,
+                      Miss_handler on_miss)
+  {
+    assert((flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) == 0);
+
+    std::size_t size = get_size_class(num_bytes);
+    cl::Buffer buffer;
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      ++_stats.num_requests;
+
+      auto free_list = _free_buffers.find(bucket_key{flags, size});
+      if(free_list != _free_buffers.end() && !free_list->second.empty())
+      {
+        buffer = std::move(free_list->second.back());
+        free_list->second.pop_back();
+
+        ++_stats.num_hits;
+        _stats.bytes_cached -= size;
+        _stats.bytes_in_use += size;
+      }
+    }
+
+    if(!buffer())
+    {
+      on_miss(size);
+
+      cl_int err;
+      buffer = cl::Buffer(_context, flags, size, nullptr, &err);
+      if(err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES)
+      {
+        // Cached memory might prevent the allocation
+        release_cached();
+        buffer = cl::Buffer(_context, flags, size, nullptr, &err);
+      }
+      check_cl_error(err, "Could not create buffer object!");
+
+      std::lock_guard<std::mutex> lock{_mutex};
+      _stats.bytes_in_use += size;
+      update_high_water_mark();
+    }
+
+    std::weak_ptr<memory_pool> pool = shared_from_this();
+    return buffer_ptr(new cl::Buffer(std::move(buffer)),
+      [pool, flags, size](cl::Buffer* released)
+      {
+        if(std::shared_ptr<memory_pool> p = pool.lock())
+          p->recycle(flags, size, *released);
+        delete released;
+      });
+  }
+
+  /// Frees all cached buffers that are currently not in use
+  void release_cached()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _free_buffers.clear();
+    _stats.bytes_cached = 0;
+  }
+
+  /// Sets the maximum number of bytes that are kept in cached buffers.
+  /// Buffers that are released when the limit is reached are freed.
+  /// \param max_bytes The maximum number of cached bytes
+  void set_max_bytes_cached(std::size_t max_bytes)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _max_bytes_cached = max_bytes;
+  }
+
+  /// \return The maximum number of bytes that are kept in cached buffers
+  std::size_t get_max_bytes_cached() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _max_bytes_cached;
+  }
+
+  /// \return The current allocation statistics
+  memory_pool_statistics get_statistics() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _stats;
+  }
+
+  /// Resets the request counters and the high-water mark of the
+  /// statistics. The high-water mark is reset to the current footprint.
+  void reset_statistics()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _stats.num_requests = 0;
+    _stats.num_hits = 0;
+    _stats.high_water_mark = _stats.bytes_in_use + _stats.bytes_cached;
+  }
+
+  /// \return The size in bytes of buffers that are allocated for requests
+  /// of the given size.
+  /// \param num_bytes The requested size
+  static std::size_t get_size_class(std::size_t num_bytes)
+  {
+    const std::size_t min_size = 256;
+    if(num_bytes <= min_size)
+      return min_size;
+
+    // Four size classes per power of two
+    std::size_t power = min_size;
+    while(power * 2 < num_bytes)
+      power *= 2;
+    std::size_t step = power / 4;
+
+    return ((num_bytes + step - 1) / step) * step;
+  }
+private:
+  using bucket_key = std::pair<cl_mem_flags, std::size_t>;
+
+  void recycle(cl_mem_flags flags, std::size_t size, cl::Buffer& buffer)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _stats.bytes_in_use -= size;
+
+    if(_stats.bytes_cached + size <= _max_bytes_cached)
+    {
+      _free_buffers[bucket_key{flags, size}].push_back(std::move(buffer));
+      _stats.bytes_cached += size;
+    }
+  }
+
+  void update_high_water_mark()
+  {
+    _stats.high_water_mark = std::max(_stats.high_water_mark,
+                                      _stats.bytes_in_use + _stats.bytes_cached);
+  }
+
+  cl::Context _context;
+
+  mutable std::mutex _mutex;
+  std::map<bucket_key, std::vector<cl::Buffer>> _free_buffers;
+  std::size_t _max_bytes_cached;
+  memory_pool_statistics _stats;
+};
+
+using memory_pool_ptr = std::shared_ptr<memory_pool>;
+
+/// The device memory footprint of a \c device_context, see
+/// \c device_context::get_memory_footprint()
+struct memory_footprint
+{
+  /// The number of bytes of the live buffers created with
+  /// \c device_context::create_buffer() (excluding pooled buffers)
+  std::size_t buffer_bytes = 0;
+  /// The number of live buffers created with \c device_context::create_buffer()
+  std::size_t num_buffers = 0;
+  /// The peak of \c buffer_bytes
+  std::size_t peak_buffer_bytes = 0;
+  /// The number of bytes of pooled buffers that are in use
+  std::size_t pool_bytes_in_use = 0;
+  /// The number of bytes of cached pooled buffers that are not in use
+  std::size_t pool_bytes_cached = 0;
+  /// The number of programs in the program cache
+  std::size_t num_programs = 0;
+  /// The number of cached specialized programs
+  std::size_t num_specializations = 0;
+  /// How often cached memory has been evicted to stay within the budget
+  std::size_t num_evictions = 0;
+  /// The memory budget in bytes
+  std::size_t budget = 0;
+  /// The size of the global memory of the device in bytes
+  std::size_t global_memory_size = 0;
+
+  /// \return The total number of bytes allocated through the context,
+  /// which is checked against the budget
+  std::size_t get_total_bytes() const
+  {
+    return buffer_bytes + pool_bytes_in_use + pool_bytes_cached;
+  }
+
+  /// \return The fraction of the budget that is used
+  double get_budget_utilization() const
+  {
+    if(budget == 0)
+      return 0.0;
+    return static_cast<double>(get_total_bytes()) / static_cast<double>(budget);
+  }
+};
+
+namespace detail {
+
+/// Counts the buffers allocated through a device context. Buffers
+/// are counted until they are destroyed, which is detected by a destructor
+/// callback. The counters are shared with the callbacks, such that buffers
+/// may outlive their device context.
+struct memory_accounting
+{
+  std::atomic<std::size_t> bytes_allocated{0};
+  std::atomic<std::size_t> num_buffers{0};
+  std::atomic<std::size_t> peak_bytes_allocated{0};
+  std::atomic<std::size_t> num_evictions{0};
+
+  /// Counts a buffer until it is destroyed
+  /// \param accounting The counters
+  /// \param buffer The newly created buffer
+  /// \param num_bytes The size of the buffer
+  static void track(const std::shared_ptr<memory_accounting>& accounting,
+                    cl::Buffer& buffer,
+                    std::size_t num_bytes)
+  {
+    allocation* record = new allocation{accounting, num_bytes};
+    if(buffer.setDestructorCallback(&memory_accounting::on_release, record) != CL_SUCCESS)
+    {
+      delete record;
+      return;
+    }
+
+    ++accounting->num_buffers;
+    std::size_t bytes = accounting->bytes_allocated += num_bytes;
+
+    std::size_t peak = accounting->peak_bytes_allocated.load();
+    while(bytes > peak &&
+          !accounting->peak_bytes_allocated.compare_exchange_weak(peak, bytes))
+      ;
+  }
+private:
+  struct allocation
+  {
+    std::shared_ptr<memory_accounting> accounting;
+    std::size_t num_bytes;
+  };
+
+  static void CL_CALLBACK on_release(cl_mem, void* user_data)
+  {
+    std::unique_ptr<allocation> record{static_cast<allocation*>(user_data)};
+    record->accounting->bytes_allocated -= record->num_bytes;
+    --record->accounting->num_buffers;
+  }
+};
+
+}
+
+/// A set of runtime values that are compiled into a QCL module as
+/// preprocessor definitions, such that the compiler can fold them like
+/// constants (e.g. to fully unroll loops over a stencil radius).
+/// Kernels of a module specialized for a set of values are obtained with the
+/// specialization overload of module entrypoints:
+/// \code
+/// qcl::specialization spec;
+/// spec.set("RADIUS", radius).set("TILE_SIZE", tile_size);
+/// my_module::stencil(ctx, spec, global_size, group_size)(input, output);
+/// \endcode
+/// Each distinct set of values is compiled once per device context on
+/// demand. The number of cached variants is bounded, see
+/// \c device_context::set_max_specializations().
+class specialization
+{
+public:
+  /// Sets the value of a definition, replacing a previous value
+  /// \return This object, to allow chaining
+  /// \param name The name of the preprocessor macro
+  /// \param value The value. Floating point values are defined as literals
+  /// of the same precision, boolean values as 0 or 1.
+  template<class T>
+  specialization& set(const std::string& name, const T& value)
+  {
+    static_assert(std::is_arithmetic<T>::value,
+                  "Only arithmetic values can be specialized, use "
+                  "set_literal() for other values");
+    return set_literal(name, to_literal(value));
+  }
+
+  /// Sets the definition of a macro to an arbitrary CL expression
+  /// \return This object, to allow chaining
+  /// \param name The name of the preprocessor macro
+  /// \param literal The CL code the macro expands to
+  specialization& set_literal(const std::string& name, const std::string& literal)
+  {
+    assert(!name.empty());
+    assert(name.find('\n') == std::string::npos);
+    assert(literal.find('\n') == std::string::npos);
+    _definitions[name] = literal;
+    update_key();
+    return *this;
+  }
+
+  /// \return The preprocessor definitions of the values
+  std::string get_definitions() const
+  {
+    std::string result;
+    for(const auto& definition : _definitions)
+      result += "#define " + definition.first + " " + definition.second + "\n";
+    return result;
+  }
+
+  /// \return A string identifying the set of values. Two specializations
+  /// have the same key if and only if they have the same definitions.
+  const std::string& get_key() const
+  {
+    return _key;
+  }
+
+  bool empty() const
+  {
+    return _definitions.empty();
+  }
+private:
+  /// Rebuilds the key from the definitions. Names and values are joined as
+  /// <tt>name=value,...</tt>, with the separators escaped inside names and
+  /// values, such that different definitions never result in the same key.
+  void update_key()
+  {
+    _key.clear();
+    for(const auto& definition : _definitions)
+    {
+      if(!_key.empty())
+        _key += ",";
+      append_escaped(definition.first, _key);
+      _key += "=";
+      append_escaped(definition.second, _key);
+    }
+  }
+
+  static void append_escaped(const std::string& str, std::string& out)
+  {
+    for(char c : str)
+    {
+      if(c == '\\' || c == ',' || c == '=')
+        out += '\\';
+      out += c;
+    }
+  }
+
+  static std::string to_literal(bool value)
+  {
+    return value ? "1" : "0";
+  }
+
+  static std::string to_literal(float value)
+  {
+    std::stringstream sstr;
+    sstr << std::setprecision(std::numeric_limits<float>::max_digits10)
+         << std::scientific << value << "f";
+    return sstr.str();
+  }
+
+  static std::string to_literal(double value)
+  {
+    std::stringstream sstr;
+    sstr << std::setprecision(std::numeric_limits<double>::max_digits10)
+         << std::scientific << value;
+    return sstr.str();
+  }
+
+  template<class T>
+  static std::string to_literal(const T& value)
+  {
+    static_assert(std::is_integral<T>::value, "Unsupported type");
+    std::string suffix = std::is_unsigned<T>::value ? "u" : "";
+    if(sizeof(T) > 4)
+      suffix += "l";
+    std::string literal = std::to_string(value) + suffix;
+    // Negative values are parenthesized, such that they
+    // remain one operand when the macro is expanded
+    return (value < 0) ? "(" + literal + ")" : literal;
+  }
+
+  /// Ordered by name, such that the key does not depend on
+  /// the order of the \c set() calls
+  std::map<std::string, std::string> _definitions;
+  /// The key of the definitions, see \c get_key()
+  std::string _key;
+};
+
+/// The type of a command recorded by a \c profiler
+enum class profiled_command
+{
+  kernel,
+  memcpy_h2d,
+  memcpy_d2h,
+  memcpy_d2d
+};
+
+/// \return A human readable name of a profiled command type
+inline const char* get_profiled_command_name(profiled_command command)
+{
+  switch(command)
+  {
+  case profiled_command::kernel:
+    return "kernel";
+  case profiled_command::memcpy_h2d:
+    return "memcpy_h2d";
+  case profiled_command::memcpy_d2h:
+    return "memcpy_d2h";
+  case profiled_command::memcpy_d2d:
+    return "memcpy_d2d";
+  }
+  return "unknown";
+}
+
+/// The timestamps of a single profiled command. All times are
+/// device timestamps in nanoseconds.
+struct profiling_record
+{
+  /// The scoped name of the kernel, or the name of the memcpy function
+  std::string name;
+  profiled_command command;
+  /// The command queue into which the command was enqueued
+  std::size_t queue;
+  /// The number of bytes transferred, if the command is a memory transfer
+  std::size_t bytes;
+
+  cl_ulong queued;
+  cl_ulong submit;
+  cl_ulong start;
+  cl_ulong end;
+
+  /// \return The execution time of the command on the device
+  cl_ulong get_duration() const
+  { return end > start ? end - start : 0; }
+};
+
+/// Aggregated execution times of all profiled commands with the same name.
+/// All times are in nanoseconds.
+struct profiling_statistics
+{
+  std::string name;
+  profiled_command command;
+
+  /// The number of recorded commands
+  std::size_t count = 0;
+  /// The total number of transferred bytes
+  std::size_t total_bytes = 0;
+
+  cl_ulong total_time = 0;
+  cl_ulong min_time = 0;
+  cl_ulong max_time = 0;
+  cl_ulong median_time = 0;
+  cl_ulong p90_time = 0;
+  cl_ulong p99_time = 0;
+  /// The sum of the time spans between enqueuing and starting
+  /// the commands
+  cl_ulong total_queue_latency = 0;
+
+  double get_mean_time() const
+  {
+    if(count == 0)
+      return 0.0;
+    return static_cast<double>(total_time) / static_cast<double>(count);
+  }
+};
+
+/// Collects the profiling information of the commands enqueued by a
+/// \c device_context, see \c device_context::enable_profiling().
+/// Commands are recorded by their events. The timestamps of the events
+/// are only queried once the events have completed, such that recording
+/// never blocks the launching thread.
+///
+/// Aggregated counts and total times are exact. The individual records,
+/// which are used for the percentiles and the trace export, are bounded
+/// by \c set_max_records(); once the limit is reached, the oldest records
+/// are discarded.
+class profiler
+{
+public:
+  profiler() = default;
+
+  profiler(const profiler& other) = delete;
+  profiler& operator=(const profiler& other) = delete;
+
+  /// Records a command. Thread-safe.
+  /// \param name The name under which the command is recorded
+  /// \param command The type of the command
+  /// \param queue The command queue of the command
+  /// \param bytes The number of transferred bytes
+  /// \param evt The event of the command, which must stem from a
+  /// profiling-enabled command queue.
+  void record(const std::string& name,
+              profiled_command command,
+              std::size_t queue,
+              std::size_t bytes,
+              const cl::Event& evt)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    pending_record pending;
+    pending.name = name;
+    pending.command = command;
+    pending.queue = queue;
+    pending.bytes = bytes;
+    pending.evt = evt;
+    _pending.push_back(pending);
+
+    if(_pending.size() >= _resolve_threshold)
+      resolve_pending(false);
+  }
+
+  /// Waits for all recorded commands to complete and queries their timestamps.
+  void flush()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    resolve_pending(true);
+  }
+
+  /// Discards all records and statistics
+  void reset()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _pending.clear();
+    _records.clear();
+    _totals.clear();
+  }
+
+  /// Sets the maximum number of individual records that are retained.
+  void set_max_records(std::size_t max_records)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _max_records = max_records;
+    while(_records.size() > _max_records)
+      _records.pop_front();
+  }
+
+  std::size_t get_max_records() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _max_records;
+  }
+
+  /// \return The retained records of all completed commands. Waits for
+  /// all recorded commands to complete.
+  std::vector<profiling_record> get_records()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    resolve_pending(true);
+    return std::vector<profiling_record>(_records.begin(), _records.end());
+  }
+
+  /// \return The statistics of all recorded commands, grouped by name and
+  /// sorted by descending total time. Waits for all recorded commands
+  /// to complete.
+  std::vector<profiling_statistics> get_statistics()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    resolve_pending(true);
+
+    std::map<std::string, std::vector<cl_ulong>> durations;
+    for(const profiling_record& r : _records)
+      durations[r.name].push_back(r.get_duration());
+
+    std::vector<profiling_statistics> result;
+    for(const auto& total : _totals)
+    {
+      profiling_statistics stats = total.second;
+
+      std::vector<cl_ulong>& times = durations[total.first];
+      if(!times.empty())
+      {
+        std::sort(times.begin(), times.end());
+        stats.median_time = get_percentile(times, 0.5);
+        stats.p90_time = get_percentile(times, 0.9);
+        stats.p99_time = get_percentile(times, 0.99);
+      }
+      result.push_back(stats);
+    }
+
+    std::sort(result.begin(), result.end(),
+              [](const profiling_statistics& a, const profiling_statistics& b)
+    {
+      return a.total_time > b.total_time;
+    });
+    return result;
+  }
+
+  /// Writes a human readable table of the statistics to a stream.
+  /// \param ostr The output stream
+  void write_report(std::ostream& ostr)
+  {
+    std::vector<profiling_statistics> stats = get_statistics();
+
+    cl_ulong total_time = 0;
+    for(const profiling_statistics& s : stats)
+      total_time += s.total_time;
+
+    ostr << std::left << std::setw(48) << "name" << std::right
+         << std::setw(12) << "type"
+         << std::setw(10) << "count"
+         << std::setw(14) << "total [ms]"
+         << std::setw(8)  << "%"
+         << std::setw(12) << "mean [us]"
+         << std::setw(12) << "p50 [us]"
+         << std::setw(12) << "p90 [us]"
+         << std::setw(12) << "p99 [us]"
+         << std::setw(12) << "max [us]" << std::endl;
+
+    ostr << std::fixed;
+    for(const profiling_statistics& s : stats)
+    {
+      double percentage = total_time > 0 ?
+          100.0 * static_cast<double>(s.total_time) / static_cast<double>(total_time) : 0.0;
+
+      ostr << std::left << std::setw(48) << s.name << std::right
+           << std::setw(12) << get_profiled_command_name(s.command)
+           << std::setw(10) << s.count
+           << std::setw(14) << std::setprecision(3) << 1.e-6 * s.total_time
+           << std::setw(8)  << std::setprecision(1) << percentage
+           << std::setprecision(2)
+           << std::setw(12) << 1.e-3 * s.get_mean_time()
+           << std::setw(12) << 1.e-3 * s.median_time
+           << std::setw(12) << 1.e-3 * s.p90_time
+           << std::setw(12) << 1.e-3 * s.p99_time
+           << std::setw(12) << 1.e-3 * s.max_time << std::endl;
+    }
+    ostr.unsetf(std::ios_base::floatfield);
+  }
+
+  /// Writes the retained records in the Chrome trace event format, which
+  /// can be viewed with chrome://tracing or Perfetto. Each command queue
+  /// appears as a separate thread.
+  /// \param ostr The output stream
+  /// \param process_id The process id under which the commands appear in
+  /// the trace, e.g. to distinguish several devices.
+  void write_chrome_trace(std::ostream& ostr, std::size_t process_id = 0)
+  {
+    std::vector<profiling_record> records = get_records();
+
+    cl_ulong time_origin = std::numeric_limits<cl_ulong>::max();
+    for(const profiling_record& r : records)
+      time_origin = std::min(time_origin, r.start);
+
+    ostr << "{\"traceEvents\":[";
+    for(std::size_t i = 0; i < records.size(); ++i)
+    {
+      const profiling_record& r = records[i];
+      if(i != 0)
+        ostr << ",";
+      ostr << "\n{\"name\":\"" << escape_json(r.name) << "\""
+           << ",\"cat\":\"" << get_profiled_command_name(r.command) << "\""
+           << ",\"ph\":\"X\""
+           << ",\"ts\":" << (r.start - time_origin) / 1000
+           << "." << std::setfill('0') << std::setw(3) << (r.start - time_origin) % 1000
+           << ",\"dur\":" << r.get_duration() / 1000
+           << "." << std::setw(3) << r.get_duration() % 1000 << std::setfill(' ')
+           << ",\"pid\":" << process_id
+           << ",\"tid\":" << r.queue
+           << ",\"args\":{\"bytes\":" << r.bytes
+           << ",\"queue_latency_ns\":" << (r.start > r.queued ? r.start - r.queued : 0)
+           << "}}";
+    }
+    ostr << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  }
+
+private:
+  struct pending_record
+  {
+    std::string name;
+    profiled_command command;
+    std::size_t queue;
+    std::size_t bytes;
+    cl::Event evt;
+  };
+
+  static cl_ulong get_percentile(const std::vector<cl_ulong>& sorted_times,
+                                 double percentile)
+  {
+    assert(!sorted_times.empty());
+    std::size_t idx = static_cast<std::size_t>(
+          percentile * static_cast<double>(sorted_times.size() - 1) + 0.5);
+    return sorted_times[std::min(idx, sorted_times.size() - 1)];
+  }
+
+  static std::string escape_json(const std::string& str)
+  {
+    std::string result;
+    for(char c : str)
+    {
+      if(c == '"' || c == '\\')
+      {
+        result += '\\';
+        result += c;
+      }
+      else if(static_cast<unsigned char>(c) < 0x20)
+        result += ' ';
+      else
+        result += c;
+    }
+    return result;
+  }
+
+  /// Queries the timestamps of pending records. Must be called
+  /// with the mutex held.
+  /// \param wait Whether to wait for incomplete commands. Otherwise,
+  /// only records of completed commands are resolved.
+  void resolve_pending(bool wait)
+  {
+    std::vector<pending_record> remaining;
+    for(pending_record& pending : _pending)
+    {
+      if(wait)
+        pending.evt.wait();
+      else
+      {
+        cl_int status = CL_COMPLETE;
+        pending.evt.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &status);
+        if(status > CL_COMPLETE)
+        {
+          remaining.push_back(pending);
+          continue;
+        }
+      }
+
+      profiling_record r;
+      r.name = pending.name;
+      r.command = pending.command;
+      r.queue = pending.queue;
+      r.bytes = pending.bytes;
+      // Commands that have failed do not provide timestamps
+      if(pending.evt.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &r.queued) != CL_SUCCESS ||
+         pending.evt.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &r.submit) != CL_SUCCESS ||
+         pending.evt.getProfilingInfo(CL_PROFILING_COMMAND_START, &r.start) != CL_SUCCESS ||
+         pending.evt.getProfilingInfo(CL_PROFILING_COMMAND_END, &r.end) != CL_SUCCESS)
+        continue;
+
+      add_record(r);
+    }
+    _pending.swap(remaining);
+
+    // Avoid rescanning the same unfinished commands on every record
+    _resolve_threshold = std::max(get_default_resolve_threshold(),
+                                  2 * _pending.size());
+  }
+
+  void add_record(const profiling_record& r)
+  {
+    profiling_statistics& stats = _totals[r.name];
+    if(stats.count == 0)
+    {
+      stats.name = r.name;
+      stats.command = r.command;
+      stats.min_time = r.get_duration();
+    }
+    ++stats.count;
+    stats.total_bytes += r.bytes;
+    stats.total_time += r.get_duration();
+    stats.min_time = std::min(stats.min_time, r.get_duration());
+    stats.max_time = std::max(stats.max_time, r.get_duration());
+    stats.total_queue_latency += r.start > r.queued ? r.start - r.queued : 0;
+
+    if(_max_records == 0)
+      return;
+    if(_records.size() >= _max_records)
+      _records.pop_front();
+    _records.push_back(r);
+  }
+
+  static std::size_t get_default_resolve_threshold()
+  { return 256; }
+
+  mutable std::mutex _mutex;
+  std::vector<pending_record> _pending;
+  std::deque<profiling_record> _records;
+  std::map<std::string, profiling_statistics> _totals;
+
+  std::size_t _max_records = 100000;
+  std::size_t _resolve_threshold = get_default_resolve_threshold();
+};
+
+using profiler_ptr = std::shared_ptr<profiler>;
+
+/// Stores the work group sizes found by the autotuner (see
+/// \c kernel_call::autotune()), keyed by device, kernel and problem size
+/// bucket. If a file name is given, the results are loaded from and
+/// saved to a text file, such that later runs can reuse them without
+/// benchmarking again. Thread-safe.
+class work_group_tuner
+{
+public:
+  /// Creates an in-memory tuner
+  work_group_tuner() = default;
+
+  /// Creates a tuner which persists its results in a file. Existing
+  /// results are loaded from the file, if it exists.
+  /// \param filename The file in which the results are stored
+  explicit work_group_tuner(const std::string& filename)
+    : _filename{filename}
+  {
+    load();
+  }
+
+  work_group_tuner(const work_group_tuner& other) = delete;
+  work_group_tuner& operator=(const work_group_tuner& other) = delete;
+
+  /// Looks up a tuned work group size.
+  /// \return Whether an entry has been found
+  /// \param key The key of the entry, see \c get_key()
+  /// \param local_size Will contain the work group size, if an entry has been found
+  bool lookup(const std::string& key, cl::NDRange& local_size) const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    auto entry = _entries.find(key);
+    if(entry == _entries.end())
+      return false;
+
+    local_size = make_ndrange(entry->second);
+    return true;
+  }
+
+  /// Stores a tuned work group size. If the tuner is persistent,
+  /// the file is updated.
+  /// \param key The key of the entry, see \c get_key()
+  /// \param local_size The work group size
+  void store(const std::string& key, const cl::NDRange& local_size)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    std::vector<std::size_t> sizes(local_size.dimensions());
+    for(std::size_t i = 0; i < sizes.size(); ++i)
+      sizes[i] = local_size.get()[i];
+    _entries[key] = sizes;
+
+    if(!_filename.empty())
+      save();
+  }
+
+  /// \return The number of stored work group sizes
+  std::size_t get_num_entries() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _entries.size();
+  }
+
+  /// Removes all entries. The file of a persistent tuner is not modified
+  /// until the next entry is stored.
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _entries.clear();
+  }
+
+  /// \return The file in which the results are stored, or an empty
+  /// string if the tuner is not persistent.
+  const std::string& get_filename() const
+  {
+    return _filename;
+  }
+
+  /// \return The key under which the work group size of a kernel launch is
+  /// stored. The global size is rounded up to powers of two in each dimension,
+  /// such that similar problem sizes share one entry.
+  /// \param device_name A unique description of the device
+  /// \param kernel_name The scoped name of the kernel
+  /// \param global_size The global size of the launch
+  static std::string get_key(const std::string& device_name,
+                             const std::string& kernel_name,
+                             const cl::NDRange& global_size)
+  {
+    std::stringstream sstr;
+    sstr << device_name << "|" << kernel_name << "|";
+    for(std::size_t i = 0; i < global_size.dimensions(); ++i)
+    {
+      std::size_t bucket = 1;
+      while(bucket < global_size.get()[i])
+        bucket *= 2;
+
+      if(i != 0)
+        sstr << "x";
+      sstr << bucket;
+    }
+
+    // Tabs and newlines are reserved by the file format
+    std::string key = sstr.str();
+    std::replace(key.begin(), key.end(), '\t', ' ');
+    std::replace(key.begin(), key.end(), '\n', ' ');
+    return key;
+  }
+
+  /// \return An NDRange of the given sizes
+  static cl::NDRange make_ndrange(const std::vector<std::size_t>& sizes)
+  {
+    switch(sizes.size())
+    {
+    case 1:
+      return cl::NDRange(sizes[0]);
+    case 2:
+      return cl::NDRange(sizes[0], sizes[1]);
+    case 3:
+      return cl::NDRange(sizes[0], sizes[1], sizes[2]);
+    default:
+      return cl::NullRange;
+    }
+  }
+
+private:
+  /// Loads the entries of the file. Lines that cannot be parsed are ignored.
+  void load()
+  {
+    std::ifstream file(_filename.c_str());
+    if(!file.is_open())
+      return;
+
+    std::string line;
+    while(std::getline(file, line))
+    {
+      std::size_t separator = line.find('\t');
+      if(separator == std::string::npos || separator == 0)
+        continue;
+
+      std::istringstream sizes_stream(line.substr(separator + 1));
+      std::vector<std::size_t> sizes;
+      std::size_t size = 0;
+      while(sizes_stream >> size)
+        sizes.push_back(size);
+
+      if(sizes.empty() || sizes.size() > 3)
+        continue;
+
+      _entries[line.substr(0, separator)] = sizes;
+    }
+  }
+
+  /// Writes all entries to the file. The file is first written to a
+  /// temporary file and then moved to its final location.
+  /// Must be called with the mutex held.
+  void save() const
+  {
+    std::string temp_filename = detail::get_temporary_filename(_filename);
+    {
+      std::ofstream file(temp_filename.c_str(), std::ios::trunc);
+      if(!file.is_open())
+        return;
+
+      for(const auto& entry : _entries)
+      {
+        file << entry.first << "\t";
+        for(std::size_t i = 0; i < entry.second.size(); ++i)
+          file << (i == 0 ? "" : " ") << entry.second[i];
+        file << "\n";
+      }
+
+      if(!file)
+      {
+        file.close();
+        std::remove(temp_filename.c_str());
+        return;
+      }
+    }
+
+    if(std::rename(temp_filename.c_str(), _filename.c_str()) != 0)
+      std::remove(temp_filename.c_str());
+  }
+
+  mutable std::mutex _mutex;
+  std::map<std::string, std::vector<std::size_t>> _entries;
+  std::string _filename;
+};
+
+using work_group_tuner_ptr = std::shared_ptr<work_group_tuner>;
+
+/// Represents the OpenCL context of a device. This class contains everything
+/// that is needed to execute OpenCL commands on a device. It stores one cl::Context,
+/// at least one cl::CommandQueue and a number of kernels that have been compiled for the device.
+class device_context
+{
+public:
+  /// Create NULL object
+  device_context()
+  {}
+  
+  /// \param platform The OpenCL platform to which the device belongs
+  /// \param device The OpenCL device to which the instance shall be bound
+  device_context(const cl::Platform& platform, const cl::Device& device)
+  : _device(device)
+  {
+    cl_int err;
+    cl_context_properties cprops[3] = 
+      {CL_CONTEXT_PLATFORM, (cl_context_properties)platform(), 0};
+     
+    _context = cl::Context(
+       device, 
+       cprops,
+       NULL,
+       NULL,
+       &err);
+    
+    check_cl_error(err, "Could not spawn CL context!");
+    
+    _programs = std::make_shared<detail::program_cache>(
+          std::vector<cl::Device>(1, device));
+    init_device();
+  }
+  
+  /// Create object from existing cl context and a given device
+  device_context(const cl::Context& context, const cl::Device& device)
+  : _context(context), _device(device)
+  {
+    _programs = std::make_shared<detail::program_cache>(
+          std::vector<cl::Device>(1, device));
+    init_device();
+  }
+
+  /// Create object from an existing cl context that is shared with other
+  /// device contexts. Programs are compiled only once for all devices of
+  /// the program cache, using the build options of the device context that
+  /// first requests the program. Buffers of device contexts sharing the same
+  /// \c cl::Context can be used by all of them, e.g. to copy data between
+  /// devices without a round trip through host memory.
+  /// \param context The shared OpenCL context
+  /// \param device The device to which the instance shall be bound. Must
+  /// be one of the devices of the program cache.
+  /// \param programs The program cache shared by all device contexts
+  /// of the OpenCL context.
+  device_context(const cl::Context& context, const cl::Device& device,
+                 const std::shared_ptr<detail::program_cache>& programs)
+  : _context(context), _device(device), _programs(programs)
+  {
+    assert(programs != nullptr);
+    init_device();
+  }
+  
+  device_context(const device_context& other) = delete;
+  device_context& operator=(const device_context& other) = delete;
+
+  /// Waits for all background compilations to finish.
+  ~device_context()
+  {
+    try
+    {
+      wait_for_precompilation();
+    }
+    catch(...)
+    {
+      // Compilation errors are reported by the entrypoints
+      // that make use of the failed programs
+    }
+
+    // Other device contexts may share the program cache
+    std::lock_guard<std::mutex> lock{_mutex};
+    for(const specialized_program& program : _specializations)
+      release_shared_specialization(program);
+  }
+  
+  /// \return The device that is accessed by this context
+  const cl::Device& get_device() const
+  {
+    return _device;
+  }
+  
+  /// \return The underlying OpenCL context
+  const cl::Context& get_context() const
+  {
+    return _context;
+  }
+  
+  /// \return The underlying OpenCL command queue
+  /// \param queue The id of the command queue. The id must be greater or
+  /// equal than 0 and smaller than \c get_num_command_queues().
+  const cl::CommandQueue& get_command_queue(command_queue_id queue) const
+  {
+    assert(queue < _queues.size());
+    return _queues[queue];
+  }
+
+  /// \return The underlying OpenCL command queue
+  /// \param queue The id of the command queue. The id must be greater or
+  /// equal than 0 and smaller than \c get_num_command_queues().
+  cl::CommandQueue& get_command_queue(command_queue_id queue)
+  {
+    assert(queue < _queues.size());
+    return _queues[queue];
+  }
+
+  /// \return The underlying OpenCL command queue
+  const cl::CommandQueue& get_command_queue() const
   {
     return _queues[0];
   }
@@ -455,6 +2572,43 @@ public:
     return driver_version;
   }
   
+  /// \return The number of parallel compute units of the device
+  cl_uint get_max_compute_units() const
+  {
+    cl_uint compute_units = 0;
+    check_cl_error(_device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &compute_units),
+                   "Could not obtain device information!");
+    return compute_units;
+  }
+
+  /// \return The alignment in bytes that the origin of sub-buffers
+  /// (and hence of \c device_array views) must satisfy on this device
+  std::size_t get_sub_buffer_alignment() const
+  {
+    cl_uint alignment_bits = 0;
+    check_cl_error(_device.getInfo(CL_DEVICE_MEM_BASE_ADDR_ALIGN, &alignment_bits),
+                   "Could not obtain device information!");
+    return std::max<std::size_t>(alignment_bits / 8, 1);
+  }
+
+  /// \return Whether the device supports images
+  bool has_image_support() const
+  {
+    cl_bool support = CL_FALSE;
+    check_cl_error(_device.getInfo(CL_DEVICE_IMAGE_SUPPORT, &support),
+                   "Could not obtain device information!");
+    return support == CL_TRUE;
+  }
+
+  /// \return The maximum clock frequency of the device in MHz
+  cl_uint get_max_clock_frequency() const
+  {
+    cl_uint frequency = 0;
+    check_cl_error(_device.getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &frequency),
+                   "Could not obtain device information!");
+    return frequency;
+  }
+  
   /// \return The type of the device
   cl_device_type get_device_type() const
   {
@@ -472,6 +2626,14 @@ public:
   {
     return get_device_type() == CL_DEVICE_TYPE_GPU;
   }
+
+  /// \return Whether the device shares its memory with the host, as CPUs
+  /// and integrated GPUs do. In this case, the host can access buffers
+  /// by mapping them without any copies (see \c device_array::map()).
+  bool has_unified_memory() const
+  {
+    return this->is_cpu_device() || _unified_memory;
+  }
   
   /// Compiles a file containing CL source code, and creates kernel objects
   /// for the kernels contained in the file.
@@ -523,26 +2685,22 @@ public:
       scope_prefix = scope + "::";
 
     std::vector<std::string> new_kernels;
-
-    for(const auto& kernel_name : kernel_names)
     {
-      if(_kernels.find(scope_prefix+kernel_name) == _kernels.end())
-        new_kernels.push_back(kernel_name);
+      std::lock_guard<std::mutex> lock{_mutex};
+
+      for(const auto& kernel_name : kernel_names)
+      {
+        if(_kernels.find(scope_prefix+kernel_name) == _kernels.end())
+          new_kernels.push_back(kernel_name);
+      }
     }
 
     if(new_kernels.size() > 0)
     {
-      auto cached_program = _program_cache.find(program_name);
-      if(cached_program == _program_cache.end())
-      {
-        detail::meta_source_processor source_processor;
+      cl::Program prog = obtain_program(program_name, source_code);
 
-        cl::Program prog;
-        compile_source(source_processor(source_code), prog);
-        _program_cache[program_name] = prog;
-      }
-    
-      load_kernels(_program_cache[program_name], new_kernels, scope);
+      std::lock_guard<std::mutex> lock{_mutex};
+      load_kernels(prog, new_kernels, scope);
     }
   }
   
@@ -558,19 +2716,296 @@ public:
                          Source_module_type::_qcl_get_module_name());
   }
   
+  /// Queues CL source code for compilation on background threads. Once the
+  /// compilation has started, \c register_source_code() calls with the same
+  /// program name wait for it to finish instead of compiling the source again.
+  /// If the program is requested before the compilation has started, it is
+  /// compiled on the requesting thread and the queued job has no effect.
+  /// If the program cache is shared with other device contexts (see
+  /// \c environment::create_shared_global_context()), the program is built
+  /// for all of their devices.
+  /// \param source_code The CL source code
+  /// \param program_name The identifier of the program in the program cache
+  void precompile_source(const std::string& source_code,
+                         const std::string& program_name)
+  {
+    std::lock_guard<std::mutex> lock{_precompile_mutex};
+
+    _precompile_queue.push_back(std::make_pair(program_name, source_code));
+
+    // Forget about workers that have already terminated
+    _precompile_workers.erase(
+          std::remove_if(_precompile_workers.begin(), _precompile_workers.end(),
+                         [](const std::future<void>& worker)
+    {
+      return worker.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), _precompile_workers.end());
+
+    if(_num_active_precompile_workers < _max_precompile_threads)
+    {
+      ++_num_active_precompile_workers;
+      _precompile_workers.push_back(std::async(std::launch::async,
+                                               [this](){ run_precompile_worker(); }));
+    }
+  }
+
+  /// Queues QCL source modules for compilation on background threads,
+  /// e.g. \c ctx->precompile<module_a<float>,module_b<int,3>>().
+  /// Entrypoints of the modules only block if their program is still being
+  /// compiled. See \c precompile_source() for details.
+  /// \tparam Source_module_types The QCL source modules
+  template<class... Source_module_types>
+  void precompile()
+  {
+    int expand[] = {0, (precompile_source(Source_module_types::_qcl_source(),
+                                          Source_module_types::_qcl_get_module_name()),
+                        0)...};
+    (void)expand;
+  }
+
+  /// Blocks until all queued background compilations have finished.
+  /// Throws the error of the first compilation that has failed since
+  /// the last call, if any.
+  void wait_for_precompilation()
+  {
+    for(;;)
+    {
+      std::vector<std::future<void>> workers;
+      {
+        std::lock_guard<std::mutex> lock{_precompile_mutex};
+        if(_precompile_workers.empty())
+        {
+          std::exception_ptr error = _precompile_error;
+          _precompile_error = nullptr;
+
+          if(error)
+            std::rethrow_exception(error);
+          return;
+        }
+        workers.swap(_precompile_workers);
+      }
+
+      for(std::future<void>& worker : workers)
+        worker.wait();
+    }
+  }
+
+  /// Sets the maximum number of threads used for background compilation.
+  /// By default, the number of hardware threads is used.
+  /// \param num_threads The maximum number of threads. Must be at least 1.
+  void set_max_precompile_threads(std::size_t num_threads)
+  {
+    assert(num_threads > 0);
+    std::lock_guard<std::mutex> lock{_precompile_mutex};
+    _max_precompile_threads = num_threads;
+  }
+
+  /// \return The maximum number of threads used for background compilation
+  std::size_t get_max_precompile_threads() const
+  {
+    std::lock_guard<std::mutex> lock{_precompile_mutex};
+    return _max_precompile_threads;
+  }
+
   /// \return A kernel object
   /// \param kernel_name The name of the kernel. Throws \c std::runtime_error if
   /// the kernel is not found.
   kernel_ptr get_kernel(const std::string& kernel_name)
   {
-    kernel_ptr kernel = _kernels[kernel_name];
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    auto kernel = _kernels.find(kernel_name);
     
-    if(!kernel)
+    if(kernel == _kernels.end() || !kernel->second)
       throw std::runtime_error("Requested kernel could not be found!");
 
-    return kernel;
+    return kernel->second;
   }
   
+  /// Looks up the kernel of a module entrypoint. This is the fast path
+  /// used by \c QCL_ENTRYPOINT for repeated kernel calls: It only requires
+  /// an index into a table and neither builds strings nor allocates memory.
+  /// The table is protected by an (uncontended in the common case) lock,
+  /// since other threads may register entrypoints concurrently.
+  /// \return The kernel that has been stored for the entrypoint with
+  /// \c set_entrypoint_kernel(). If there is no such kernel, the
+  /// \c kernel member of the returned object is \c nullptr.
+  /// \param entrypoint_id The id of the entrypoint, as obtained from
+  /// \c detail::allocate_entrypoint_id()
+  detail::entrypoint_kernel get_entrypoint_kernel(std::size_t entrypoint_id) const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    if(entrypoint_id < _entrypoint_kernels.size())
+      return _entrypoint_kernels[entrypoint_id];
+    return detail::entrypoint_kernel{};
+  }
+
+  /// Stores the kernel of a module entrypoint, such that it can be retrieved
+  /// quickly with \c get_entrypoint_kernel().
+  /// \return The stored entry
+  /// \param entrypoint_id The id of the entrypoint, as obtained from
+  /// \c detail::allocate_entrypoint_id()
+  /// \param kernel The kernel object
+  detail::entrypoint_kernel set_entrypoint_kernel(std::size_t entrypoint_id,
+                                                  const kernel_ptr& kernel)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    if(entrypoint_id >= _entrypoint_kernels.size())
+      _entrypoint_kernels.resize(entrypoint_id + 1);
+
+    detail::entrypoint_kernel& entry = _entrypoint_kernels[entrypoint_id];
+    // Another thread may have been faster
+    if(!entry.kernel)
+    {
+      entry.kernel = detail::create_kernel_instance(*kernel);
+      entry.arguments = std::make_shared<detail::kernel_argument_cache>();
+      entry.name = std::make_shared<const std::string>(lookup_scoped_kernel_name(*kernel));
+      if(_thread_safe_launches)
+        entry.instances = std::make_shared<detail::kernel_instance_pool>(kernel, entry.name);
+    }
+    return entry;
+  }
+
+  /// Enables thread-safe kernel launches. In this mode, kernel calls through
+  /// module entrypoints do not share a single kernel object, but obtain their
+  /// own kernel instance from a pool for the lifetime of the \c kernel_call
+  /// object. Several host threads can hence set arguments and launch the same
+  /// entrypoint concurrently. Registering and compiling source code is always
+  /// thread-safe, independent of this setting. Kernels obtained directly from
+  /// \c get_kernel() are still shared objects.
+  /// This function itself is not thread-safe and should be called before
+  /// the device context is shared with other threads.
+  void enable_thread_safe_launches()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    _thread_safe_launches = true;
+    for(detail::entrypoint_kernel& entry : _entrypoint_kernels)
+      if(entry.kernel && !entry.instances)
+        entry.instances = std::make_shared<detail::kernel_instance_pool>(entry.kernel,
+                                                                         entry.name);
+
+    for(specialized_program& program : _specializations)
+      for(auto& kernel : program.kernels)
+        if(!kernel.second.instances)
+          kernel.second.instances =
+              std::make_shared<detail::kernel_instance_pool>(kernel.second.kernel,
+                                                             kernel.second.name);
+  }
+
+  /// Looks up the kernel of a module specialized for a set of runtime values,
+  /// and compiles the specialized module if required. This is used by the
+  /// specialization overload of \c QCL_ENTRYPOINT. Repeated lookups only
+  /// require a hash table lookup of the specialization key, the module source
+  /// and name are only obtained if the specialized program must be compiled.
+  /// The most recently used specialized programs are cached; if more than
+  /// \c get_max_specializations() programs have been created, the least
+  /// recently used program is removed from the cache.
+  /// \return The kernel, in the form of an entrypoint kernel
+  /// \param entrypoint_id The id of the entrypoint, as obtained from
+  /// \c detail::allocate_entrypoint_id()
+  /// \param kernel_name The name of the kernel in the module
+  /// \param spec The values the module is specialized for
+  /// \param get_source A function returning the source code of the module
+  /// \param get_module_name A function returning the name of the module
+  template<class Source_function, class Name_function>
+  detail::entrypoint_kernel get_specialized_kernel(std::size_t entrypoint_id,
+                                                   const char* kernel_name,
+                                                   const specialization& spec,
+                                                   Source_function get_source,
+                                                   Name_function get_module_name)
+  {
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      detail::entrypoint_kernel entry = find_specialized_kernel(entrypoint_id, spec.get_key());
+      if(entry.kernel)
+        return entry;
+    }
+
+    std::string program_name = get_module_name() + "<" + spec.get_key() + ">";
+    cl::Program prog = obtain_program(program_name, get_source(), &spec);
+    cl_int err;
+    kernel_ptr kernel = kernel_ptr(new cl::Kernel(prog, kernel_name, &err));
+    check_cl_error(err, "Could not create kernel object!");
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    // Another thread may have been faster
+    detail::entrypoint_kernel entry = find_specialized_kernel(entrypoint_id, spec.get_key());
+    if(entry.kernel)
+      return entry;
+
+    auto program = std::find_if(_specializations.begin(), _specializations.end(),
+                                [&program_name](const specialized_program& p)
+                                { return p.name == program_name; });
+    if(program == _specializations.end())
+    {
+      program = _specializations.insert(_specializations.begin(),
+                                        specialized_program{program_name, spec.get_key(), {}, {}});
+      std::lock_guard<std::mutex> programs_lock{_programs->mutex};
+      ++_programs->specialized_program_users[program_name];
+      ++_programs->specialization_key_users[spec.get_key()];
+    }
+    else
+      _specializations.splice(_specializations.begin(), _specializations, program);
+
+    auto kernel_entry = program->kernels.find(kernel_name);
+    if(kernel_entry == program->kernels.end())
+    {
+      entry.kernel = kernel;
+      entry.arguments = std::make_shared<detail::kernel_argument_cache>();
+      entry.name = std::make_shared<const std::string>(program_name + "::" + kernel_name);
+      if(_thread_safe_launches)
+        entry.instances = std::make_shared<detail::kernel_instance_pool>(kernel, entry.name);
+
+      kernel_entry = program->kernels.insert(std::make_pair(std::string{kernel_name}, entry)).first;
+      _kernel_names[(*kernel)()] = *entry.name;
+    }
+
+    if(entrypoint_id >= _specialized_entrypoints.size())
+      _specialized_entrypoints.resize(entrypoint_id + 1);
+    _specialized_entrypoints[entrypoint_id][spec.get_key()] =
+        specialized_kernel_ref{program, kernel_entry};
+    program->entrypoints.push_back(entrypoint_id);
+
+    evict_specializations();
+    return kernel_entry->second;
+  }
+
+  /// Sets the maximum number of specialized programs that are cached,
+  /// see \c get_specialized_kernel(). Must be at least 1. Each device context
+  /// has its own limit; a program evicted by this context remains in a
+  /// shared program cache as long as other device contexts still hold it.
+  void set_max_specializations(std::size_t max_specializations)
+  {
+    assert(max_specializations > 0);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _max_specializations = max_specializations;
+    evict_specializations();
+  }
+
+  /// \return The maximum number of cached specialized programs
+  std::size_t get_max_specializations() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _max_specializations;
+  }
+
+  /// \return The number of currently cached specialized programs
+  std::size_t get_num_specializations() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _specializations.size();
+  }
+
+  /// \return Whether thread-safe kernel launches are enabled
+  bool is_thread_safe_launch_enabled() const
+  {
+    return _thread_safe_launches;
+  }
+
   /// Create an OpenCL buffer object. For CPU devices, it will
   /// be attempted to construct a zero-copy buffer. In this case
   /// \c initial_data must remain valid!
@@ -585,23 +3020,19 @@ public:
                    std::size_t size,
                    T* initial_data = nullptr) const
   {
-    if(this->is_cpu_device())
-    {
-      // Try a zero-copy buffer
-      if(!initial_data)
-        flags |= CL_MEM_ALLOC_HOST_PTR;
-      else
-        flags |= CL_MEM_USE_HOST_PTR;
-    }
-    else
-    {
-      if(initial_data)
-        flags |= CL_MEM_COPY_HOST_PTR;
-    }
+    flags = get_buffer_flags(flags, initial_data != nullptr);
+
+    reserve_device_memory(size * sizeof(T));
 
     cl_int err;
     buffer_ptr buff = buffer_ptr(new cl::Buffer(_context, flags, size * sizeof(T), initial_data, &err));
+    if(is_allocation_failure(err))
+    {
+      release_cached_memory();
+      buff = buffer_ptr(new cl::Buffer(_context, flags, size * sizeof(T), initial_data, &err));
+    }
     check_cl_error(err, "Could not create buffer object!");
+    detail::memory_accounting::track(_memory_accounting, *buff, size * sizeof(T));
     
     return buff;
   }
@@ -621,23 +3052,19 @@ public:
                    std::size_t size,
                    T* initial_data = nullptr) const
   {
-    if(this->is_cpu_device())
-    {
-      // Try a zero-copy buffer
-      if(!initial_data)
-        flags |= CL_MEM_ALLOC_HOST_PTR;
-      else
-        flags |= CL_MEM_USE_HOST_PTR;
-    }
-    else
-    {
-      if(initial_data)
-        flags |= CL_MEM_COPY_HOST_PTR;
-    }
+    flags = get_buffer_flags(flags, initial_data != nullptr);
     
+    reserve_device_memory(size * sizeof(T));
+
     cl_int err;
     out = cl::Buffer(_context, flags, size * sizeof(T), initial_data, &err);
+    if(is_allocation_failure(err))
+    {
+      release_cached_memory();
+      out = cl::Buffer(_context, flags, size * sizeof(T), initial_data, &err);
+    }
     check_cl_error(err, "Could not create buffer object!");
+    detail::memory_accounting::track(_memory_accounting, out, size * sizeof(T));
   }
 
   /// Create a read-write OpenCL buffer object. For CPU devices, it will
@@ -726,18 +3153,160 @@ public:
     create_buffer<T>(out, CL_MEM_WRITE_ONLY, size, initial_data);
   }
   
+  /// Enables the memory pool of this device context. Buffers created with
+  /// \c create_pooled_buffer() (and hence \c device_array objects) are then
+  /// served from cached buffers where possible, and are returned to the
+  /// pool instead of being freed.
+  void enable_memory_pool()
+  {
+    if(!_memory_pool)
+      _memory_pool = std::make_shared<memory_pool>(_context);
+  }
+
+  /// Disables the memory pool. Buffers that have already been allocated
+  /// from the pool remain valid, and their memory is freed once they are
+  /// released. Until then, they still count towards the memory budget.
+  void disable_memory_pool()
+  {
+    _retired_memory_pools.erase(
+        std::remove_if(_retired_memory_pools.begin(), _retired_memory_pools.end(),
+                       [](const memory_pool_ptr& pool)
+                       { return pool->get_statistics().bytes_in_use == 0; }),
+        _retired_memory_pools.end());
+
+    if(!_memory_pool)
+      return;
+
+    // The pool is kept to count its buffers, but released buffers
+    // are freed instead of being cached
+    _memory_pool->set_max_bytes_cached(0);
+    _memory_pool->release_cached();
+    if(_memory_pool->get_statistics().bytes_in_use > 0)
+      _retired_memory_pools.push_back(_memory_pool);
+    _memory_pool = nullptr;
+  }
+
+  /// \return Whether the memory pool is enabled
+  bool is_memory_pool_enabled() const
+  {
+    return _memory_pool != nullptr;
+  }
+
+  /// \return The memory pool, or \c nullptr if the memory pool
+  /// is disabled. The pool can e.g. be used to query allocation statistics.
+  const memory_pool_ptr& get_memory_pool() const
+  {
+    return _memory_pool;
+  }
+
+  /// Create an OpenCL buffer object from the memory pool. If the memory
+  /// pool is disabled, the buffer is created as with \c create_buffer().
+  /// The buffer may be larger than requested if it is taken from the pool.
+  /// \return A pointer to the buffer object. When the pointer is
+  /// released, the buffer is returned to the pool.
+  /// \param flags The OpenCL flags for the allocated memory
+  /// \param size The number of elements to allocate
+  /// \tparam T The data type for which memory should be allocated
+  template<class T>
+  buffer_ptr create_pooled_buffer(cl_mem_flags flags,
+                                  std::size_t size) const
+  {
+    if(!_memory_pool)
+      return create_buffer<T>(flags, size);
+
+    // Only buffers that are not served from the cache need new memory
+    return _memory_pool->allocate(get_buffer_flags(flags, false),
+                                  size * sizeof(T),
+                                  [this](std::size_t num_bytes)
+                                  { reserve_device_memory(num_bytes); });
+  }
+
+  /// \return The size of the global memory of the device in bytes
+  std::size_t get_global_memory_size() const
+  {
+    cl_ulong size = 0;
+    check_cl_error(_device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &size),
+                   "Could not obtain device information!");
+    return static_cast<std::size_t>(size);
+  }
+
+  /// Sets the budget for the device memory allocated through this context,
+  /// i.e. by \c create_buffer(), \c create_pooled_buffer() and hence
+  /// \c device_array objects. If an allocation would exceed the budget,
+  /// the cached buffers of the memory pool are freed first. Allocations served
+  /// from cached pool buffers need no new memory and are not checked. If the
+  /// allocation then still exceeds the budget, the least recently used
+  /// specialized programs are evicted to free the device memory held by the
+  /// OpenCL implementation, and the allocation fails with a \c qcl_error with
+  /// code \c CL_MEM_OBJECT_ALLOCATION_FAILURE. The same memory is released
+  /// before an allocation is retried once if the OpenCL implementation runs
+  /// out of memory. By default, the budget is the size
+  /// of the global memory of the device. On devices shared with other
+  /// processes or contexts, a lower budget detects overcommitment before
+  /// the OpenCL implementation fails.
+  /// \param num_bytes The budget in bytes
+  void set_memory_budget(std::size_t num_bytes)
+  {
+    _memory_budget = num_bytes;
+  }
+
+  /// \return The budget for the device memory, see \c set_memory_budget()
+  std::size_t get_memory_budget() const
+  {
+    return _memory_budget;
+  }
+
+  /// \return The current device memory footprint of this context. Note
+  /// that buffers created directly through the OpenCL API are not included,
+  /// and that the pool statistics include buffers of all contexts sharing
+  /// the memory pool.
+  memory_footprint get_memory_footprint() const
+  {
+    memory_footprint footprint;
+    footprint.buffer_bytes = _memory_accounting->bytes_allocated;
+    footprint.num_buffers = _memory_accounting->num_buffers;
+    footprint.peak_buffer_bytes = _memory_accounting->peak_bytes_allocated;
+    footprint.num_evictions = _memory_accounting->num_evictions;
+
+    if(_memory_pool)
+    {
+      memory_pool_statistics pool_stats = _memory_pool->get_statistics();
+      footprint.pool_bytes_in_use = pool_stats.bytes_in_use;
+      footprint.pool_bytes_cached = pool_stats.bytes_cached;
+    }
+    for(const memory_pool_ptr& pool : _retired_memory_pools)
+      footprint.pool_bytes_in_use += pool->get_statistics().bytes_in_use;
+
+    {
+      std::lock_guard<std::mutex> lock{_programs->mutex};
+      footprint.num_programs = _programs->programs.size();
+    }
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      footprint.num_specializations = _specializations.size();
+    }
+
+    footprint.budget = _memory_budget;
+    footprint.global_memory_size = get_global_memory_size();
+    return footprint;
+  }
+
   template<class T>
   void memcpy_h2d(const cl::Buffer& buff,
                   const T* data,
                   std::size_t size,
                   command_queue_id queue = 0) const
   {   
-    cl_int err;
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(nullptr, profiling_event);
 
+    cl_int err;
     err = get_command_queue(queue).enqueueWriteBuffer(buff, CL_TRUE,
-                                                      0, size * sizeof(T), data);
+                                                      0, size * sizeof(T), data,
+                                                      nullptr, evt);
 
     check_cl_error(err, "Could not enqueue buffer write!");
+    record_transfer(profiled_command::memcpy_h2d, queue, size * sizeof(T), evt);
   }
 
   template<class T>
@@ -746,12 +3315,16 @@ public:
                   const std::vector<cl::Event>* dependencies=nullptr,
                   command_queue_id queue = 0) const
   {
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
     cl_int err;
     err = get_command_queue(queue).enqueueWriteBuffer(buff,
                                                       CL_FALSE, 0, size * sizeof(T),
-                                                      data, dependencies, event);
+                                                      data, dependencies, evt);
 
     check_cl_error(err, "Could not enqueue async buffer write!");
+    record_transfer(profiled_command::memcpy_h2d, queue, size * sizeof(T), evt);
   }
   
   template<class T>
@@ -760,13 +3333,16 @@ public:
                   std::size_t size,
                   command_queue_id queue = 0) const
   {
-    cl_int err;
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(nullptr, profiling_event);
 
+    cl_int err;
     err = get_command_queue(queue).enqueueReadBuffer(buff,
                                                      CL_TRUE, 0, size * sizeof(T), 
-                                                     data);
+                                                     data, nullptr, evt);
 
     check_cl_error(err, "Could not enqueue buffer write!");
+    record_transfer(profiled_command::memcpy_d2h, queue, size * sizeof(T), evt);
   }
   
   template<class T>
@@ -777,11 +3353,15 @@ public:
                   const std::vector<cl::Event>* dependencies = nullptr,
                   command_queue_id queue = 0) const
   {
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
     cl_int err;
     err = get_command_queue(queue).enqueueReadBuffer(buff, CL_FALSE, 0, size * sizeof(T),
-                                                     data, dependencies, event);
+                                                     data, dependencies, evt);
 
     check_cl_error(err, "Could not enqueue async buffer write!");
+    record_transfer(profiled_command::memcpy_d2h, queue, size * sizeof(T), evt);
   }
 
 
@@ -794,12 +3374,16 @@ public:
     assert(end > begin);
     std::size_t size = end - begin;
 
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(nullptr, profiling_event);
+
     cl_int err;
     err = get_command_queue(queue).enqueueWriteBuffer(buff, CL_TRUE,
                                                       begin * sizeof(T),
                                                       size * sizeof(T),
-                                                      data);
+                                                      data, nullptr, evt);
     check_cl_error(err, "Could not enqueue buffer write!");
+    record_transfer(profiled_command::memcpy_h2d, queue, size * sizeof(T), evt);
   }
 
   template<class T>
@@ -814,13 +3398,17 @@ public:
     assert(end > begin);
     std::size_t size = end - begin;
 
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
     cl_int err;
     err = get_command_queue(queue).enqueueWriteBuffer(buff, CL_FALSE,
                                                       begin * sizeof(T), 
                                                       size * sizeof(T),
-                                                      data, dependencies, event);
+                                                      data, dependencies, evt);
 
     check_cl_error(err, "Could not enqueue async buffer write!");
+    record_transfer(profiled_command::memcpy_h2d, queue, size * sizeof(T), evt);
   }
   
   template<class T>
@@ -833,13 +3421,17 @@ public:
     assert(end > begin);
     std::size_t size = end - begin;
 
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(nullptr, profiling_event);
+
     cl_int err;
     err = get_command_queue(queue).enqueueReadBuffer(buff, CL_TRUE,
                                                      begin * sizeof(T), 
                                                      size * sizeof(T),
-                                                     data);
+                                                     data, nullptr, evt);
 
     check_cl_error(err, "Could not enqueue buffer write!");
+    record_transfer(profiled_command::memcpy_d2h, queue, size * sizeof(T), evt);
   }
   
   template<class T>
@@ -854,13 +3446,186 @@ public:
     assert(end > begin);
     std::size_t size = end - begin;
 
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
     cl_int err;
     err = get_command_queue(queue).enqueueReadBuffer(buff, CL_FALSE,
                                                      begin * sizeof(T),
                                                      size * sizeof(T),
-                                                     data, dependencies, event);
+                                                     data, dependencies, evt);
 
     check_cl_error(err, "Could not enqueue async buffer write!");
+    record_transfer(profiled_command::memcpy_d2h, queue, size * sizeof(T), evt);
+  }
+  
+  /// Writes a rectangular region of host memory into a rectangular
+  /// region of a buffer asynchronously. As in \c clEnqueueWriteBufferRect(),
+  /// the first component of the origins and the region as well as all
+  /// pitches are given in bytes.
+  /// \param buff The destination buffer
+  /// \param data The host memory
+  /// \param buffer_origin The origin of the region in the buffer
+  /// \param host_origin The origin of the region in the host memory
+  /// \param region The size of the region
+  /// \param buffer_row_pitch The size of a row of the buffer in bytes
+  /// \param buffer_slice_pitch The size of a 2D slice of the buffer in bytes
+  /// \param host_row_pitch The size of a row of the host memory in bytes
+  /// \param host_slice_pitch The size of a 2D slice of the host memory in bytes
+  void memcpy_h2d_rect_async(const cl::Buffer& buff,
+                             const void* data,
+                             const cl::array<cl::size_type, 3>& buffer_origin,
+                             const cl::array<cl::size_type, 3>& host_origin,
+                             const cl::array<cl::size_type, 3>& region,
+                             std::size_t buffer_row_pitch,
+                             std::size_t buffer_slice_pitch,
+                             std::size_t host_row_pitch,
+                             std::size_t host_slice_pitch,
+                             cl::Event* event,
+                             const std::vector<cl::Event>* dependencies = nullptr,
+                             command_queue_id queue = 0) const
+  {
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
+    cl_int err;
+    err = get_command_queue(queue).enqueueWriteBufferRect(buff, CL_FALSE,
+                                                          buffer_origin, host_origin, region,
+                                                          buffer_row_pitch, buffer_slice_pitch,
+                                                          host_row_pitch, host_slice_pitch,
+                                                          data, dependencies, evt);
+
+    check_cl_error(err, "Could not enqueue async rectangular buffer write!");
+    record_transfer(profiled_command::memcpy_h2d, queue,
+                    region[0] * region[1] * region[2], evt);
+  }
+
+  /// Reads a rectangular region of a buffer into a rectangular region of
+  /// host memory asynchronously. As in \c clEnqueueReadBufferRect(),
+  /// the first component of the origins and the region as well as all
+  /// pitches are given in bytes.
+  /// \param data The host memory
+  /// \param buff The source buffer
+  /// \param buffer_origin The origin of the region in the buffer
+  /// \param host_origin The origin of the region in the host memory
+  /// \param region The size of the region
+  /// \param buffer_row_pitch The size of a row of the buffer in bytes
+  /// \param buffer_slice_pitch The size of a 2D slice of the buffer in bytes
+  /// \param host_row_pitch The size of a row of the host memory in bytes
+  /// \param host_slice_pitch The size of a 2D slice of the host memory in bytes
+  void memcpy_d2h_rect_async(void* data,
+                             const cl::Buffer& buff,
+                             const cl::array<cl::size_type, 3>& buffer_origin,
+                             const cl::array<cl::size_type, 3>& host_origin,
+                             const cl::array<cl::size_type, 3>& region,
+                             std::size_t buffer_row_pitch,
+                             std::size_t buffer_slice_pitch,
+                             std::size_t host_row_pitch,
+                             std::size_t host_slice_pitch,
+                             cl::Event* event,
+                             const std::vector<cl::Event>* dependencies = nullptr,
+                             command_queue_id queue = 0) const
+  {
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
+    cl_int err;
+    err = get_command_queue(queue).enqueueReadBufferRect(buff, CL_FALSE,
+                                                         buffer_origin, host_origin, region,
+                                                         buffer_row_pitch, buffer_slice_pitch,
+                                                         host_row_pitch, host_slice_pitch,
+                                                         data, dependencies, evt);
+
+    check_cl_error(err, "Could not enqueue async rectangular buffer read!");
+    record_transfer(profiled_command::memcpy_d2h, queue,
+                    region[0] * region[1] * region[2], evt);
+  }
+
+  /// \return Whether this device context uses the same OpenCL context as
+  /// another device context. In this case, buffers can be used by both
+  /// device contexts, e.g. for \c memcpy_d2d().
+  /// \param other The other device context
+  bool shares_context_with(const device_context& other) const
+  {
+    return _context() == other._context();
+  }
+
+  /// \return Whether this device context shares its program cache with other
+  /// device contexts, i.e. programs are built for several devices at once.
+  bool is_program_cache_shared() const
+  {
+    return _programs && _programs->devices.size() > 1;
+  }
+
+  /// Copies data between two buffers of the OpenCL context of this device
+  /// context. The buffers may belong to other device contexts sharing the same
+  /// OpenCL context, which allows copies between devices without a round trip
+  /// through host memory.
+  /// \param dst The destination buffer
+  /// \param src The source buffer
+  /// \param size The number of elements to copy
+  /// \param queue The command queue used for the copy
+  template<class T>
+  void memcpy_d2d(const cl::Buffer& dst,
+                  const cl::Buffer& src,
+                  std::size_t size,
+                  command_queue_id queue = 0) const
+  {
+    this->memcpy_d2d<T>(dst, 0, src, 0, size, queue);
+  }
+
+  template<class T>
+  void memcpy_d2d_async(const cl::Buffer& dst,
+                        const cl::Buffer& src,
+                        std::size_t size,
+                        cl::Event* event,
+                        const std::vector<cl::Event>* dependencies = nullptr,
+                        command_queue_id queue = 0) const
+  {
+    this->memcpy_d2d_async<T>(dst, 0, src, 0, size, event, dependencies, queue);
+  }
+
+  /// Copies the elements [src_begin, src_end) of a buffer to a different
+  /// buffer, starting at element \c dst_begin.
+  template<class T>
+  void memcpy_d2d(const cl::Buffer& dst,
+                  std::size_t dst_begin,
+                  const cl::Buffer& src,
+                  std::size_t src_begin,
+                  std::size_t src_end,
+                  command_queue_id queue = 0) const
+  {
+    cl::Event evt;
+    this->memcpy_d2d_async<T>(dst, dst_begin, src, src_begin, src_end, &evt,
+                              nullptr, queue);
+    check_cl_error(evt.wait(), "Could not wait for buffer copy!");
+  }
+
+  template<class T>
+  void memcpy_d2d_async(const cl::Buffer& dst,
+                        std::size_t dst_begin,
+                        const cl::Buffer& src,
+                        std::size_t src_begin,
+                        std::size_t src_end,
+                        cl::Event* event,
+                        const std::vector<cl::Event>* dependencies = nullptr,
+                        command_queue_id queue = 0) const
+  {
+    assert(src_end > src_begin);
+    std::size_t size = src_end - src_begin;
+
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
+    cl_int err;
+    err = get_command_queue(queue).enqueueCopyBuffer(src, dst,
+                                                     src_begin * sizeof(T),
+                                                     dst_begin * sizeof(T),
+                                                     size * sizeof(T),
+                                                     dependencies, evt);
+
+    check_cl_error(err, "Could not enqueue buffer copy!");
+    record_transfer(profiled_command::memcpy_d2d, queue, size * sizeof(T), evt);
   }
   
   /// Queries the OpenCL extensions supported by a given device.
@@ -903,10 +3668,14 @@ public:
   /// \param props Optional properties of the queue
   command_queue_id add_command_queue(cl_command_queue_properties props = 0)
   {
+    if(_profiler)
+      props |= CL_QUEUE_PROFILING_ENABLE;
+
     cl_int err;
     _queues.push_back(cl::CommandQueue(_context, _device, props, &err));
     
     check_cl_error(err, "Could not create command queue!");
+    _queue_properties.push_back(props);
 
     return _queues.size() - 1;
   }
@@ -933,43 +3702,229 @@ public:
       add_command_queue();
   }
 
-  cl_int enqueue_ndrange_kernel(const kernel_ptr& kernel,
-                                const cl::NDRange& minimum_num_work_items,
-                                const cl::NDRange& num_local_items,
-                                cl::Event* event = nullptr,
-                                const cl::NDRange& offset = cl::NullRange,
-                                const std::vector<cl::Event>* dependencies = nullptr,
-                                command_queue_id queue = 0)
+  cl_int enqueue_ndrange_kernel(const kernel_ptr& kernel,
+                                const cl::NDRange& minimum_num_work_items,
+                                const cl::NDRange& num_local_items,
+                                cl::Event* event = nullptr,
+                                const cl::NDRange& offset = cl::NullRange,
+                                const std::vector<cl::Event>* dependencies = nullptr,
+                                command_queue_id queue = 0,
+                                const std::string* kernel_name = nullptr)
+  {
+    cl::Event profiling_event;
+    cl::Event* evt = get_profiling_event(event, profiling_event);
+
+    cl_int err = enqueue_unprofiled_ndrange_kernel(kernel, minimum_num_work_items,
+                                                   num_local_items, evt, offset,
+                                                   dependencies, queue);
+    if(_profiler && err == CL_SUCCESS)
+    {
+      if(kernel_name)
+        _profiler->record(*kernel_name, profiled_command::kernel, queue, 0, *evt);
+      else
+        _profiler->record(get_scoped_kernel_name(*kernel), profiled_command::kernel,
+                          queue, 0, *evt);
+    }
+    return err;
+  }
+
+  /// Enqueues a kernel like \c enqueue_ndrange_kernel(), but never records
+  /// it in the profiler. This is used for launches that are not part of
+  /// the workload, such as the benchmark launches of the autotuner.
+  cl_int enqueue_unprofiled_ndrange_kernel(const kernel_ptr& kernel,
+                                           const cl::NDRange& minimum_num_work_items,
+                                           const cl::NDRange& num_local_items,
+                                           cl::Event* event = nullptr,
+                                           const cl::NDRange& offset = cl::NullRange,
+                                           const std::vector<cl::Event>* dependencies = nullptr,
+                                           command_queue_id queue = 0)
+  {
+    assert(queue < get_num_command_queues());
+
+    cl::NDRange global = minimum_num_work_items;
+    // Only make the global size a multiple of the lcoal size
+    // if we are not using a NullRange, i.e. the dimensions are > 0
+    if(num_local_items.dimensions() > 0)
+    {
+      assert(minimum_num_work_items.dimensions() == num_local_items.dimensions());
+
+      for(std::size_t i = 0; i < minimum_num_work_items.dimensions(); ++i)
+      {
+        std::size_t work_items = minimum_num_work_items.get()[i];
+        std::size_t local_items = num_local_items.get()[i];
+
+        std::size_t multiple = (work_items/local_items)*local_items;
+        if(multiple != work_items)
+          multiple += local_items;
+
+        assert(multiple % local_items == 0 && multiple >= work_items);
+        global.get()[i] = multiple;
+      }
+    }
+    return get_command_queue(queue).enqueueNDRangeKernel(*kernel,
+                                                         offset,
+                                                         global,
+                                                         num_local_items,
+                                                         dependencies,
+                                                         event);
+  }
+
+  /// Enables the profiling mode. All existing command queues are replaced
+  /// by profiling-enabled queues with the same properties (after finishing
+  /// the commands enqueued so far), and all command queues created later
+  /// on have profiling enabled as well. Afterwards, all kernel launches through
+  /// \c enqueue_ndrange_kernel() (and hence \c kernel_call and entrypoints)
+  /// and all \c memcpy_* calls are recorded by the profiler returned by
+  /// \c get_profiler(), under the scoped name of the kernel or the name of
+  /// the memcpy function, respectively.
+  /// Commands enqueued directly into the command queues are not recorded.
+  /// Must not be called while other threads use the device context.
+  void enable_profiling()
+  {
+    if(_profiler)
+      return;
+
+    for(std::size_t i = 0; i < _queues.size(); ++i)
+    {
+      if(_queue_properties[i] & CL_QUEUE_PROFILING_ENABLE)
+        continue;
+
+      check_cl_error(_queues[i].finish(), "Could not finish command queue!");
+
+      cl_int err;
+      _queue_properties[i] |= CL_QUEUE_PROFILING_ENABLE;
+      _queues[i] = cl::CommandQueue(_context, _device, _queue_properties[i], &err);
+      check_cl_error(err, "Could not create profiling command queue!");
+    }
+
+    _profiler = std::make_shared<profiler>();
+  }
+
+  /// Stops recording commands. The command queues remain profiling-enabled,
+  /// and the profiler returned by \c get_profiler() before this call remains
+  /// valid.
+  void disable_profiling()
+  {
+    _profiler = nullptr;
+  }
+
+  /// \return Whether the profiling mode is enabled
+  bool is_profiling_enabled() const
+  {
+    return _profiler != nullptr;
+  }
+
+  /// \return The profiler that records the commands of this device context,
+  /// or \c nullptr if the profiling mode is not enabled.
+  const profiler_ptr& get_profiler() const
+  {
+    return _profiler;
+  }
+
+  /// Determines the fastest work group size for a kernel launch with the
+  /// autotuner. If the tuner already knows a work group size for this device,
+  /// kernel and problem size bucket, it is returned directly. Otherwise, the
+  /// kernel is benchmarked with candidate work group sizes that respect
+  /// \c CL_KERNEL_WORK_GROUP_SIZE and are multiples of
+  /// \c CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, and the fastest
+  /// candidate is stored in the tuner.
+  /// Kernels with a required work group size (\c reqd_work_group_size)
+  /// are not tuned.
+  /// \return The tuned work group size, or \c default_local_size if no
+  /// candidate could be launched.
+  /// \param kernel The kernel, with all arguments set
+  /// \param global_size The global size of the launch
+  /// \param default_local_size The work group size used if tuning is not possible
+  /// \param launch A function that enqueues the kernel with a given
+  /// work group size into the command queue \c queue. It will be called
+  /// several times during benchmarking, and should bypass the profiler,
+  /// e.g. by using \c enqueue_unprofiled_ndrange_kernel().
+  /// \param queue The command queue into which \c launch enqueues the kernel
+  cl::NDRange get_tuned_work_group_size(const kernel_ptr& kernel,
+                                        const cl::NDRange& global_size,
+                                        const cl::NDRange& default_local_size,
+                                        const std::function<cl_int (const cl::NDRange&)>& launch,
+                                        command_queue_id queue = 0,
+                                        const std::string* kernel_name = nullptr)
   {
-    assert(queue < get_num_command_queues());
+    if(global_size.dimensions() == 0)
+      return default_local_size;
 
-    cl::NDRange global = minimum_num_work_items;
-    // Only make the global size a multiple of the lcoal size
-    // if we are not using a NullRange, i.e. the dimensions are > 0
-    if(num_local_items.dimensions() > 0)
-    {
-      assert(minimum_num_work_items.dimensions() == num_local_items.dimensions());
+    std::size_t compile_size [3] = {0, 0, 0};
+    if(clGetKernelWorkGroupInfo((*kernel)(), _device(), CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                                sizeof(compile_size), compile_size, nullptr) == CL_SUCCESS
+       && compile_size[0] != 0)
+      return default_local_size;
 
-      for(std::size_t i = 0; i < minimum_num_work_items.dimensions(); ++i)
-      {
-        std::size_t work_items = minimum_num_work_items.get()[i];
-        std::size_t local_items = num_local_items.get()[i];
+    const std::string key = work_group_tuner::get_key(
+          get_device_name() + " " + get_device_info_string(_device, CL_DRIVER_VERSION),
+          kernel_name ? *kernel_name : get_scoped_kernel_name(*kernel),
+          global_size);
 
-        std::size_t multiple = (work_items/local_items)*local_items;
-        if(multiple != work_items)
-          multiple += local_items;
+    cl::NDRange tuned_size;
+    if(_tuner->lookup(key, tuned_size) &&
+       tuned_size.dimensions() == global_size.dimensions())
+      return tuned_size;
 
-        assert(multiple % local_items == 0 && multiple >= work_items);
-        global.get()[i] = multiple;
+    const std::size_t num_repetitions = 3;
+
+    cl::CommandQueue& benchmark_queue = get_command_queue(queue);
+    check_cl_error(benchmark_queue.finish(), "Could not finish command queue!");
+
+    bool found = false;
+    double best_time = std::numeric_limits<double>::max();
+
+    for(const cl::NDRange& candidate : get_work_group_size_candidates(*kernel, global_size))
+    {
+      // Warm-up launch, which also rejects candidates that cannot be launched
+      if(launch(candidate) != CL_SUCCESS || benchmark_queue.finish() != CL_SUCCESS)
+        continue;
+
+      bool success = true;
+      auto start = std::chrono::steady_clock::now();
+      for(std::size_t i = 0; i < num_repetitions && success; ++i)
+        success = (launch(candidate) == CL_SUCCESS);
+      success = success && (benchmark_queue.finish() == CL_SUCCESS);
+      auto stop = std::chrono::steady_clock::now();
+
+      double time = std::chrono::duration<double>(stop - start).count();
+      if(success && time < best_time)
+      {
+        found = true;
+        best_time = time;
+        tuned_size = candidate;
       }
     }
-    cl_int err = get_command_queue(queue).enqueueNDRangeKernel(*kernel,
-                                                               offset,
-                                                               global,
-                                                               num_local_items,
-                                                               dependencies,
-                                                               event);
-    return err;
+
+    if(!found)
+      return default_local_size;
+
+    _tuner->store(key, tuned_size);
+    return tuned_size;
+  }
+
+  /// Sets the tuner in which the autotuner stores its results. The tuner
+  /// can be shared between several device contexts.
+  void set_work_group_tuner(const work_group_tuner_ptr& tuner)
+  {
+    assert(tuner != nullptr);
+    _tuner = tuner;
+  }
+
+  /// \return The tuner in which the autotuner stores its results.
+  /// By default, every device context has its own in-memory tuner.
+  const work_group_tuner_ptr& get_work_group_tuner() const
+  {
+    return _tuner;
+  }
+
+  /// Makes the results of the autotuner persistent by replacing the tuner
+  /// by one that stores its results in a file. Results from previous
+  /// runs are loaded from the file.
+  /// \param filename The file in which the results are stored
+  void enable_persistent_autotuning(const std::string& filename)
+  {
+    _tuner = std::make_shared<work_group_tuner>(filename);
   }
 
 
@@ -1002,6 +3957,60 @@ public:
     this->append_build_option("-cl-fast-relaxed-math");
   }
 
+  /// Enables separate compilation of modules. Modules that declare an
+  /// interface with \c QCL_MODULE_INTERFACE() are then compiled only once
+  /// per OpenCL context into an object with \c clCompileProgram(). Programs
+  /// including such a module only see its interface, and the module's
+  /// object is linked to them with \c clLinkProgram(). This avoids
+  /// recompiling large modules that are included by many other modules.
+  /// Modules included by a specialized program (see \c specialization) are
+  /// compiled once per specialization with the same definitions as the
+  /// program. Modules without an interface are still inlined into every program or
+  /// object that includes them, so they should only contain definitions that
+  /// may appear in several objects (e.g. macros, types and \c static
+  /// functions). Programs built with separate compilation are not stored in
+  /// the persistent binary cache.
+  /// Must be called before any programs are compiled.
+  /// \param enable Whether separate compilation should be used
+  void enable_separate_compilation(bool enable = true)
+  {
+    this->_separate_compilation = enable;
+  }
+
+  /// \return Whether modules are compiled separately, see
+  /// \c enable_separate_compilation()
+  bool is_separate_compilation_enabled() const
+  {
+    return _separate_compilation;
+  }
+
+  /// Enables the persistent on-disk cache for compiled program binaries.
+  /// Programs are then only compiled from source if no matching binary
+  /// is found in the cache. Entries are keyed by the processed source code,
+  /// the build options, the device name, the driver version and the OpenCL
+  /// version of the device, such that stale entries are never used after
+  /// e.g. a driver update. Entries that cannot be loaded fall back to
+  /// a compilation from source.
+  /// \param directory The directory in which the binaries are stored.
+  /// The directory must already exist.
+  void enable_binary_cache(const std::string& directory)
+  {
+    _binary_cache = std::make_shared<detail::program_binary_cache>(directory);
+  }
+
+  /// Disables the persistent on-disk cache for compiled program binaries.
+  /// Already cached entries are not deleted.
+  void disable_binary_cache()
+  {
+    _binary_cache = nullptr;
+  }
+
+  /// \return Whether the persistent on-disk binary cache is enabled
+  bool is_binary_cache_enabled() const
+  {
+    return _binary_cache != nullptr;
+  }
+
 private:
 
   /// Loads and creates specified kernel objects
@@ -1020,14 +4029,452 @@ private:
 
     for(std::size_t i = 0; i < kernel_names.size(); ++i)
     {
+      // Another thread may have loaded the kernel in the meantime
+      if(_kernels.find(prefix+kernel_names[i]) != _kernels.end())
+        continue;
+
       cl_int err;
       kernel_ptr kernel = kernel_ptr(new cl::Kernel(prog, kernel_names[i].c_str(), &err));
       check_cl_error(err, "Could not create kernel object!");
 
       _kernels[prefix+kernel_names[i]] = kernel;
+      _kernel_names[(*kernel)()] = prefix+kernel_names[i];
     }
   }
   
+  /// \return The memory flags used for new buffers. For CPU devices, zero-copy
+  /// buffers are requested. For other devices with unified memory, buffers
+  /// are allocated in host-accessible memory, such that they can be mapped
+  /// without copies.
+  /// \param flags The memory flags requested by the user
+  /// \param has_initial_data Whether the buffer is initialized from
+  /// a host pointer
+  cl_mem_flags get_buffer_flags(cl_mem_flags flags, bool has_initial_data) const
+  {
+    if(this->is_cpu_device())
+    {
+      // Try a zero-copy buffer
+      if(!has_initial_data)
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+      else
+        flags |= CL_MEM_USE_HOST_PTR;
+    }
+    else
+    {
+      if(this->has_unified_memory())
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+      if(has_initial_data)
+        flags |= CL_MEM_COPY_HOST_PTR;
+    }
+    return flags;
+  }
+
+  /// Retrieves a program from the program cache, or compiles it if it is
+  /// not yet cached. The compilation takes place without holding any lock,
+  /// such that different programs can be compiled concurrently. If another
+  /// thread (or another device context sharing the program cache) is already
+  /// compiling the program, waits until it is available.
+  /// \return The compiled program
+  /// \param program_name The identifier of the program in the cache
+  /// \param source_code The unprocessed source code of the program
+  /// \param spec If not \c nullptr, the specialization whose definitions
+  /// precede the source code of the program and of its separately
+  /// compiled modules
+  cl::Program obtain_program(const std::string& program_name,
+                             const std::string& source_code,
+                             const specialization* spec = nullptr)
+  {
+    std::unique_lock<std::mutex> lock{_programs->mutex};
+
+    auto cached_program = _programs->programs.find(program_name);
+    if(cached_program != _programs->programs.end())
+    {
+      std::shared_future<cl::Program> program = cached_program->second;
+      lock.unlock();
+      // Rethrows the compilation error, if the compilation has failed
+      // in a different thread
+      return program.get();
+    }
+
+    std::promise<cl::Program> promise;
+    _programs->programs[program_name] = promise.get_future().share();
+
+    lock.unlock();
+    try
+    {
+      cl::Program prog;
+      if(_separate_compilation)
+        link_source(source_code, spec, prog);
+      else
+      {
+        detail::meta_source_processor source_processor;
+        std::string definitions = spec ? spec->get_definitions() : std::string{};
+        compile_source(source_processor(definitions + source_code), prog);
+      }
+
+      promise.set_value(prog);
+      return prog;
+    }
+    catch(...)
+    {
+      promise.set_exception(std::current_exception());
+
+      lock.lock();
+      // Allow new attempts to compile the program
+      _programs->programs.erase(program_name);
+      throw;
+    }
+  }
+
+  /// \return The event that should be passed to an enqueue call. If the
+  /// profiling mode is enabled and the caller is not interested in the
+  /// event, the local event is used such that the command can be recorded.
+  /// \param event The event requested by the caller, may be \c nullptr
+  /// \param local_event A local event
+  cl::Event* get_profiling_event(cl::Event* event, cl::Event& local_event) const
+  {
+    if(_profiler && !event)
+      return &local_event;
+    return event;
+  }
+
+  /// Records a memory transfer, if the profiling mode is enabled.
+  void record_transfer(profiled_command command,
+                       command_queue_id queue,
+                       std::size_t bytes,
+                       const cl::Event* evt) const
+  {
+    if(_profiler && evt)
+      _profiler->record(get_profiled_command_name(command), command,
+                        queue, bytes, *evt);
+  }
+
+  /// A module compiled for a set of runtime values, see
+  /// \c get_specialized_kernel()
+  struct specialized_program
+  {
+    /// The name of the program in the program cache
+    std::string name;
+    /// The key of the specialization, see \c specialization::get_key()
+    std::string key;
+    /// The kernels that have been created from the program, by name
+    std::map<std::string, detail::entrypoint_kernel> kernels;
+    /// The entrypoints whose entries in \c _specialized_entrypoints
+    /// refer to this program
+    std::vector<std::size_t> entrypoints;
+  };
+
+  /// A kernel of a specialized program
+  struct specialized_kernel_ref
+  {
+    std::list<specialized_program>::iterator program;
+    std::map<std::string, detail::entrypoint_kernel>::iterator kernel;
+  };
+
+  /// Looks up the kernel of a specialized entrypoint and marks its program
+  /// as most recently used. Must be called with \c _mutex locked.
+  /// \return The kernel, or an empty entry if it has not been created yet
+  /// \param entrypoint_id The id of the entrypoint
+  /// \param key The key of the specialization
+  detail::entrypoint_kernel find_specialized_kernel(std::size_t entrypoint_id,
+                                                    const std::string& key)
+  {
+    if(entrypoint_id >= _specialized_entrypoints.size())
+      return detail::entrypoint_kernel{};
+
+    const auto& kernels = _specialized_entrypoints[entrypoint_id];
+    auto kernel = kernels.find(key);
+    if(kernel == kernels.end())
+      return detail::entrypoint_kernel{};
+
+    // Move to the front of the LRU list
+    _specializations.splice(_specializations.begin(), _specializations,
+                            kernel->second.program);
+    return kernel->second.kernel->second;
+  }
+
+  /// Removes the least recently used specialized programs exceeding
+  /// \c _max_specializations from the caches. Kernel calls that still
+  /// hold kernels of these programs remain valid.
+  /// Must be called with \c _mutex locked.
+  void evict_specializations() const
+  {
+    evict_specializations(_max_specializations);
+  }
+
+  /// Removes the least recently used specialized programs from the
+  /// caches, until at most the given number of programs remains.
+  /// Must be called with \c _mutex locked.
+  /// \param num_retained The number of programs to keep
+  void evict_specializations(std::size_t num_retained) const
+  {
+    while(_specializations.size() > num_retained)
+    {
+      const specialized_program& program = _specializations.back();
+      for(const auto& kernel : program.kernels)
+        _kernel_names.erase((*kernel.second.kernel)());
+      for(std::size_t entrypoint_id : program.entrypoints)
+        _specialized_entrypoints[entrypoint_id].erase(program.key);
+
+      release_shared_specialization(program);
+      _specializations.pop_back();
+    }
+  }
+
+  /// Removes a specialized program that this context no longer holds from
+  /// the shared program cache, unless other device contexts sharing the
+  /// cache still hold it.
+  /// \param program The specialized program
+  void release_shared_specialization(const specialized_program& program) const
+  {
+    std::lock_guard<std::mutex> programs_lock{_programs->mutex};
+
+    if(release_user(_programs->specialized_program_users, program.name))
+      _programs->programs.erase(program.name);
+
+    // Modules compiled for an empty specialization are shared with
+    // unspecialized programs
+    if(release_user(_programs->specialization_key_users, program.key) &&
+       !program.key.empty())
+      for(auto module = _programs->modules.begin();
+          module != _programs->modules.end();)
+      {
+        if(module->first.second == program.key)
+          module = _programs->modules.erase(module);
+        else
+          ++module;
+      }
+  }
+
+  /// Decrements a user count of the program cache.
+  /// \return Whether the count has dropped to zero
+  static bool release_user(std::map<std::string, std::size_t>& users,
+                           const std::string& name)
+  {
+    auto count = users.find(name);
+    if(count == users.end())
+      return true;
+    if(--count->second > 0)
+      return false;
+    users.erase(count);
+    return true;
+  }
+
+  /// \return The name under which a kernel has been registered, including
+  /// its scope. Kernel instances created from a registered kernel (e.g. for
+  /// entrypoints and thread-safe launches) are resolved to the name of the
+  /// kernel they have been created from. Falls back to the function name of
+  /// the kernel, if the kernel is unknown. Launches through \c kernel_call
+  /// pass the name stored with their kernel instance instead, since resolving
+  /// unknown kernels requires querying all registered kernels.
+  std::string get_scoped_kernel_name(const cl::Kernel& kernel) const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return lookup_scoped_kernel_name(kernel);
+  }
+
+  /// Implements \c get_scoped_kernel_name(). Must be called with
+  /// \c _mutex locked.
+  std::string lookup_scoped_kernel_name(const cl::Kernel& kernel) const
+  {
+    auto known_name = _kernel_names.find(kernel());
+    if(known_name != _kernel_names.end())
+      return known_name->second;
+
+    std::string function_name;
+    cl::Program program;
+    kernel.getInfo(CL_KERNEL_FUNCTION_NAME, &function_name);
+    kernel.getInfo(CL_KERNEL_PROGRAM, &program);
+    detail::remove_zeros(function_name);
+
+    for(const auto& registered : _kernels)
+    {
+      std::string registered_function_name;
+      cl::Program registered_program;
+      registered.second->getInfo(CL_KERNEL_FUNCTION_NAME, &registered_function_name);
+      registered.second->getInfo(CL_KERNEL_PROGRAM, &registered_program);
+      detail::remove_zeros(registered_function_name);
+
+      if(registered_program() == program() &&
+         registered_function_name == function_name)
+        return registered.first;
+    }
+    return function_name;
+  }
+
+  /// \return The work group sizes that are considered by the autotuner
+  /// for a kernel launch.
+  /// \param kernel The kernel
+  /// \param global_size The global size of the launch
+  std::vector<cl::NDRange>
+  get_work_group_size_candidates(const cl::Kernel& kernel,
+                                 const cl::NDRange& global_size) const
+  {
+    std::size_t max_size = 1;
+    std::size_t multiple = 1;
+    if(kernel.getWorkGroupInfo(_device, CL_KERNEL_WORK_GROUP_SIZE, &max_size) != CL_SUCCESS
+       || max_size == 0)
+      max_size = 1;
+    if(kernel.getWorkGroupInfo(_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                               &multiple) != CL_SUCCESS || multiple == 0)
+      multiple = 1;
+
+    std::vector<std::size_t> max_item_sizes;
+    _device.getInfo(CL_DEVICE_MAX_WORK_ITEM_SIZES, &max_item_sizes);
+
+    const std::size_t dimensions = global_size.dimensions();
+    std::vector<std::vector<std::size_t>> sizes(dimensions);
+    for(std::size_t dim = 0; dim < dimensions; ++dim)
+    {
+      // There is no point in work groups larger than the problem size
+      std::size_t limit = 1;
+      while(limit < global_size.get()[dim])
+        limit *= 2;
+      limit = std::min(limit, max_size);
+      if(dim < max_item_sizes.size())
+        limit = std::min(limit, max_item_sizes[dim]);
+
+      // The first dimension should be a multiple of the preferred
+      // work group size multiple, the others are powers of two.
+      std::size_t step = (dim == 0) ? multiple : 1;
+      for(std::size_t size = step; size <= limit; size *= 2)
+        sizes[dim].push_back(size);
+
+      if(sizes[dim].empty())
+        sizes[dim].push_back(std::max<std::size_t>(limit, 1));
+    }
+
+    std::vector<cl::NDRange> candidates;
+    for(std::size_t x : sizes[0])
+    {
+      if(dimensions == 1)
+      {
+        candidates.push_back(cl::NDRange(x));
+        continue;
+      }
+      for(std::size_t y : sizes[1])
+      {
+        if(x * y > max_size)
+          break;
+        if(dimensions == 2)
+        {
+          candidates.push_back(cl::NDRange(x, y));
+          continue;
+        }
+        for(std::size_t z : sizes[2])
+        {
+          if(x * y * z > max_size)
+            break;
+          candidates.push_back(cl::NDRange(x, y, z));
+        }
+      }
+    }
+    return candidates;
+  }
+
+  /// Compiles queued programs until the queue of background
+  /// compilations is empty.
+  void run_precompile_worker()
+  {
+    for(;;)
+    {
+      std::pair<std::string, std::string> job;
+      {
+        std::lock_guard<std::mutex> lock{_precompile_mutex};
+        if(_precompile_queue.empty())
+        {
+          --_num_active_precompile_workers;
+          return;
+        }
+        job = std::move(_precompile_queue.front());
+        _precompile_queue.pop_front();
+      }
+
+      try
+      {
+        obtain_program(job.first, job.second);
+      }
+      catch(...)
+      {
+        std::lock_guard<std::mutex> lock{_precompile_mutex};
+        if(!_precompile_error)
+          _precompile_error = std::current_exception();
+      }
+    }
+  }
+
+  /// \return The number of bytes allocated through this context that
+  /// count towards the memory budget
+  std::size_t get_allocated_memory() const
+  {
+    std::size_t bytes = _memory_accounting->bytes_allocated;
+    if(_memory_pool)
+    {
+      memory_pool_statistics pool_stats = _memory_pool->get_statistics();
+      bytes += pool_stats.bytes_in_use + pool_stats.bytes_cached;
+    }
+    for(const memory_pool_ptr& pool : _retired_memory_pools)
+      bytes += pool->get_statistics().bytes_in_use;
+    return bytes;
+  }
+
+  /// Ensures that an allocation fits into the memory budget, evicting
+  /// cached memory if necessary: first the cached buffers of the memory
+  /// pool, then the least recently used specialized programs.
+  /// \throws qcl_error if the allocation still exceeds the budget
+  /// \param num_bytes The size of the allocation
+  void reserve_device_memory(std::size_t num_bytes) const
+  {
+    if(get_allocated_memory() + num_bytes <= _memory_budget)
+      return;
+
+    ++_memory_accounting->num_evictions;
+
+    // Cached pool buffers are not in use and can be freed immediately
+    if(_memory_pool)
+      _memory_pool->release_cached();
+
+    std::size_t allocated = get_allocated_memory();
+    if(allocated + num_bytes <= _memory_budget)
+      return;
+
+    // Rarely used program variants hold device memory that is not accounted
+    // for, hence releasing them cannot make the allocation fit the budget.
+    // It however leaves more memory to the OpenCL implementation for the
+    // allocations the caller may retry after freeing its own buffers.
+    evict_unused_specializations();
+
+    std::stringstream sstr;
+    sstr << "Allocation of " << num_bytes << " bytes on device " << get_device_name()
+         << " exceeds the memory budget: " << allocated << " of "
+         << _memory_budget << " bytes are in use";
+    throw qcl_error{sstr.str(), CL_MEM_OBJECT_ALLOCATION_FAILURE};
+  }
+
+  /// Evicts all specialized programs except the most recently used one
+  void evict_unused_specializations() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    evict_specializations(std::min<std::size_t>(_specializations.size(), 1));
+  }
+
+  /// \return Whether an OpenCL error indicates that the implementation
+  /// ran out of memory
+  static bool is_allocation_failure(cl_int err)
+  {
+    return err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES;
+  }
+
+  /// Frees cached memory after the OpenCL implementation failed to
+  /// allocate a buffer, such that the allocation can be retried once
+  void release_cached_memory() const
+  {
+    ++_memory_accounting->num_evictions;
+    if(_memory_pool)
+      _memory_pool->release_cached();
+    evict_unused_specializations();
+  }
+
   /// Initializes the device and creates a command queue.
   void init_device()
   {
@@ -1035,35 +4482,312 @@ private:
 
     check_cl_error(_device.getInfo(CL_DEVICE_TYPE, &_device_type),
                    "get_device_type(): Could not obtain device type");
+
+    cl_bool unified_memory = CL_FALSE;
+    check_cl_error(_device.getInfo(CL_DEVICE_HOST_UNIFIED_MEMORY, &unified_memory),
+                   "Could not obtain device information!");
+    _unified_memory = (unified_memory == CL_TRUE);
+
+    _memory_budget = get_global_memory_size();
   }
   
   /// Compiles OpenCL source code and creates a cl::Program object.
+  /// The program is built for all devices of the program cache.
   /// \param program_src The OpenCL source code
   /// \param program The newly created cl::Program object.
   void compile_source(const std::string& program_src,
                       cl::Program& program) const
   {
-    cl::Program::Sources src{1, 
-                            program_src};
+    const std::vector<cl::Device>& devices = _programs->devices;
+
+    std::string cache_key;
+    if(_binary_cache)
+    {
+      cache_key = get_binary_cache_key(program_src);
+      if(load_cached_binary(cache_key, program))
+        return;
+    }
+
+    cl::Program::Sources src{1, 
+                            program_src};
+
+    program = cl::Program(_context, src);
+
+    cl_int err = program.build(devices,
+                               _build_options.c_str());
+
+    if(err != CL_SUCCESS)
+      throw std::runtime_error(get_build_error_message(program, program_src));
+
+    if(_binary_cache)
+      store_cached_binary(cache_key, program);
+  }
+
+  /// \return An error message containing the build logs of a program
+  /// for all devices
+  /// \param program The program that failed to build
+  /// \param program_src The (processed) source code of the program
+  std::string get_build_error_message(const cl::Program& program,
+                                      const std::string& program_src) const
+  {
+    std::stringstream sstr;
+    for(const cl::Device& device : _programs->devices)
+    {
+      std::string log;
+      program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &log);
+      detail::remove_zeros(log);
+
+      sstr << get_device_info_string(device, CL_DEVICE_NAME)
+           << ": Could not compile CL source: " << log << std::endl;
+    }
+    sstr << std::endl << "Source was: " << program_src;
+    return sstr.str();
+  }
+
+  /// Compiles a source into an object that can be linked with
+  /// \c clLinkProgram().
+  /// \return The compiled object
+  /// \param program_src The processed source code
+  cl::Program compile_object(const std::string& program_src) const
+  {
+    cl::Program::Sources src{1, program_src};
+    cl::Program object{_context, src};
+
+    if(object.compile(_build_options.c_str()) != CL_SUCCESS)
+      throw std::runtime_error(get_build_error_message(object, program_src));
+
+    return object;
+  }
+
+  /// \return The separately compiled object of a module. The object is
+  /// compiled on the first request and shared by all device contexts
+  /// using the same program cache.
+  /// \param module_id The id of the module in the \c detail::module_registry
+  /// \param spec If not \c nullptr, the specialization whose definitions
+  /// precede the source code of the module
+  detail::compiled_module obtain_compiled_module(std::size_t module_id,
+                                                 const specialization* spec)
+  {
+    const std::pair<std::size_t, std::string> key{module_id,
+                                                  spec ? spec->get_key() : std::string{}};
+    std::unique_lock<std::mutex> lock{_programs->mutex};
+
+    auto cached_module = _programs->modules.find(key);
+    if(cached_module != _programs->modules.end())
+    {
+      std::shared_future<detail::compiled_module> module = cached_module->second;
+      lock.unlock();
+      return module.get();
+    }
+
+    std::promise<detail::compiled_module> promise;
+    _programs->modules[key] = promise.get_future().share();
+
+    lock.unlock();
+    try
+    {
+      detail::module_registry::entry entry;
+      if(!detail::module_registry::get().find(module_id, entry))
+        throw std::invalid_argument{"Unknown module id "+std::to_string(module_id)};
+
+      detail::meta_source_processor source_processor;
+      detail::compiled_module module;
+      std::string definitions = spec ? spec->get_definitions() : std::string{};
+      module.object = compile_object(source_processor(definitions + entry.source(),
+                                                      &module.dependencies));
+      promise.set_value(module);
+      return module;
+    }
+    catch(...)
+    {
+      promise.set_exception(std::current_exception());
+
+      lock.lock();
+      _programs->modules.erase(key);
+      throw;
+    }
+  }
+
+  /// Builds a program with separate compilation of the modules it includes,
+  /// see \c enable_separate_compilation().
+  /// \param source_code The unprocessed source code of the program
+  /// \param spec If not \c nullptr, the specialization whose definitions
+  /// precede the source code of the program and of its modules
+  /// \param program The linked program
+  void link_source(const std::string& source_code,
+                   const specialization* spec,
+                   cl::Program& program)
+  {
+    detail::meta_source_processor source_processor;
+    std::vector<std::size_t> modules;
+    std::string definitions = spec ? spec->get_definitions() : std::string{};
+    std::string program_src = source_processor(definitions + source_code, &modules);
+
+    std::vector<cl::Program> objects{compile_object(program_src)};
+
+    // Also link the modules that the included modules depend on
+    for(std::size_t i = 0; i < modules.size(); ++i)
+    {
+      if(std::find(modules.begin(), modules.begin() + i, modules[i])
+          != modules.begin() + i)
+        continue;
+
+      detail::compiled_module module = obtain_compiled_module(modules[i], spec);
+      objects.push_back(module.object);
+      modules.insert(modules.end(),
+                     module.dependencies.begin(), module.dependencies.end());
+    }
+
+    // Compiler options such as macro definitions are not valid linker
+    // options, hence only the options valid for linking are passed on.
+    const std::string link_options = get_link_options();
+    cl_int err = CL_SUCCESS;
+    program = cl::linkProgram(objects, link_options.c_str(), nullptr, nullptr, &err);
+    if(err != CL_SUCCESS)
+    {
+      if(program() != nullptr)
+        throw std::runtime_error(get_build_error_message(program, program_src));
+      check_cl_error(err, "Could not link program!");
+    }
+  }
+
+  /// \return The build options that are also valid options of
+  /// \c clLinkProgram(), i.e. the math options that affect the linked
+  /// program. Other options only affect the compilation of the objects.
+  std::string get_link_options() const
+  {
+    static const char* const link_options [] = {
+      "-cl-denorms-are-zero",
+      "-cl-no-signed-zeros",
+      "-cl-unsafe-math-optimizations",
+      "-cl-finite-math-only",
+      "-cl-fast-relaxed-math",
+      "-cl-no-subgroup-ifp"
+    };
+
+    std::string result;
+    std::istringstream options{_build_options};
+    std::string option;
+    while(options >> option)
+    {
+      for(const char* link_option : link_options)
+      {
+        if(option == link_option)
+        {
+          if(!result.empty())
+            result += " ";
+          result += option;
+          break;
+        }
+      }
+    }
+    return result;
+  }
+
+  /// \return A string-valued property of a device, with trailing
+  /// zeros removed
+  /// \param device The device
+  /// \param info The property
+  static std::string get_device_info_string(const cl::Device& device,
+                                            cl_device_info info)
+  {
+    std::string value;
+    check_cl_error(device.getInfo(info, &value),
+                   "Could not obtain device information!");
+    detail::remove_zeros(value);
+    return value;
+  }
+
+  /// \return The key under which the binaries of a program
+  /// are stored in the binary cache. The key contains the full source code,
+  /// such that entries of colliding file names are never mistaken for
+  /// each other.
+  /// \param program_src The (processed) source code of the program
+  std::string get_binary_cache_key(const std::string& program_src) const
+  {
+    std::stringstream sstr;
+    sstr << "build options: " << _build_options << "\n";
 
-    program = cl::Program(_context, src);
+    for(const cl::Device& device : _programs->devices)
+      sstr << "device: " << get_device_info_string(device, CL_DEVICE_NAME) << "\n"
+           << "driver version: " << get_device_info_string(device, CL_DRIVER_VERSION) << "\n"
+           << "cl version: " << get_device_info_string(device, CL_DEVICE_VERSION) << "\n";
 
-    cl_int err = program.build(std::vector<cl::Device>(1,_device),
-                               _build_options.c_str());
+    sstr << "source: " << program_src.size() << "\n" << program_src;
+    return sstr.str();
+  }
 
-    if(err != CL_SUCCESS)
+  /// Attempts to create and build a program from binaries stored in
+  /// the binary cache.
+  /// \return Whether a valid entry was found and could be built
+  /// \param cache_key The key of the cache entry
+  /// \param program The newly created program
+  bool load_cached_binary(const std::string& cache_key,
+                          cl::Program& program) const
+  {
+    const std::vector<cl::Device>& devices = _programs->devices;
+
+    cl::Program::Binaries binaries;
+    if(!_binary_cache->load(cache_key, binaries) ||
+       binaries.size() != devices.size())
+      return false;
+
+    std::vector<cl_int> binary_status;
+
+    cl_int err;
+    cl::Program cached_program(_context, devices, binaries, &binary_status, &err);
+    if(err != CL_SUCCESS || binary_status.size() != devices.size())
+      return false;
+    for(cl_int status : binary_status)
+      if(status != CL_SUCCESS)
+        return false;
+
+    if(cached_program.build(devices, _build_options.c_str()) != CL_SUCCESS)
+      return false;
+
+    program = cached_program;
+    return true;
+  }
+
+  /// Stores the binaries of a program in the binary cache.
+  /// \param cache_key The key of the cache entry
+  /// \param program The built program
+  void store_cached_binary(const std::string& cache_key,
+                           const cl::Program& program) const
+  {
+    // The program may be associated with more devices than it has been
+    // built for, if the OpenCL context contains further devices.
+    std::vector<cl::Device> program_devices;
+    std::vector<std::size_t> binary_sizes;
+    if(program.getInfo(CL_PROGRAM_DEVICES, &program_devices) != CL_SUCCESS ||
+       program.getInfo(CL_PROGRAM_BINARY_SIZES, &binary_sizes) != CL_SUCCESS ||
+       binary_sizes.size() != program_devices.size())
+      return;
+
+    std::vector<std::vector<unsigned char>> all_binaries(binary_sizes.size());
+    std::vector<unsigned char*> binary_ptrs(binary_sizes.size());
+    for(std::size_t i = 0; i < binary_sizes.size(); ++i)
     {
-      std::string log;
-      program.getBuildInfo(_device, CL_PROGRAM_BUILD_LOG, &log);
-      detail::remove_zeros(log);
+      all_binaries[i].resize(binary_sizes[i]);
+      binary_ptrs[i] = all_binaries[i].data();
+    }
 
-      std::stringstream sstr;
-      sstr << get_device_name() << ": Could not compile CL source: " << log; 
-      sstr << std::endl << std::endl << "Source was: " << program_src;
-      std::string err_msg = sstr.str();
+    if(clGetProgramInfo(program(), CL_PROGRAM_BINARIES,
+                        binary_ptrs.size() * sizeof(unsigned char*),
+                        binary_ptrs.data(), nullptr) != CL_SUCCESS)
+      return;
 
-      throw std::runtime_error(err_msg);
+    std::vector<std::vector<unsigned char>> binaries;
+    for(const cl::Device& device : _programs->devices)
+    {
+      for(std::size_t i = 0; i < program_devices.size(); ++i)
+        if(program_devices[i]() == device())
+          binaries.push_back(all_binaries[i]);
     }
+    if(binaries.size() != _programs->devices.size())
+      return;
+
+    _binary_cache->store(cache_key, binaries);
   }
   
   /// Read source code from a file
@@ -1091,25 +4815,259 @@ private:
   /// The command queues for this device. One command
   /// queue is always created during initialization.
   std::vector<cl::CommandQueue> _queues;
+  /// The properties the command queues have been created with
+  std::vector<cl_command_queue_properties> _queue_properties;
   
+  /// Protects the kernel and entrypoint caches
+  mutable std::mutex _mutex;
+
   /// Stores the names of the kernels and their
   /// corresponding kernel objects.
   std::map<std::string, kernel_ptr> _kernels;
+  /// The scoped names of the registered and specialized kernel objects,
+  /// which are kept alive by the context, such that their handles
+  /// cannot be reused by other kernels. Mutable, since specialized kernels
+  /// can be evicted by allocations, see \c reserve_device_memory().
+  mutable std::map<cl_kernel, std::string> _kernel_names;
   /// Caches compiled programs so that they do not
   /// need to be compiled again if a different kernel
-  /// from the same program is required
-  std::map<std::string, cl::Program> _program_cache;
+  /// from the same program is required. May be shared
+  /// with other device contexts of the same \c cl::Context.
+  std::shared_ptr<detail::program_cache> _programs;
+  /// Kernels of module entrypoints, indexed by entrypoint id
+  std::vector<detail::entrypoint_kernel> _entrypoint_kernels;
+
+  /// Specialized programs, ordered from the most to the least recently used
+  mutable std::list<specialized_program> _specializations;
+  /// The kernels of specialized entrypoints, indexed by entrypoint id
+  /// and specialization key
+  mutable std::vector<std::unordered_map<std::string, specialized_kernel_ref>>
+      _specialized_entrypoints;
+  /// The maximum number of cached specialized programs
+  std::size_t _max_specializations = 64;
+
+  /// Whether entrypoint kernel calls use pooled kernel instances
+  std::atomic<bool> _thread_safe_launches{false};
   
   /// The type of this device
   cl_device_type _device_type;
 
+  /// Whether the device and the host share their memory
+  bool _unified_memory;
+
   /// The build options for kernels on this device
   std::string _build_options;
+  /// Whether modules with interfaces are compiled separately
+  bool _separate_compilation = false;
+
+  /// The persistent binary cache, or \c nullptr if disabled
+  std::shared_ptr<detail::program_binary_cache> _binary_cache;
+
+  /// The memory pool, or \c nullptr if disabled
+  memory_pool_ptr _memory_pool;
+
+  /// Counts the buffers allocated through this context
+  std::shared_ptr<detail::memory_accounting> _memory_accounting =
+      std::make_shared<detail::memory_accounting>();
+  /// Disabled memory pools whose buffers are still in use. Their buffers
+  /// count towards the memory budget until they are released.
+  std::vector<memory_pool_ptr> _retired_memory_pools;
+  /// The budget for the allocated device memory in bytes
+  std::atomic<std::size_t> _memory_budget{std::numeric_limits<std::size_t>::max()};
+
+  /// Records commands in profiling mode, \c nullptr otherwise
+  profiler_ptr _profiler;
+
+  /// Stores the results of the autotuner
+  work_group_tuner_ptr _tuner = std::make_shared<work_group_tuner>();
+
+  /// Protects the state of the background compilation
+  mutable std::mutex _precompile_mutex;
+  /// Programs waiting for background compilation, as pairs of
+  /// program name and source code
+  std::deque<std::pair<std::string, std::string>> _precompile_queue;
+  std::vector<std::future<void>> _precompile_workers;
+  std::size_t _num_active_precompile_workers = 0;
+  std::size_t _max_precompile_threads =
+      std::max(1u, std::thread::hardware_concurrency());
+  std::exception_ptr _precompile_error;
 };
 
 using device_context_ptr = std::shared_ptr<device_context>;
 using const_device_context_ptr = std::shared_ptr<const device_context>;
 
+/// A future-like handle for the completion of an OpenCL command. The
+/// completion is signaled by the OpenCL runtime via \c clSetEventCallback(),
+/// so no host thread needs to block or poll. Continuations registered with
+/// \c then() run as soon as the command has completed. The handle is
+/// convertible to a \c std::shared_future<void> for use with code
+/// based on the standard library.
+///
+/// Example:
+/// \code
+/// my_module::my_kernel(ctx, n, 64).async(input, output)
+///   .then([](cl_int status){ std::cout << "done" << std::endl; });
+/// \endcode
+class event_future
+{
+public:
+  /// Constructs an invalid handle
+  event_future() = default;
+
+  /// Constructs a handle for the given event. The command associated with
+  /// the event must already have been submitted to the device (e.g. by
+  /// flushing the command queue), otherwise the handle may never complete.
+  /// \param evt The event. Must be a valid event.
+  explicit event_future(const cl::Event& evt)
+    : _evt{evt},
+      _state{std::make_shared<state>()}
+  {
+    assert(evt() != nullptr);
+
+    _future = _state->completion.get_future().share();
+
+    // The callback owns a reference to the state until it has run
+    std::shared_ptr<state>* callback_state = new std::shared_ptr<state>{_state};
+    cl_int err = _evt.setCallback(CL_COMPLETE,
+                                  &event_future::on_completion,
+                                  callback_state);
+    if(err != CL_SUCCESS)
+    {
+      delete callback_state;
+      check_cl_error(err, "Could not set event callback!");
+    }
+  }
+
+  /// \return Whether this handle refers to a command
+  bool valid() const
+  {
+    return _state != nullptr;
+  }
+
+  /// \return Whether the command and all continuations registered before
+  /// its completion have finished
+  bool is_ready() const
+  {
+    assert(valid());
+    return _future.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+  }
+
+  /// Blocks until the command and all continuations registered before its
+  /// completion have finished.
+  /// \throws qcl_error if the command was terminated abnormally
+  void wait() const
+  {
+    assert(valid());
+    _future.get();
+  }
+
+  /// Blocks until the command has finished or the timeout has expired.
+  /// \return Whether the command has finished
+  /// \param timeout The maximum duration to wait
+  template<class Rep, class Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& timeout) const
+  {
+    assert(valid());
+    return _future.wait_for(timeout) == std::future_status::ready;
+  }
+
+  /// Registers a continuation that is invoked with the execution status
+  /// of the command (\c CL_COMPLETE, or a negative error code if the
+  /// command was terminated abnormally) once it has completed. If the
+  /// command has already completed, the continuation is invoked immediately
+  /// in the calling thread. Otherwise, it is invoked in a thread of the
+  /// OpenCL runtime and should hence be short and must not call blocking
+  /// OpenCL functions. Exceptions thrown by continuations are ignored.
+  /// \return This handle, e.g. to register several continuations
+  /// \param continuation A callable with the signature <tt>void(cl_int)</tt>
+  template<class Continuation>
+  event_future& then(Continuation continuation)
+  {
+    assert(valid());
+
+    std::unique_lock<std::mutex> lock{_state->lock};
+    if(!_state->completed)
+    {
+      _state->continuations.push_back(std::function<void(cl_int)>{continuation});
+      return *this;
+    }
+    cl_int status = _state->status;
+    lock.unlock();
+
+    run_continuation(continuation, status);
+    return *this;
+  }
+
+  /// \return The event of the command
+  const cl::Event& get_event() const
+  {
+    return _evt;
+  }
+
+  /// \return A standard future that becomes ready once the command and
+  /// all continuations registered before its completion have finished
+  const std::shared_future<void>& get_future() const
+  {
+    return _future;
+  }
+
+  operator std::shared_future<void>() const
+  {
+    return _future;
+  }
+private:
+  struct state
+  {
+    std::mutex lock;
+    bool completed = false;
+    cl_int status = CL_COMPLETE;
+    std::vector<std::function<void(cl_int)>> continuations;
+    std::promise<void> completion;
+  };
+
+  template<class Continuation>
+  static void run_continuation(Continuation& continuation, cl_int status)
+  {
+    try
+    {
+      continuation(status);
+    }
+    catch(...)
+    {}
+  }
+
+  static void CL_CALLBACK on_completion(cl_event, cl_int status, void* user_data)
+  {
+    std::unique_ptr<std::shared_ptr<state>> callback_state{
+      static_cast<std::shared_ptr<state>*>(user_data)};
+    state& s = **callback_state;
+
+    std::vector<std::function<void(cl_int)>> continuations;
+    {
+      std::lock_guard<std::mutex> lock{s.lock};
+      s.completed = true;
+      s.status = status;
+      continuations.swap(s.continuations);
+    }
+
+    for(std::function<void(cl_int)>& continuation : continuations)
+      run_continuation(continuation, status);
+
+    if(status < 0)
+    {
+      std::stringstream sstr;
+      sstr << "OpenCL error " << status << ": Command was terminated abnormally!";
+      s.completion.set_exception(std::make_exception_ptr(qcl_error{sstr.str(), status}));
+    }
+    else
+      s.completion.set_value();
+  }
+
+  cl::Event _evt;
+  std::shared_ptr<state> _state;
+  std::shared_future<void> _future;
+};
+
 
 
 
@@ -1123,13 +5081,124 @@ public:
               cl::Event* evt = nullptr,
               std::vector<cl::Event>* dependencies = nullptr)
     : _ctx{ctx},
-      _kernel{kernel},
+      _instance{kernel, nullptr, nullptr},
       _args{kernel},
       _work_dim{minimum_work_dim},
       _group_dim{group_dim},
       _evt{evt},
-      _dependencies{dependencies}
+      _dependencies{dependencies},
+      _queue{0},
+      _autotune{false}
+  {
+  }
+
+  /// Construct a call of a module entrypoint. If the entrypoint has
+  /// a pool of kernel instances (i.e., thread-safe launches are enabled),
+  /// a kernel instance is acquired from the pool for the lifetime of
+  /// this object.
+  kernel_call(const qcl::device_context_ptr& ctx,
+              const detail::entrypoint_kernel& entrypoint,
+              const cl::NDRange& minimum_work_dim,
+              const cl::NDRange& group_dim,
+              cl::Event* evt = nullptr,
+              std::vector<cl::Event>* dependencies = nullptr)
+    : _ctx{ctx},
+      _instances{entrypoint.instances},
+      _instance(entrypoint.instances ? entrypoint.instances->acquire()
+                                     : detail::kernel_instance{entrypoint.kernel,
+                                                               entrypoint.arguments,
+                                                               entrypoint.name}),
+      _args{_instance.kernel, _instance.arguments},
+      _work_dim{minimum_work_dim},
+      _group_dim{group_dim},
+      _evt{evt},
+      _dependencies{dependencies},
+      _queue{0},
+      _autotune{false}
+  {
+    borrow_scratch();
+  }
+
+  /// Copies a kernel call. If the kernel call uses a pooled kernel
+  /// instance, the copy acquires its own instance and partially
+  /// set arguments are not copied.
+  kernel_call(const kernel_call& other)
+    : _ctx{other._ctx},
+      _instances{other._instances},
+      _instance(other._instances ? other._instances->acquire() : other._instance),
+      _args{other._instances ? kernel_argument_list{_instance.kernel, _instance.arguments}
+                             : other._args},
+      _accesses{other._instances ? std::vector<detail::tracked_access>{}
+                                 : other._accesses},
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+      _indirect_svm{other._indirect_svm},
+      _indirect_accesses{other._indirect_accesses},
+#endif
+      _work_dim{other._work_dim},
+      _group_dim{other._group_dim},
+      _offset{other._offset},
+      _evt{other._evt},
+      _dependencies{other._dependencies},
+      _queue{other._queue},
+      _autotune{other._autotune}
+  {
+  }
+
+  kernel_call(kernel_call&& other)
+    : _ctx{std::move(other._ctx)},
+      _instances{std::move(other._instances)},
+      _instance(std::move(other._instance)),
+      _args{std::move(other._args)},
+      _accesses{std::move(other._accesses)},
+      _dependency_buffer{std::move(other._dependency_buffer)},
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+      _indirect_svm{std::move(other._indirect_svm)},
+      _indirect_accesses{std::move(other._indirect_accesses)},
+#endif
+      _work_dim{other._work_dim},
+      _group_dim{other._group_dim},
+      _offset{other._offset},
+      _evt{other._evt},
+      _dependencies{other._dependencies},
+      _queue{other._queue},
+      _autotune{other._autotune}
+  {
+    other._instances = nullptr;
+  }
+
+  kernel_call& operator=(kernel_call other)
   {
+    swap(*this, other);
+    return *this;
+  }
+
+  ~kernel_call()
+  {
+    return_scratch();
+    if(_instances && _instance.kernel)
+      _instances->release(std::move(_instance));
+  }
+
+  friend void swap(kernel_call& a, kernel_call& b)
+  {
+    using std::swap;
+    swap(a._ctx, b._ctx);
+    swap(a._instances, b._instances);
+    swap(a._instance, b._instance);
+    swap(a._args, b._args);
+    swap(a._accesses, b._accesses);
+    swap(a._dependency_buffer, b._dependency_buffer);
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+    swap(a._indirect_svm, b._indirect_svm);
+    swap(a._indirect_accesses, b._indirect_accesses);
+#endif
+    swap(a._work_dim, b._work_dim);
+    swap(a._group_dim, b._group_dim);
+    swap(a._offset, b._offset);
+    swap(a._evt, b._evt);
+    swap(a._dependencies, b._dependencies);
+    swap(a._queue, b._queue);
+    swap(a._autotune, b._autotune);
   }
 
   void set_event(cl::Event* evt)
@@ -1142,17 +5211,171 @@ public:
     this->_dependencies = dependencies;
   }
 
+  /// Sets the command queue into which the kernel is enqueued
+  /// \param queue The id of the command queue of the device context
+  void set_command_queue(command_queue_id queue)
+  {
+    assert(queue < _ctx->get_num_command_queues());
+    this->_queue = queue;
+  }
+
+  /// \return The id of the command queue into which the kernel is enqueued
+  command_queue_id get_command_queue() const
+  {
+    return _queue;
+  }
+
+  /// \return The kernel object used by this call
+  const kernel_ptr& get_kernel() const
+  {
+    return _instance.kernel;
+  }
+
+  /// \return The scoped name of the kernel, or \c nullptr if the call
+  /// has not been created from a module entrypoint
+  const std::shared_ptr<const std::string>& get_kernel_name() const
+  {
+    return _instance.name;
+  }
+
+  /// \return The device context on which the kernel is executed
+  const device_context_ptr& get_device_context() const
+  {
+    return _ctx;
+  }
+
+  /// \return The minimum number of work items
+  const cl::NDRange& get_work_dim() const
+  {
+    return _work_dim;
+  }
+
+  /// \return The work group size
+  const cl::NDRange& get_group_dim() const
+  {
+    return _group_dim;
+  }
+
+  /// Sets the global work offset of the launch, i.e. the value of
+  /// \c get_global_id() of the first work item. This allows launching
+  /// a kernel on a part of the NDRange, e.g. one tile of a larger problem.
+  /// \return This kernel call, e.g. for
+  /// \c my_module::my_kernel(ctx,work,group).set_global_offset(offset)(a,b)
+  /// \param offset The offset, or \c cl::NullRange for no offset
+  kernel_call& set_global_offset(const cl::NDRange& offset)
+  {
+    assert(offset.dimensions() == 0 || offset.dimensions() == _work_dim.dimensions());
+    this->_offset = offset;
+    return *this;
+  }
+
+  /// \return The global work offset of the launch
+  const cl::NDRange& get_global_offset() const
+  {
+    return _offset;
+  }
+
+  /// Enables autotuning of the work group size for this call. Instead
+  /// of the work group size passed during construction, the launch uses the
+  /// work group size found by the autotuner of the device context (see
+  /// \c device_context::get_tuned_work_group_size()). If the autotuner has
+  /// no result for this device, kernel and problem size bucket yet, the kernel
+  /// is launched several times with candidate work group sizes before
+  /// the actual launch.
+  /// Only enable autotuning for kernels whose results do not depend
+  /// on the work group size and that can safely be executed repeatedly with
+  /// the same arguments (i.e., kernels that do not update their
+  /// input in place).
+  /// \return This kernel call, e.g. for
+  /// \c my_module::my_kernel(ctx,work,group).autotune()(a,b)
+  kernel_call& autotune(bool enable = true)
+  {
+    this->_autotune = enable;
+    return *this;
+  }
+
+  /// \return Whether the work group size of this call is autotuned
+  bool is_autotuned() const
+  {
+    return _autotune;
+  }
+
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+  /// Registers SVM arrays that the kernel accesses indirectly, i.e. through
+  /// pointers stored in other SVM memory instead of kernel arguments, such as
+  /// the nodes of a tree or the rows of a graph spread over several
+  /// \c svm_array objects. Without this registration, accessing such memory
+  /// from a kernel is undefined for coarse-grained SVM. The arrays are passed
+  /// with \c clSetKernelExecInfo(CL_KERNEL_EXEC_INFO_SVM_PTRS) for all following
+  /// launches of this call, and the launches are tracked as accesses of them.
+  /// \return This kernel call, e.g. for
+  /// \c my_module::traverse(ctx,work,group).use_svm(nodes,leaves)(root)
+  /// \param arrays The \c svm_array objects
+  template<class... Arrays>
+  kernel_call& use_svm(const Arrays&... arrays)
+  {
+    this->register_indirect_svm(arrays...);
+    return *this;
+  }
+
+  /// Removes all SVM arrays registered with \c use_svm()
+  void clear_indirect_svm()
+  {
+    _indirect_svm.clear();
+    _indirect_accesses.clear();
+  }
+#endif
+
+  /// Sets the arguments and enqueues the kernel. For \c device_array
+  /// arguments, the launch automatically waits for the commands it conflicts
+  /// with: For arrays marked with \c qcl::read_only(), it waits for the last
+  /// command writing the array; for all other arrays, it waits for all
+  /// previous accesses. These dependencies are added to the ones passed to
+  /// the constructor or \c set_dependencies().
   template<typename... Args>
   cl_int operator()(Args... arguments)
   {
     _args.reset();
+    _accesses.clear();
     this->configure_arguments(arguments...);
     cl_int result = enqueue_kernel();
     _args.reset();
+    _accesses.clear();
 
     return result;
   }
 
+  /// Sets the arguments, enqueues the kernel like \c operator() and
+  /// flushes the command queue.
+  /// \return A handle for the completion of the kernel. If an event
+  /// has been passed to the constructor, it is also set.
+  /// \throws qcl_error if the kernel could not be enqueued
+  template<typename... Args>
+  event_future async(Args... arguments)
+  {
+    cl::Event local_evt;
+    cl::Event* evt = _evt ? _evt : &local_evt;
+
+    cl::Event* user_evt = _evt;
+    this->_evt = evt;
+    cl_int err = CL_SUCCESS;
+    try
+    {
+      err = (*this)(arguments...);
+    }
+    catch(...)
+    {
+      this->_evt = user_evt;
+      throw;
+    }
+    this->_evt = user_evt;
+
+    check_cl_error(err, "Could not enqueue kernel!");
+    check_cl_error(_ctx->get_command_queue(_queue).flush(),
+                   "Could not flush command queue!");
+    return event_future{*evt};
+  }
+
   template<typename... Args>
   void partial_argument_list(Args... arguments)
   {
@@ -1162,16 +5385,124 @@ public:
   void discard_partial_arguments()
   {
     _args.reset();
+    _accesses.clear();
   }
 
   cl_int enqueue_kernel() const
   {
-    return this->_ctx->enqueue_ndrange_kernel(_kernel,
-                                              _work_dim, _group_dim,
-                                              _evt, cl::NullRange, _dependencies);
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+    if(!_indirect_svm.empty())
+    {
+      cl_int err = clSetKernelExecInfo((*_instance.kernel)(), CL_KERNEL_EXEC_INFO_SVM_PTRS,
+                                       _indirect_svm.size() * sizeof(void*),
+                                       _indirect_svm.data());
+      if(err != CL_SUCCESS)
+        return err;
+      return enqueue_tracked_kernel();
+    }
+#endif
+    if(!_accesses.empty())
+      return enqueue_tracked_kernel();
+
+    return enqueue_untracked_kernel(_evt, _dependencies);
   }
 
 private:
+  /// Enqueues the kernel such that it waits for the conflicting accesses
+  /// of its \c device_array arguments, and registers the launch as
+  /// new access.
+  cl_int enqueue_tracked_kernel() const
+  {
+    std::vector<cl::Event>& dependencies = _dependency_buffer;
+    dependencies.clear();
+    if(_dependencies)
+      dependencies.insert(dependencies.end(), _dependencies->begin(), _dependencies->end());
+
+    for(const detail::tracked_access& access : _accesses)
+    {
+      if(access.is_write)
+        access.tracker->get_write_dependencies(dependencies);
+      else
+        access.tracker->get_read_dependencies(dependencies);
+    }
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+    for(const detail::tracked_access& access : _indirect_accesses)
+      access.tracker->get_write_dependencies(dependencies);
+#endif
+
+    cl::Event local_evt;
+    cl::Event* evt = _evt ? _evt : &local_evt;
+
+    cl_int err = enqueue_untracked_kernel(evt,
+                                          dependencies.empty() ? nullptr : &dependencies);
+    dependencies.clear();
+    if(err != CL_SUCCESS)
+      return err;
+
+    // Register reads first, since registering a write
+    // supersedes all reads
+    for(const detail::tracked_access& access : _accesses)
+      if(!access.is_write)
+        access.tracker->record_read(*evt);
+    for(const detail::tracked_access& access : _accesses)
+      if(access.is_write)
+        access.tracker->record_write(*evt);
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+    for(const detail::tracked_access& access : _indirect_accesses)
+      access.tracker->record_write(*evt);
+#endif
+
+    return err;
+  }
+
+  cl_int enqueue_untracked_kernel(cl::Event* evt,
+                                  const std::vector<cl::Event>* dependencies) const
+  {
+    cl::NDRange group_dim = _group_dim;
+    if(_autotune)
+      group_dim = this->_ctx->get_tuned_work_group_size(_instance.kernel, _work_dim, _group_dim,
+                                                        [this, dependencies](const cl::NDRange& local_size)
+      {
+        return this->_ctx->enqueue_unprofiled_ndrange_kernel(_instance.kernel,
+                                                             _work_dim, local_size,
+                                                             nullptr, _offset, dependencies,
+                                                             _queue);
+      }, _queue, _instance.name.get());
+
+    return this->_ctx->enqueue_ndrange_kernel(_instance.kernel,
+                                              _work_dim, group_dim,
+                                              evt, _offset, dependencies,
+                                              _queue, _instance.name.get());
+  }
+
+  /// Takes over the scratch storage of the kernel instance, such that
+  /// collecting the tracked accesses and dependencies of the launch does
+  /// not allocate memory
+  void borrow_scratch()
+  {
+    if(!_instance.arguments)
+      return;
+    _accesses.swap(_instance.arguments->get_access_scratch());
+    _dependency_buffer.swap(_instance.arguments->get_dependency_scratch());
+  }
+
+  /// Returns the scratch storage to the kernel instance, if it is
+  /// larger than the storage the instance currently holds
+  void return_scratch()
+  {
+    if(!_instance.arguments)
+      return;
+    _accesses.clear();
+    _dependency_buffer.clear();
+
+    std::vector<detail::tracked_access>& accesses = _instance.arguments->get_access_scratch();
+    if(_accesses.capacity() > accesses.capacity())
+      accesses.swap(_accesses);
+    std::vector<cl::Event>& dependencies = _instance.arguments->get_dependency_scratch();
+    if(_dependency_buffer.capacity() > dependencies.capacity())
+      dependencies.swap(_dependency_buffer);
+  }
+
   template<typename T, typename... Args>
   void configure_arguments(const T&x, Args... arguments)
   {
@@ -1185,18 +5516,48 @@ private:
   template<class T>
   void push_argument(const T& x)
   {
-    _args.push(x);
+    detail::push_kernel_argument(_args, x);
+    detail::collect_tracked_access(x, _accesses);
+  }
+
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+  template<class T, typename... Arrays>
+  void register_indirect_svm(const svm_array<T>& array, const Arrays&... arrays)
+  {
+    _indirect_svm.push_back(array.data());
+    if(array.get_access_tracker())
+      _indirect_accesses.push_back(detail::tracked_access{array.get_access_tracker(), true});
+    this->register_indirect_svm(arrays...);
   }
 
+  void register_indirect_svm()
+  {}
+#endif
+
   qcl::device_context_ptr _ctx;
-  qcl::kernel_ptr _kernel;
+  std::shared_ptr<detail::kernel_instance_pool> _instances;
+  /// The kernel object and its argument cache
+  detail::kernel_instance _instance;
 
   kernel_argument_list _args;
+  /// The tracked buffers among the arguments
+  std::vector<detail::tracked_access> _accesses;
+  /// Storage for the dependencies of tracked launches
+  mutable std::vector<cl::Event> _dependency_buffer;
+#if CL_HPP_TARGET_OPENCL_VERSION >= 200
+  /// The SVM arrays registered with \c use_svm()
+  std::vector<void*> _indirect_svm;
+  std::vector<detail::tracked_access> _indirect_accesses;
+#endif
   cl::NDRange _work_dim;
   cl::NDRange _group_dim;
+  cl::NDRange _offset = cl::NullRange;
 
   cl::Event* _evt;
   std::vector<cl::Event>* _dependencies;
+
+  command_queue_id _queue;
+  bool _autotune;
 };
 
 
@@ -1273,6 +5634,53 @@ public:
       _contexts[i]->register_source_module<Source_module_type>(kernel_names);
   }
   
+  /// Queues QCL source modules for background compilation on all devices
+  /// in the global context (see \c device_context::precompile()).
+  /// \tparam Source_module_types The QCL source modules
+  template<class... Source_module_types>
+  void global_precompile()
+  {
+    for(std::size_t i = 0; i < _contexts.size(); ++i)
+      _contexts[i]->precompile<Source_module_types...>();
+  }
+
+  /// Blocks until the background compilations of all devices in the
+  /// global context have finished (see \c device_context::wait_for_precompilation()).
+  void global_wait_for_precompilation()
+  {
+    for(std::size_t i = 0; i < _contexts.size(); ++i)
+      _contexts[i]->wait_for_precompilation();
+  }
+  
+  /// Enables the persistent on-disk binary cache for all devices in
+  /// the global context (see \c device_context::enable_binary_cache()).
+  /// \param directory The directory in which the binaries are stored.
+  /// The directory must already exist.
+  void global_enable_binary_cache(const std::string& directory)
+  {
+    for(std::size_t i = 0; i < _contexts.size(); ++i)
+      _contexts[i]->enable_binary_cache(directory);
+  }
+  
+  /// Makes the results of the autotuner persistent for all devices in the
+  /// global context. All devices share one tuner and hence one file
+  /// (see \c device_context::enable_persistent_autotuning()).
+  /// \param filename The file in which the results are stored
+  void global_enable_persistent_autotuning(const std::string& filename)
+  {
+    work_group_tuner_ptr tuner = std::make_shared<work_group_tuner>(filename);
+    for(std::size_t i = 0; i < _contexts.size(); ++i)
+      _contexts[i]->set_work_group_tuner(tuner);
+  }
+  
+  /// Enables the memory pools of all devices in the global context
+  /// (see \c device_context::enable_memory_pool()).
+  void global_enable_memory_pool()
+  {
+    for(std::size_t i = 0; i < _contexts.size(); ++i)
+      _contexts[i]->enable_memory_pool();
+  }
+  
   /// \return The currently active device
   const device_context_ptr&
   device() const
@@ -1448,6 +5856,43 @@ public:
     return global_ctx;
   }
   
+  /// Creates a global context containing all devices from a given platform
+  /// which are of a given device type. In contrast to \c create_global_context(),
+  /// all devices share one OpenCL context. Therefore, modules are compiled only
+  /// once for all devices, and buffers can be copied between the devices with
+  /// \c device_context::memcpy_d2d().
+  /// \return The global context
+  /// \param platform The platform
+  /// \param type The type of the device that shall be included in the context.
+  /// If omitted, all available devices of the platform will be used.
+  global_context_ptr create_shared_global_context(const cl::Platform& platform,
+                                                  cl_device_type type = CL_DEVICE_TYPE_ALL) const
+  {
+    std::vector<device_context_ptr> contexts;
+    append_shared_contexts(platform, type, contexts);
+
+    global_context_ptr global_ctx(new global_context(contexts));
+    return global_ctx;
+  }
+
+  /// Creates a global context containing all devices from all platforms
+  /// which are of a given device type. The devices of each platform share
+  /// one OpenCL context, see \c create_shared_global_context(const cl::Platform&,
+  /// cl_device_type).
+  /// \return The global context
+  /// \param type The type of the device that shall be included in the context.
+  /// If omitted, all available devices will be used.
+  global_context_ptr create_shared_global_context(cl_device_type type = CL_DEVICE_TYPE_ALL) const
+  {
+    std::vector<device_context_ptr> contexts;
+
+    for(std::size_t i = 0; i < _platforms.size(); ++i)
+      append_shared_contexts(_platforms[i], type, contexts);
+
+    global_context_ptr global_ctx(new global_context(contexts));
+    return global_ctx;
+  }
+  
   /// Creates a global context containing all available GPUs of the system.
   /// \return The global context.
   global_context_ptr create_global_gpu_context() const
@@ -1612,6 +6057,37 @@ public:
   { get_devices(platform_index, result, CL_DEVICE_TYPE_GPU); }
   
 private:
+  /// Creates device contexts for all devices of a given type of a platform,
+  /// which share one OpenCL context and program cache.
+  /// \param platform The platform
+  /// \param type The type of the devices
+  /// \param contexts The newly created device contexts will be appended
+  /// to this vector.
+  void append_shared_contexts(const cl::Platform& platform,
+                              cl_device_type type,
+                              std::vector<device_context_ptr>& contexts) const
+  {
+    std::vector<cl::Device> devices;
+    get_devices(platform, devices, type);
+
+    if(devices.empty())
+      return;
+
+    cl_int err;
+    cl_context_properties cprops[3] =
+      {CL_CONTEXT_PLATFORM, (cl_context_properties)platform(), 0};
+
+    cl::Context context(devices, cprops, NULL, NULL, &err);
+    check_cl_error(err, "Could not spawn shared CL context!");
+
+    std::shared_ptr<detail::program_cache> programs =
+        std::make_shared<detail::program_cache>(devices);
+
+    for(std::size_t j = 0; j < devices.size(); ++j)
+      contexts.push_back(device_context_ptr(
+                           new device_context(context, devices[j], programs)));
+  }
+
   std::vector<cl::Platform> _platforms;
 };
 
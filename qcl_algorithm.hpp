@@ -0,0 +1,816 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_ALGORITHM_HPP
+#define QCL_ALGORITHM_HPP
+
+#include <string>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+#include "qcl.hpp"
+#include "qcl_module.hpp"
+#include "qcl_array.hpp"
+
+/// \file Parallel primitives operating on \c device_array objects:
+/// reduction, inclusive and exclusive scan, radix sort, stream compaction
+/// and histograms. The kernels are implemented as QCL modules, and are hence
+/// compiled on first use and cached by each \c device_context.
+/// All functions are asynchronous with respect to the host, unless they
+/// return a value to the host. The dependencies between the kernels
+/// and other commands accessing the arrays are tracked by the arrays.
+///
+/// Binary operations and predicates are described by types that provide
+/// the OpenCL expression of the operation, e.g.
+/// \code
+/// struct absolute_maximum
+/// {
+///   static std::string get_expression()
+///   { return "max(fabs(a), fabs(b))"; }
+///
+///   template<class T>
+///   static T get_identity()
+///   { return T{0}; }
+/// };
+/// \endcode
+
+/// Makes a binary operation available in CL source as
+/// \c QCL_BINARY_OP(a,b). Must be nested inside a \c QCL_STANDALONE_SOURCE()
+/// or \c QCL_MAKE_SOURCE() call.
+/// \param operation A type with a static \c get_expression() function
+/// returning an expression in terms of \c a and \c b
+#define QCL_IMPORT_BINARY_OPERATION(operation) \
+  std::string{"\n#define QCL_BINARY_OP(a,b) ("} \
+  + operation::get_expression() + std::string{")\n"} +
+
+/// Makes a unary predicate available in CL source as
+/// \c QCL_PREDICATE(x). Must be nested inside a \c QCL_STANDALONE_SOURCE()
+/// or \c QCL_MAKE_SOURCE() call.
+/// \param predicate A type with a static \c get_expression() function
+/// returning an expression in terms of \c x
+#define QCL_IMPORT_PREDICATE(predicate) \
+  std::string{"\n#define QCL_PREDICATE(x) ("} \
+  + predicate::get_expression() + std::string{")\n"} +
+
+namespace qcl {
+
+/// Addition, the default operation of reductions and scans
+struct plus
+{
+  static std::string get_expression()
+  { return "(a) + (b)"; }
+
+  template<class T>
+  static T get_identity()
+  { return T(); }
+};
+
+/// Multiplication
+struct multiplies
+{
+  static std::string get_expression()
+  { return "(a) * (b)"; }
+
+  template<class T>
+  static T get_identity()
+  { return static_cast<T>(1); }
+};
+
+/// Minimum of scalar values
+struct minimum
+{
+  static std::string get_expression()
+  { return "min((a), (b))"; }
+
+  template<class T>
+  static T get_identity()
+  { return std::numeric_limits<T>::has_infinity ?
+        std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max(); }
+};
+
+/// Maximum of scalar values
+struct maximum
+{
+  static std::string get_expression()
+  { return "max((a), (b))"; }
+
+  template<class T>
+  static T get_identity()
+  { return std::numeric_limits<T>::has_infinity ?
+        -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest(); }
+};
+
+/// Selects non-zero elements, the default predicate of \c compact()
+struct is_nonzero
+{
+  static std::string get_expression()
+  { return "(x) != 0"; }
+};
+
+namespace detail {
+
+template<class T, class Operation>
+QCL_STANDALONE_MODULE(reduce_module)
+QCL_ENTRYPOINT(qcl_reduce_groups)
+QCL_STANDALONE_SOURCE
+(
+  QCL_IMPORT_TYPE(T)
+  QCL_IMPORT_BINARY_OPERATION(Operation)
+  R"(
+  __kernel void qcl_reduce_groups(__global const T* input,
+                                  uint n,
+                                  __global T* output,
+                                  __local T* scratch,
+                                  T identity)
+  {
+    uint lid = get_local_id(0);
+
+    T acc = identity;
+    for(uint i = get_global_id(0); i < n; i += get_global_size(0))
+      acc = QCL_BINARY_OP(acc, input[i]);
+
+    scratch[lid] = acc;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint stride = get_local_size(0) / 2; stride > 0; stride /= 2)
+    {
+      if(lid < stride)
+        scratch[lid] = QCL_BINARY_OP(scratch[lid], scratch[lid + stride]);
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(lid == 0)
+      output[get_group_id(0)] = scratch[0];
+  }
+  )"
+)
+
+template<class T, class Operation>
+QCL_STANDALONE_MODULE(scan_module)
+QCL_ENTRYPOINT(qcl_scan_blocks)
+QCL_ENTRYPOINT(qcl_add_block_offsets)
+QCL_STANDALONE_SOURCE
+(
+  QCL_IMPORT_TYPE(T)
+  QCL_IMPORT_BINARY_OPERATION(Operation)
+  R"(
+  __kernel void qcl_scan_blocks(__global const T* input,
+                                uint n,
+                                __global T* output,
+                                __global T* block_sums,
+                                __local T* scratch,
+                                T identity,
+                                int inclusive)
+  {
+    uint lid = get_local_id(0);
+    uint gid = get_global_id(0);
+
+    scratch[lid] = (gid < n) ? input[gid] : identity;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint offset = 1; offset < get_local_size(0); offset *= 2)
+    {
+      T x = scratch[lid];
+      if(lid >= offset)
+        x = QCL_BINARY_OP(scratch[lid - offset], x);
+      barrier(CLK_LOCAL_MEM_FENCE);
+      scratch[lid] = x;
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(gid < n)
+    {
+      if(inclusive)
+        output[gid] = scratch[lid];
+      else
+        output[gid] = (lid == 0) ? identity : scratch[lid - 1];
+    }
+
+    if(lid == get_local_size(0) - 1)
+      block_sums[get_group_id(0)] = scratch[lid];
+  }
+
+  __kernel void qcl_add_block_offsets(__global T* output,
+                                      uint n,
+                                      __global const T* block_offsets)
+  {
+    uint gid = get_global_id(0);
+    if(gid < n)
+      output[gid] = QCL_BINARY_OP(block_offsets[get_group_id(0)], output[gid]);
+  }
+  )"
+)
+
+/// Describes how keys of a given type are mapped to unsigned integers
+/// with the same ordering for the radix sort
+template<class T>
+struct radix_key_traits
+{};
+
+template<>
+struct radix_key_traits<cl_uint>
+{
+  static std::string get_radix_type() { return "uint"; }
+  static std::string get_conversion() { return "(x)"; }
+};
+
+template<>
+struct radix_key_traits<cl_int>
+{
+  static std::string get_radix_type() { return "uint"; }
+  static std::string get_conversion() { return "(as_uint(x) ^ 0x80000000u)"; }
+};
+
+template<>
+struct radix_key_traits<cl_float>
+{
+  static std::string get_radix_type() { return "uint"; }
+  // Flips all bits of negative numbers, and the sign bit of positive numbers
+  static std::string get_conversion()
+  { return "(as_uint(x) ^ ((as_uint(x) & 0x80000000u) ? 0xffffffffu : 0x80000000u))"; }
+};
+
+template<>
+struct radix_key_traits<cl_ulong>
+{
+  static std::string get_radix_type() { return "ulong"; }
+  static std::string get_conversion() { return "(x)"; }
+};
+
+template<>
+struct radix_key_traits<cl_long>
+{
+  static std::string get_radix_type() { return "ulong"; }
+  static std::string get_conversion() { return "(as_ulong(x) ^ 0x8000000000000000ul)"; }
+};
+
+template<class T>
+QCL_STANDALONE_MODULE(radix_sort_module)
+QCL_ENTRYPOINT(qcl_radix_histogram)
+QCL_ENTRYPOINT(qcl_radix_scatter)
+QCL_STANDALONE_SOURCE
+(
+  QCL_IMPORT_TYPE(T)
+  std::string{"\n#define QCL_TO_RADIX(x) (("}
+  + radix_key_traits<T>::get_radix_type() + std::string{")"}
+  + radix_key_traits<T>::get_conversion() + std::string{")\n"} +
+  R"(
+  #define QCL_RADIX_BUCKETS 16
+  #define QCL_RADIX_MASK 15
+
+  __kernel void qcl_radix_histogram(__global const T* keys,
+                                    uint n,
+                                    uint tile_size,
+                                    uint shift,
+                                    __global uint* counts)
+  {
+    __local uint histogram[QCL_RADIX_BUCKETS];
+
+    uint lid = get_local_id(0);
+    uint group = get_group_id(0);
+
+    if(lid < QCL_RADIX_BUCKETS)
+      histogram[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint begin = group * tile_size;
+    uint end = min(begin + tile_size, n);
+    for(uint i = begin + lid; i < end; i += get_local_size(0))
+    {
+      uint digit = (uint)((QCL_TO_RADIX(keys[i]) >> shift) & QCL_RADIX_MASK);
+      atomic_inc(&histogram[digit]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Digit-major layout, such that an exclusive scan of the counts
+    // yields the output position of each (digit, group) pair
+    if(lid < QCL_RADIX_BUCKETS)
+      counts[lid * get_num_groups(0) + group] = histogram[lid];
+  }
+
+  // The elements up to and including a work item with a given digit are
+  // counted in 16 bit fields, two digits per word
+  #define QCL_RADIX_WORDS 8
+  #define QCL_RADIX_COUNT(counters, digit) \
+    (((counters)[(digit) >> 1] >> (((digit) & 1) * 16)) & 0xffffu)
+
+  __kernel void qcl_radix_scatter(__global const T* keys,
+                                  __global T* sorted_keys,
+                                  uint n,
+                                  uint tile_size,
+                                  uint shift,
+                                  __global const uint* offsets,
+                                  __local uint* counters)
+  {
+    __local uint bucket_offsets[QCL_RADIX_BUCKETS];
+
+    uint lid = get_local_id(0);
+    uint local_size = get_local_size(0);
+    uint group = get_group_id(0);
+
+    if(lid < QCL_RADIX_BUCKETS)
+      bucket_offsets[lid] = offsets[lid * get_num_groups(0) + group];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __local uint* own = counters + lid * QCL_RADIX_WORDS;
+    __local const uint* totals = counters + (local_size - 1) * QCL_RADIX_WORDS;
+
+    uint begin = group * tile_size;
+    uint end = min(begin + tile_size, n);
+    for(uint chunk = begin; chunk < end; chunk += local_size)
+    {
+      uint i = chunk + lid;
+      uint digit = QCL_RADIX_BUCKETS;
+      if(i < end)
+        digit = (uint)((QCL_TO_RADIX(keys[i]) >> shift) & QCL_RADIX_MASK);
+
+      for(uint w = 0; w < QCL_RADIX_WORDS; ++w)
+        own[w] = 0;
+      if(digit < QCL_RADIX_BUCKETS)
+        own[digit >> 1] = 1u << ((digit & 1) * 16);
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      // Inclusive scan of the counters of all digits at once
+      for(uint stride = 1; stride < local_size; stride <<= 1)
+      {
+        uint sums[QCL_RADIX_WORDS];
+        for(uint w = 0; w < QCL_RADIX_WORDS; ++w)
+          sums[w] = own[w];
+        if(lid >= stride)
+        {
+          __local const uint* preceding = own - stride * QCL_RADIX_WORDS;
+          for(uint w = 0; w < QCL_RADIX_WORDS; ++w)
+            sums[w] += preceding[w];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(uint w = 0; w < QCL_RADIX_WORDS; ++w)
+          own[w] = sums[w];
+        barrier(CLK_LOCAL_MEM_FENCE);
+      }
+
+      // The rank among the preceding elements with the same digit
+      // keeps the sort stable
+      if(digit < QCL_RADIX_BUCKETS)
+      {
+        uint rank = QCL_RADIX_COUNT(own, digit) - 1;
+        sorted_keys[bucket_offsets[digit] + rank] = keys[i];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      if(lid < QCL_RADIX_BUCKETS)
+        bucket_offsets[lid] += QCL_RADIX_COUNT(totals, lid);
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+  }
+  )"
+)
+
+template<class T, class Predicate>
+QCL_STANDALONE_MODULE(compact_module)
+QCL_ENTRYPOINT(qcl_compute_flags)
+QCL_ENTRYPOINT(qcl_compact_scatter)
+QCL_STANDALONE_SOURCE
+(
+  QCL_IMPORT_TYPE(T)
+  QCL_IMPORT_PREDICATE(Predicate)
+  R"(
+  __kernel void qcl_compute_flags(__global const T* input,
+                                  uint n,
+                                  __global uint* flags)
+  {
+    uint gid = get_global_id(0);
+    if(gid < n)
+    {
+      T x = input[gid];
+      flags[gid] = QCL_PREDICATE(x) ? 1 : 0;
+    }
+  }
+
+  __kernel void qcl_compact_scatter(__global const T* input,
+                                    uint n,
+                                    __global const uint* flags,
+                                    __global const uint* positions,
+                                    __global T* output)
+  {
+    uint gid = get_global_id(0);
+    if(gid < n && flags[gid])
+      output[positions[gid]] = input[gid];
+  }
+  )"
+)
+
+template<class T>
+QCL_STANDALONE_MODULE(histogram_module)
+QCL_ENTRYPOINT(qcl_histogram)
+QCL_ENTRYPOINT(qcl_clear_bins)
+QCL_STANDALONE_SOURCE
+(
+  QCL_IMPORT_TYPE(T)
+  R"(
+  __kernel void qcl_histogram(__global const T* input,
+                              uint n,
+                              float lower,
+                              float scale,
+                              uint num_bins,
+                              __global uint* bins,
+                              __local uint* local_bins)
+  {
+    uint lid = get_local_id(0);
+
+    for(uint b = lid; b < num_bins; b += get_local_size(0))
+      local_bins[b] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint i = get_global_id(0); i < n; i += get_global_size(0))
+    {
+      float position = ((float)input[i] - lower) * scale;
+      if(position >= 0.0f && position < (float)num_bins)
+        atomic_inc(&local_bins[(uint)position]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint b = lid; b < num_bins; b += get_local_size(0))
+      if(local_bins[b] != 0)
+        atomic_add(&bins[b], local_bins[b]);
+  }
+
+  __kernel void qcl_clear_bins(__global uint* bins, uint num_bins)
+  {
+    uint gid = get_global_id(0);
+    if(gid < num_bins)
+      bins[gid] = 0;
+  }
+  )"
+)
+
+/// \return The work group size for an algorithm kernel: The largest power
+/// of two that the kernel and device permit, up to \c max_size, such that
+/// a local buffer of \c local_bytes_per_item bytes per work item fits
+/// into half of the local memory.
+/// \param call A call of the kernel
+/// \param local_bytes_per_item The local memory required per work item
+/// \param max_size The maximum work group size
+inline std::size_t get_algorithm_group_size(const kernel_call& call,
+                                            std::size_t local_bytes_per_item,
+                                            std::size_t max_size = 256)
+{
+  const device_context_ptr& ctx = call.get_device_context();
+
+  std::size_t kernel_max_size = 1;
+  check_cl_error(call.get_kernel()->getWorkGroupInfo(ctx->get_device(),
+                                                     CL_KERNEL_WORK_GROUP_SIZE,
+                                                     &kernel_max_size),
+                 "Could not query kernel work group size!");
+
+  std::size_t limit = std::min(kernel_max_size, max_size);
+  if(local_bytes_per_item > 0)
+  {
+    cl_ulong local_mem_size = 0;
+    check_cl_error(ctx->get_device().getInfo(CL_DEVICE_LOCAL_MEM_SIZE, &local_mem_size),
+                   "Could not query local memory size!");
+    limit = std::min(limit, static_cast<std::size_t>(local_mem_size / 2 / local_bytes_per_item));
+  }
+
+  std::size_t group_size = 1;
+  while(2 * group_size <= limit)
+    group_size *= 2;
+  return group_size;
+}
+
+/// \return The number of work groups for grid-stride kernels, which
+/// process several elements per work item
+inline std::size_t get_num_algorithm_groups(const device_context_ptr& ctx,
+                                            std::size_t n,
+                                            std::size_t group_size)
+{
+  std::size_t max_groups = 4 * std::max<std::size_t>(ctx->get_max_compute_units(), 1);
+  return std::max<std::size_t>(1, std::min((n + group_size - 1) / group_size, max_groups));
+}
+
+inline void check_algorithm_size(std::size_t n)
+{
+  if(n > static_cast<std::size_t>(std::numeric_limits<cl_uint>::max()))
+    throw std::runtime_error("Arrays processed by QCL algorithms must not "
+                             "have more than 2^32-1 elements!");
+}
+
+/// Scans the first \c n elements of \c input into \c output
+template<class T, class Operation>
+void scan(const device_array<T>& input,
+          device_array<T>& output,
+          std::size_t n,
+          bool inclusive)
+{
+  if(n == 0)
+    return;
+  check_algorithm_size(n);
+
+  const device_context_ptr& ctx = input.get_context();
+  using module = scan_module<T, Operation>;
+
+  std::size_t group_size = get_algorithm_group_size(
+        module::qcl_scan_blocks(ctx, cl::NDRange{n}, cl::NullRange), sizeof(T));
+  std::size_t num_groups = (n + group_size - 1) / group_size;
+
+  device_array<T> block_sums{ctx, num_groups};
+
+  check_cl_error(module::qcl_scan_blocks(ctx, cl::NDRange{n}, cl::NDRange{group_size})(
+                   read_only(input), static_cast<cl_uint>(n), output, block_sums,
+                   local_memory<T>{group_size},
+                   Operation::template get_identity<T>(),
+                   static_cast<cl_int>(inclusive)),
+                 "Could not enqueue scan kernel!");
+
+  if(num_groups > 1)
+  {
+    device_array<T> block_offsets{ctx, num_groups};
+    scan<T, Operation>(block_sums, block_offsets, num_groups, false);
+
+    check_cl_error(module::qcl_add_block_offsets(ctx, cl::NDRange{n}, cl::NDRange{group_size})(
+                     output, static_cast<cl_uint>(n), read_only(block_offsets)),
+                   "Could not enqueue scan kernel!");
+  }
+}
+
+} // detail
+
+/// Reduces an array with an associative and commutative operation
+/// into the first element of \c result.
+/// \param input The input array
+/// \param result An array with at least one element
+/// \param op The operation
+template<class T, class Operation = plus>
+void reduce(const device_array<T>& input,
+            device_array<T>& result,
+            Operation op = Operation())
+{
+  (void)op;
+  assert(result.size() >= 1);
+  std::size_t n = input.size();
+  detail::check_algorithm_size(n);
+
+  const device_context_ptr& ctx = input.get_context();
+  using module = detail::reduce_module<T, Operation>;
+
+  std::size_t group_size = detail::get_algorithm_group_size(
+        module::qcl_reduce_groups(ctx, cl::NDRange{1}, cl::NullRange), sizeof(T));
+  std::size_t num_groups = detail::get_num_algorithm_groups(ctx, n, group_size);
+
+  device_array<T> partial_results{ctx, num_groups};
+
+  check_cl_error(module::qcl_reduce_groups(ctx, cl::NDRange{num_groups * group_size},
+                                           cl::NDRange{group_size})(
+                   read_only(input), static_cast<cl_uint>(n), partial_results,
+                   local_memory<T>{group_size}, Operation::template get_identity<T>()),
+                 "Could not enqueue reduction kernel!");
+
+  check_cl_error(module::qcl_reduce_groups(ctx, cl::NDRange{group_size},
+                                           cl::NDRange{group_size})(
+                   read_only(partial_results), static_cast<cl_uint>(num_groups), result,
+                   local_memory<T>{group_size}, Operation::template get_identity<T>()),
+                 "Could not enqueue reduction kernel!");
+}
+
+/// Reduces an array with an associative and commutative operation.
+/// \return The result of the reduction. Blocks until it is available.
+/// \param input The input array
+/// \param op The operation
+template<class T, class Operation = plus>
+T reduce(const device_array<T>& input,
+         Operation op = Operation())
+{
+  device_array<T> result{input.get_context(), 1};
+  reduce(input, result, op);
+
+  std::vector<T> host_result;
+  result.read(host_result);
+  return host_result[0];
+}
+
+/// Computes the inclusive scan (prefix sum) of an array with an
+/// associative operation, i.e. <tt>output[i] = input[0] op ... op input[i]</tt>.
+/// \c input and \c output may be the same array.
+/// \param input The input array
+/// \param output The output array. Must hold at least as many elements as \c input.
+/// \param op The operation
+template<class T, class Operation = plus>
+void inclusive_scan(const device_array<T>& input,
+                    device_array<T>& output,
+                    Operation op = Operation())
+{
+  (void)op;
+  assert(output.size() >= input.size());
+  detail::scan<T, Operation>(input, output, input.size(), true);
+}
+
+/// Computes the exclusive scan of an array with an associative operation,
+/// i.e. <tt>output[0]</tt> is the identity of the operation and
+/// <tt>output[i] = input[0] op ... op input[i-1]</tt>.
+/// \c input and \c output may be the same array.
+/// \param input The input array
+/// \param output The output array. Must hold at least as many elements as \c input.
+/// \param op The operation
+template<class T, class Operation = plus>
+void exclusive_scan(const device_array<T>& input,
+                    device_array<T>& output,
+                    Operation op = Operation())
+{
+  (void)op;
+  assert(output.size() >= input.size());
+  detail::scan<T, Operation>(input, output, input.size(), false);
+}
+
+/// Sorts an array in ascending order with a stable LSD radix sort.
+/// Supported key types are \c cl_uint, \c cl_int, \c cl_float, \c cl_ulong
+/// and \c cl_long.
+/// \param keys The array to sort
+template<class T>
+void radix_sort(device_array<T>& keys)
+{
+  std::size_t n = keys.size();
+  if(n < 2)
+    return;
+  detail::check_algorithm_size(n);
+
+  const device_context_ptr& ctx = keys.get_context();
+  using module = detail::radix_sort_module<T>;
+  const std::size_t num_buckets = 16;
+  const std::size_t bits_per_pass = 4;
+  // The packed digit counters of each work item in the scatter kernel
+  const std::size_t counter_words = 8;
+
+  std::size_t group_size = detail::get_algorithm_group_size(
+        module::qcl_radix_scatter(ctx, cl::NDRange{1}, cl::NullRange),
+        counter_words * sizeof(cl_uint));
+  if(group_size < num_buckets)
+    throw std::runtime_error("radix_sort(): The device does not support "
+                             "large enough work groups!");
+
+  // Every work group sorts one contiguous tile of the keys
+  std::size_t num_groups = std::min<std::size_t>((n + group_size - 1) / group_size, 256);
+  std::size_t tile_size = (n + num_groups - 1) / num_groups;
+  tile_size = ((tile_size + group_size - 1) / group_size) * group_size;
+  num_groups = (n + tile_size - 1) / tile_size;
+
+  device_array<cl_uint> counts{ctx, num_buckets * num_groups};
+  device_array<cl_uint> offsets{ctx, num_buckets * num_groups};
+  device_array<T> temp{ctx, n};
+
+  device_array<T>* src = &keys;
+  device_array<T>* dst = &temp;
+
+  // The number of passes is even, hence the sorted keys end up in \c keys
+  for(std::size_t shift = 0; shift < 8 * sizeof(T); shift += bits_per_pass)
+  {
+    check_cl_error(module::qcl_radix_histogram(ctx, cl::NDRange{num_groups * group_size},
+                                               cl::NDRange{group_size})(
+                     read_only(*src), static_cast<cl_uint>(n),
+                     static_cast<cl_uint>(tile_size), static_cast<cl_uint>(shift),
+                     counts),
+                   "Could not enqueue radix sort kernel!");
+
+    exclusive_scan(counts, offsets);
+
+    check_cl_error(module::qcl_radix_scatter(ctx, cl::NDRange{num_groups * group_size},
+                                             cl::NDRange{group_size})(
+                     read_only(*src), *dst, static_cast<cl_uint>(n),
+                     static_cast<cl_uint>(tile_size), static_cast<cl_uint>(shift),
+                     read_only(offsets), local_memory<cl_uint>{counter_words * group_size}),
+                   "Could not enqueue radix sort kernel!");
+
+    std::swap(src, dst);
+  }
+}
+
+/// Copies the elements of an array that satisfy a predicate to the
+/// beginning of another array, preserving their order (stream compaction).
+/// \return The number of selected elements. Blocks until the number is
+/// available.
+/// \param input The input array
+/// \param output The output array. Must hold at least as many elements as
+/// \c input.
+/// \param pred The predicate
+template<class T, class Predicate = is_nonzero>
+std::size_t compact(const device_array<T>& input,
+                    device_array<T>& output,
+                    Predicate pred = Predicate())
+{
+  (void)pred;
+  assert(output.size() >= input.size());
+  std::size_t n = input.size();
+  if(n == 0)
+    return 0;
+  detail::check_algorithm_size(n);
+
+  const device_context_ptr& ctx = input.get_context();
+  using module = detail::compact_module<T, Predicate>;
+
+  std::size_t group_size = detail::get_algorithm_group_size(
+        module::qcl_compute_flags(ctx, cl::NDRange{n}, cl::NullRange), 0);
+
+  device_array<cl_uint> flags{ctx, n};
+  device_array<cl_uint> positions{ctx, n};
+
+  check_cl_error(module::qcl_compute_flags(ctx, cl::NDRange{n}, cl::NDRange{group_size})(
+                   read_only(input), static_cast<cl_uint>(n), flags),
+                 "Could not enqueue compaction kernel!");
+
+  exclusive_scan(flags, positions);
+
+  check_cl_error(module::qcl_compact_scatter(ctx, cl::NDRange{n}, cl::NDRange{group_size})(
+                   read_only(input), static_cast<cl_uint>(n),
+                   read_only(flags), read_only(positions), output),
+                 "Could not enqueue compaction kernel!");
+
+  cl_uint last_flag = 0;
+  cl_uint last_position = 0;
+  flags.read(&last_flag, flags.end() - 1, flags.end());
+  positions.read(&last_position, positions.end() - 1, positions.end());
+
+  return static_cast<std::size_t>(last_position) + last_flag;
+}
+
+/// Computes a histogram of an array. The range [lower, upper) is divided
+/// into \c bins.size() bins of equal width; elements outside of the range
+/// are ignored. The elements are converted to \c float to determine
+/// their bin.
+/// \param input The input array
+/// \param bins The array that will contain the number of elements in each bin
+/// \param lower The lower bound of the first bin
+/// \param upper The upper bound of the last bin
+template<class T>
+void histogram(const device_array<T>& input,
+               device_array<cl_uint>& bins,
+               float lower,
+               float upper)
+{
+  assert(upper > lower);
+  std::size_t n = input.size();
+  std::size_t num_bins = bins.size();
+  if(num_bins == 0)
+    return;
+  detail::check_algorithm_size(n);
+  detail::check_algorithm_size(num_bins);
+
+  const device_context_ptr& ctx = input.get_context();
+  using module = detail::histogram_module<T>;
+
+  cl_ulong local_mem_size = 0;
+  check_cl_error(ctx->get_device().getInfo(CL_DEVICE_LOCAL_MEM_SIZE, &local_mem_size),
+                 "Could not query local memory size!");
+  if(num_bins * sizeof(cl_uint) > local_mem_size / 2)
+    throw std::runtime_error("histogram(): The bins do not fit into local memory!");
+
+  std::size_t group_size = detail::get_algorithm_group_size(
+        module::qcl_histogram(ctx, cl::NDRange{1}, cl::NullRange), 0);
+  std::size_t num_groups = detail::get_num_algorithm_groups(ctx, n, group_size);
+
+  check_cl_error(module::qcl_clear_bins(ctx, cl::NDRange{num_bins}, cl::NDRange{group_size})(
+                   bins, static_cast<cl_uint>(num_bins)),
+                 "Could not enqueue histogram kernel!");
+
+  if(n == 0)
+    return;
+
+  float scale = static_cast<float>(num_bins) / (upper - lower);
+  check_cl_error(module::qcl_histogram(ctx, cl::NDRange{num_groups * group_size},
+                                       cl::NDRange{group_size})(
+                   read_only(input), static_cast<cl_uint>(n), lower, scale,
+                   static_cast<cl_uint>(num_bins), bins,
+                   local_memory<cl_uint>{num_bins}),
+                 "Could not enqueue histogram kernel!");
+}
+
+}
+
+#endif
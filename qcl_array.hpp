@@ -33,6 +33,10 @@
 
 #include <iterator>
 #include <cassert>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <type_traits>
 
 namespace qcl {
 namespace detail {
@@ -273,6 +277,246 @@ operator-(typename array_iterator<T,Array_type>::difference_type n,
 
 }
 
+namespace detail {
+
+/// A region of page-locked host memory. The memory is backed by a buffer
+/// allocated with \c CL_MEM_ALLOC_HOST_PTR, which is mapped once for the
+/// lifetime of the object. Transfers between such memory and device buffers
+/// can be carried out by DMA without an additional staging copy by the driver,
+/// and can hence overlap with computations.
+class pinned_host_region
+{
+public:
+  /// \param ctx The device context which is used to allocate and map the memory
+  /// \param num_bytes The size of the region in bytes
+  pinned_host_region(const device_context_ptr& ctx, std::size_t num_bytes)
+    : _ctx{ctx}, _data{nullptr}, _num_bytes{num_bytes}
+  {
+    assert(num_bytes > 0);
+
+    cl_int err;
+    _buff = cl::Buffer(_ctx->get_context(),
+                       CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                       num_bytes, nullptr, &err);
+    check_cl_error(err, "Could not create pinned host buffer!");
+
+    _data = _ctx->get_command_queue().enqueueMapBuffer(_buff, CL_TRUE,
+                                                       CL_MAP_READ | CL_MAP_WRITE,
+                                                       0, num_bytes,
+                                                       nullptr, nullptr, &err);
+    check_cl_error(err, "Could not map pinned host buffer!");
+  }
+
+  pinned_host_region(const pinned_host_region&) = delete;
+  pinned_host_region& operator=(const pinned_host_region&) = delete;
+
+  ~pinned_host_region()
+  {
+    if(_data)
+      _ctx->get_command_queue().enqueueUnmapMemObject(_buff, _data);
+  }
+
+  /// \return A pointer to the page-locked memory
+  void* get_data() const noexcept
+  {
+    return _data;
+  }
+
+  /// \return The size of the region in bytes
+  std::size_t get_size() const noexcept
+  {
+    return _num_bytes;
+  }
+
+  /// \return The buffer backing the region
+  const cl::Buffer& get_buffer() const noexcept
+  {
+    return _buff;
+  }
+
+  /// \return The device context of the region
+  const device_context_ptr& get_context() const noexcept
+  {
+    return _ctx;
+  }
+private:
+  device_context_ptr _ctx;
+  cl::Buffer _buff;
+  void* _data;
+  std::size_t _num_bytes;
+};
+
+/// Keeps track of the pinned regions handed out by copies
+/// of a \c pinned_host_allocator
+class pinned_region_registry
+{
+public:
+  explicit pinned_region_registry(const device_context_ptr& ctx)
+    : _ctx{ctx}
+  {}
+
+  void* allocate(std::size_t num_bytes)
+  {
+    std::shared_ptr<pinned_host_region> region =
+        std::make_shared<pinned_host_region>(_ctx, num_bytes);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _regions[region->get_data()] = region;
+    return region->get_data();
+  }
+
+  void deallocate(void* ptr)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _regions.erase(ptr);
+  }
+
+  const device_context_ptr& get_context() const noexcept
+  {
+    return _ctx;
+  }
+private:
+  device_context_ptr _ctx;
+
+  std::mutex _mutex;
+  std::map<void*, std::shared_ptr<pinned_host_region>> _regions;
+};
+
+}
+
+/// A standard compliant allocator for page-locked host memory. Each
+/// allocation is backed by a mapped \c CL_MEM_ALLOC_HOST_PTR buffer
+/// (see \c detail::pinned_host_region). Since these allocations are
+/// comparatively expensive, the allocator is suited for long-lived
+/// containers such as staging buffers, e.g.
+/// \code
+/// std::vector<float, qcl::pinned_host_allocator<float>> staging{
+///   n, qcl::pinned_host_allocator<float>{ctx}};
+/// \endcode
+/// Copies of an allocator share their allocations and compare equal.
+template<class T>
+class pinned_host_allocator
+{
+public:
+  using value_type = T;
+
+  explicit pinned_host_allocator(const device_context_ptr& ctx)
+    : _registry{std::make_shared<detail::pinned_region_registry>(ctx)}
+  {}
+
+  template<class U>
+  pinned_host_allocator(const pinned_host_allocator<U>& other) noexcept
+    : _registry{other.get_registry()}
+  {}
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(_registry->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, std::size_t)
+  {
+    _registry->deallocate(ptr);
+  }
+
+  const std::shared_ptr<detail::pinned_region_registry>& get_registry() const noexcept
+  {
+    return _registry;
+  }
+private:
+  std::shared_ptr<detail::pinned_region_registry> _registry;
+};
+
+template<class T, class U>
+bool operator==(const pinned_host_allocator<T>& a,
+                const pinned_host_allocator<U>& b) noexcept
+{ return a.get_registry() == b.get_registry(); }
+
+template<class T, class U>
+bool operator!=(const pinned_host_allocator<T>& a,
+                const pinned_host_allocator<U>& b) noexcept
+{ return !(a == b); }
+
+/// An array in page-locked host memory, which is the host-side counterpart
+/// of \c device_array. Transfers between \c pinned_host_array and
+/// \c device_array objects run at full bandwidth and are truly asynchronous.
+/// Like \c device_array, copies of the array refer to the same memory.
+/// The elements are not initialized.
+template<class T>
+class pinned_host_array
+{
+public:
+  using value_type = T;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  pinned_host_array()
+    : _data{nullptr}, _num_elements{0}
+  {}
+
+  explicit pinned_host_array(const device_context_ptr& ctx,
+                             std::size_t num_elements)
+    : _region{std::make_shared<detail::pinned_host_region>(ctx, num_elements * sizeof(T))},
+      _data{static_cast<T*>(_region->get_data())},
+      _num_elements{num_elements}
+  {}
+
+  std::size_t size() const noexcept
+  {
+    return _num_elements;
+  }
+
+  T* data() noexcept
+  { return _data; }
+
+  const T* data() const noexcept
+  { return _data; }
+
+  T& operator[](std::size_t i) noexcept
+  {
+    assert(i < _num_elements);
+    return _data[i];
+  }
+
+  const T& operator[](std::size_t i) const noexcept
+  {
+    assert(i < _num_elements);
+    return _data[i];
+  }
+
+  iterator begin() noexcept
+  { return _data; }
+
+  iterator end() noexcept
+  { return _data + _num_elements; }
+
+  const_iterator begin() const noexcept
+  { return _data; }
+
+  const_iterator end() const noexcept
+  { return _data + _num_elements; }
+
+  /// \return The buffer backing the host memory
+  const cl::Buffer& get_buffer() const noexcept
+  {
+    assert(_region != nullptr);
+    return _region->get_buffer();
+  }
+
+  const device_context_ptr& get_context() const
+  {
+    assert(_region != nullptr);
+    return _region->get_context();
+  }
+private:
+  std::shared_ptr<detail::pinned_host_region> _region;
+  T* _data;
+  std::size_t _num_elements;
+};
+
+template<class T>
+class mapped_array;
+
 template<class T>
 class device_array
 {
@@ -282,32 +526,55 @@ public:
   using const_remote_iterator =
     detail::array_iterator<const T, const device_array<T>>;
 
+  /// Creates an empty array. It has its own tracker, such that
+  /// it can be handled like any other array.
   device_array()
-    : _num_elements{0}
+    : _num_elements{0}, _offset{0},
+      _tracker{std::make_shared<detail::access_tracker>()}
   {}
 
+  /// Wraps an existing buffer. Accesses to the buffer that do not go through
+  /// this object (or its copies) are not tracked, see \c get_access_tracker().
   explicit device_array(const device_context_ptr& ctx,
                         const cl::Buffer& buff,
                         std::size_t num_elements)
-    : _ctx{ctx}, _buff{buff}, _num_elements{num_elements}
+    : _ctx{ctx}, _buff{buff}, _num_elements{num_elements}, _offset{0},
+      _tracker{std::make_shared<detail::access_tracker>()}
   {}
 
+  /// If the memory pool of the device context is enabled, the
+  /// memory is allocated from the pool and returned to it when the
+  /// last copy of the array is destroyed.
   explicit device_array(const device_context_ptr& ctx,
                         const std::vector<T>& initial_data)
-    : _ctx{ctx}, _num_elements{initial_data.size()}
+    : _ctx{ctx}, _num_elements{initial_data.size()}, _offset{0},
+      _tracker{std::make_shared<detail::access_tracker>()}
   {
     assert(initial_data.size() > 0);
 
-    _ctx->create_buffer<T>(_buff, initial_data.size());
+    allocate();
     this->write(initial_data);
   }
 
-
+  /// If the memory pool of the device context is enabled, the
+  /// memory is allocated from the pool and returned to it when the
+  /// last copy of the array is destroyed.
   explicit device_array(const device_context_ptr& ctx,
                         std::size_t num_elements)
-    : _ctx{ctx}, _num_elements{num_elements}
+    : _ctx{ctx}, _num_elements{num_elements}, _offset{0},
+      _tracker{std::make_shared<detail::access_tracker>()}
+  {
+    allocate();
+  }
+
+  /// Evaluates an elementwise expression into this array with a single
+  /// fused kernel, see qcl_expression.hpp and \c qcl::assign().
+  template<class Expression,
+           class = typename Expression::qcl_expression_tag>
+  device_array& operator=(const Expression& expr)
   {
-    _ctx->create_buffer<T>(_buff, num_elements);
+    check_cl_error(assign(*this, expr), "Could not enqueue fused expression kernel!");
+    return *this;
   }
 
   std::size_t size() const noexcept
@@ -340,18 +607,22 @@ public:
                      queue);
   }
 
+  /// Reads a part of the array. Waits for the last command that has
+  /// written to the array, even if it has been enqueued into a different
+  /// command queue.
   void read(T* out,
             const_remote_iterator begin,
             const_remote_iterator end,
             command_queue_id queue = 0) const
   {
-    _ctx->memcpy_d2h(out,
-                     _buff,
-                     begin.get_position(),
-                     end.get_position(),
-                     queue);
+    cl::Event evt;
+    this->read_async(out, begin, end, &evt, nullptr, queue);
+    check_cl_error(evt.wait(), "Could not wait for buffer read!");
   }
 
+  /// Reads a part of the array asynchronously. In addition to the given
+  /// dependencies, the read waits for the last command that has
+  /// written to the array.
   void read_async(T* out,
             const_remote_iterator begin,
             const_remote_iterator end,
@@ -359,13 +630,40 @@ public:
             std::vector<cl::Event>* dependencies = nullptr,
             command_queue_id queue = 0) const
   {
+    std::vector<cl::Event> all_dependencies;
+    if(dependencies)
+      all_dependencies = *dependencies;
+    _tracker->get_read_dependencies(all_dependencies);
+
+    cl::Event local_evt;
+    if(!evt)
+      evt = &local_evt;
+
     _ctx->memcpy_d2h_async(out,
                            _buff,
                            begin.get_position(),
                            end.get_position(),
                            evt,
-                           dependencies,
+                           all_dependencies.empty() ? nullptr : &all_dependencies,
                            queue);
+    _tracker->record_read(*evt);
+  }
+
+  /// Reads the whole array into page-locked host memory. Since the
+  /// memory is page-locked, the transfer is truly asynchronous.
+  /// \param out The destination. Must hold at least \c size() elements.
+  void read_async(pinned_host_array<T>& out,
+                  cl::Event* evt = nullptr,
+                  std::vector<cl::Event>* dependencies = nullptr,
+                  command_queue_id queue = 0) const
+  {
+    assert(out.size() >= this->_num_elements);
+
+    this->read_async(out.data(),
+                     begin(), end(),
+                     evt,
+                     dependencies,
+                     queue);
   }
 
   remote_iterator begin() noexcept
@@ -380,17 +678,21 @@ public:
   const_remote_iterator end() const noexcept
   { return const_remote_iterator{this, _num_elements}; }
 
+  /// Writes a part of the array. Waits for all previous commands
+  /// accessing the array, even if they have been enqueued into
+  /// different command queues.
   void write(const T* data,
              remote_iterator out_begin, remote_iterator out_end,
              command_queue_id queue = 0)
   {
-    assert(out_begin.array() == this && out_end.array() == this);
-    _ctx->memcpy_h2d(_buff, data,
-                     out_begin.get_position(),
-                     out_end.get_position(),
-                     queue);
+    cl::Event evt;
+    this->write_async(data, out_begin, out_end, &evt, nullptr, queue);
+    check_cl_error(evt.wait(), "Could not wait for buffer write!");
   }
 
+  /// Writes a part of the array asynchronously. In addition to the given
+  /// dependencies, the write waits for all previous commands accessing
+  /// the array.
   void write_async(const T* data,
                    remote_iterator out_begin,
                    remote_iterator out_end,
@@ -399,12 +701,23 @@ public:
                    command_queue_id queue = 0)
   {
     assert(out_begin.array() == this && out_end.array() == this);
+
+    std::vector<cl::Event> all_dependencies;
+    if(dependencies)
+      all_dependencies = *dependencies;
+    _tracker->get_write_dependencies(all_dependencies);
+
+    cl::Event local_evt;
+    if(!evt)
+      evt = &local_evt;
+
     _ctx->memcpy_h2d_async(_buff, data,
                            out_begin.get_position(),
                            out_end.get_position(),
                            evt,
-                           dependencies,
+                           all_dependencies.empty() ? nullptr : &all_dependencies,
                            queue);
+    _tracker->record_write(*evt);
   }
 
   void write(const std::vector<T>& data,
@@ -427,16 +740,446 @@ public:
                 evt, dependencies, queue);
   }
 
+  /// Writes the content of page-locked host memory to the beginning of the
+  /// array. Since the memory is page-locked, the transfer is truly asynchronous.
+  /// \param data The source. Must not hold more than \c size() elements.
+  void write_async(const pinned_host_array<T>& data,
+                   cl::Event* evt = nullptr,
+                   std::vector<cl::Event>* dependencies = nullptr,
+                   command_queue_id queue = 0)
+  {
+    assert(_num_elements >= data.size());
+    write_async(data.data(),
+                begin(), begin() + data.size(),
+                evt, dependencies, queue);
+  }
+
+  /// Reads a part of the array asynchronously like \c read_async() and
+  /// flushes the command queue.
+  /// \return A handle for the completion of the read
+  event_future read_future(T* out,
+                           const_remote_iterator begin,
+                           const_remote_iterator end,
+                           std::vector<cl::Event>* dependencies = nullptr,
+                           command_queue_id queue = 0) const
+  {
+    cl::Event evt;
+    this->read_async(out, begin, end, &evt, dependencies, queue);
+    return submit_future(evt, queue);
+  }
+
+  /// Reads the whole array asynchronously like \c read_async() and
+  /// flushes the command queue. \c out must not be modified until the
+  /// read has completed.
+  /// \return A handle for the completion of the read
+  event_future read_future(std::vector<T>& out,
+                           std::vector<cl::Event>* dependencies = nullptr,
+                           command_queue_id queue = 0) const
+  {
+    cl::Event evt;
+    this->read_async(out, &evt, dependencies, queue);
+    return submit_future(evt, queue);
+  }
+
+  /// Writes a part of the array asynchronously like \c write_async() and
+  /// flushes the command queue.
+  /// \return A handle for the completion of the write
+  event_future write_future(const T* data,
+                            remote_iterator out_begin,
+                            remote_iterator out_end,
+                            std::vector<cl::Event>* dependencies = nullptr,
+                            command_queue_id queue = 0)
+  {
+    cl::Event evt;
+    this->write_async(data, out_begin, out_end, &evt, dependencies, queue);
+    return submit_future(evt, queue);
+  }
+
+  /// Writes the content of a vector to the beginning of the array
+  /// asynchronously like \c write_async() and flushes the command queue.
+  /// \return A handle for the completion of the write
+  event_future write_future(const std::vector<T>& data,
+                            std::vector<cl::Event>* dependencies = nullptr,
+                            command_queue_id queue = 0)
+  {
+    cl::Event evt;
+    this->write_async(data, &evt, dependencies, queue);
+    return submit_future(evt, queue);
+  }
+
   const device_context_ptr& get_context() const
   {
     return _ctx;
   }
+
+  /// Creates a view of a part of the array without copying. The view is
+  /// a \c device_array backed by a sub-buffer of the array's buffer and can
+  /// be passed to kernels, read, written and viewed like any other array.
+  /// It keeps the memory of the array alive. The view has its own access
+  /// tracker for its range of the array: commands on the view are only
+  /// ordered with commands on the array or other views of it if their
+  /// ranges overlap, such that commands on disjoint views can run
+  /// concurrently.
+  /// Throws \c std::runtime_error if the beginning of the view does not
+  /// satisfy the base address alignment of the device, see
+  /// \c get_view_alignment().
+  /// \param begin The first element of the view. Must not equal \c end.
+  /// \param end The element after the last element of the view
+  device_array view(const_remote_iterator begin,
+                    const_remote_iterator end) const
+  {
+    assert(begin.array() == this && end.array() == this);
+    assert(begin < end && end.get_position() <= _num_elements);
+
+    std::size_t first_element = _offset + begin.get_position();
+    if((first_element * sizeof(T)) % _ctx->get_sub_buffer_alignment() != 0)
+      throw std::runtime_error("device_array::view(): The beginning of the view "
+                               "does not satisfy the base address alignment "
+                               "of the device!");
+
+    cl_buffer_region region;
+    region.origin = first_element * sizeof(T);
+    region.size = (end - begin) * sizeof(T);
+
+    // OpenCL does not support sub-buffers of sub-buffers, hence views of
+    // views refer to the buffer of the original array.
+    cl::Buffer root_buff = this->is_view() ? _root_buff : _buff;
+
+    cl_int err;
+    cl::Buffer sub_buff = root_buff.createSubBuffer(0,
+                                                    CL_BUFFER_CREATE_TYPE_REGION,
+                                                    &region,
+                                                    &err);
+    check_cl_error(err, "Could not create sub-buffer!");
+
+    device_array result = *this;
+    result._buff = sub_buff;
+    result._root_buff = root_buff;
+    result._offset = first_element;
+    result._num_elements = end - begin;
+    if(_tracker)
+      result._tracker = std::make_shared<detail::access_tracker>(*_tracker,
+                                                                 first_element,
+                                                                 first_element + result._num_elements);
+    return result;
+  }
+
+  /// \return The granularity of views in elements: Views of an array that
+  /// is not a view itself can begin at any multiple of this number.
+  std::size_t get_view_alignment() const
+  {
+    std::size_t alignment = _ctx->get_sub_buffer_alignment();
+    std::size_t num_elements = 1;
+    while((num_elements * sizeof(T)) % alignment != 0)
+      ++num_elements;
+    return num_elements;
+  }
+
+  /// \return Whether the array is a view of another array
+  bool is_view() const noexcept
+  {
+    return _root_buff() != nullptr;
+  }
+
+  /// \return The position of the first element of the array within
+  /// the buffer of the original array if this array is a view, 0 otherwise.
+  std::size_t get_view_offset() const noexcept
+  {
+    return _offset;
+  }
+
+  /// \return The buffer of the original array if this array is a view,
+  /// the buffer of this array otherwise.
+  const cl::Buffer& get_root_buffer() const noexcept
+  {
+    return is_view() ? _root_buff : _buff;
+  }
+
+  /// Maps the array into host memory for direct access, e.g.
+  /// \code
+  /// {
+  ///   qcl::mapped_array<float> host = arr.map(CL_MAP_READ | CL_MAP_WRITE);
+  ///   for(float& x : host)
+  ///     x *= 2.f;
+  /// } // The mapping ends here
+  /// \endcode
+  /// On devices with unified memory (see
+  /// \c device_context::has_unified_memory()), the host directly accesses the
+  /// memory of the buffer without any copies. On other devices, the data is
+  /// copied into host memory (unless only \c CL_MAP_WRITE_INVALIDATE_REGION is
+  /// requested), and copied back when the mapping ends if writing is requested.
+  /// Blocks until the mapped data is available, i.e. until the conflicting
+  /// commands accessing the array have completed. While the array is mapped,
+  /// it must not be written by other commands.
+  /// \param flags \c CL_MAP_READ, \c CL_MAP_WRITE or
+  /// \c CL_MAP_WRITE_INVALIDATE_REGION, or a combination of them
+  /// \param queue The command queue used for the mapping
+  mapped_array<T> map(cl_map_flags flags, command_queue_id queue = 0)
+  {
+    return mapped_array<T>{*this, flags, 0, _num_elements, queue};
+  }
+
+  /// Maps a part of the array into host memory, see \c map(flags, queue)
+  mapped_array<T> map(cl_map_flags flags,
+                      remote_iterator begin,
+                      remote_iterator end,
+                      command_queue_id queue = 0)
+  {
+    assert(begin.array() == this && end.array() == this);
+    return mapped_array<T>{*this, flags, begin.get_position(), end.get_position(), queue};
+  }
+
+  /// Maps the array into host memory for reading, see \c map(flags, queue)
+  mapped_array<const T> map(command_queue_id queue = 0) const
+  {
+    return mapped_array<const T>{*this, CL_MAP_READ, 0, _num_elements, queue};
+  }
+
+  /// \return The tracker of the commands accessing this array. It is
+  /// shared by all copies of the array, views have their own trackers
+  /// (see \c view()). Reads, writes and kernel calls
+  /// taking the array as argument are tracked automatically; commands
+  /// that access the buffer directly can be registered manually.
+  const std::shared_ptr<detail::access_tracker>& get_access_tracker() const
+  {
+    return _tracker;
+  }
+
+  /// Blocks until all tracked commands accessing the array have completed
+  void wait() const
+  {
+    _tracker->wait();
+  }
+
+  /// Appends the events of all tracked commands accessing the array that
+  /// may not have completed yet, e.g. to synchronize with commands not
+  /// tracked by the array.
+  /// \param events The events will be appended to this vector
+  void get_pending_events(std::vector<cl::Event>& events) const
+  {
+    _tracker->get_pending_events(events);
+  }
 private:
+  event_future submit_future(const cl::Event& evt, command_queue_id queue) const
+  {
+    check_cl_error(_ctx->get_command_queue(queue).flush(),
+                   "Could not flush command queue!");
+    return event_future{evt};
+  }
+
+  void allocate()
+  {
+    if(_ctx->is_memory_pool_enabled())
+    {
+      _pooled_buff = _ctx->create_pooled_buffer<T>(CL_MEM_READ_WRITE, _num_elements);
+      _buff = *_pooled_buff;
+    }
+    else
+      _ctx->create_buffer<T>(_buff, _num_elements);
+  }
 
   device_context_ptr _ctx;
 
   cl::Buffer _buff;
+  /// Keeps the buffer from being returned to the memory pool while
+  /// copies of the array exist. \c nullptr if the buffer has not
+  /// been taken from the pool.
+  buffer_ptr _pooled_buff;
   std::size_t _num_elements;
+
+  /// If the array is a view, the buffer of the original array,
+  /// and the position of the first element within it
+  cl::Buffer _root_buff;
+  std::size_t _offset;
+
+  /// Tracks the commands accessing the buffer
+  std::shared_ptr<detail::access_tracker> _tracker;
+};
+
+/// Host access to (a part of) a \c device_array for the lifetime of the
+/// object, as created by \c device_array::map(). Depending on the device,
+/// the data is either the mapped memory of the buffer, or a host copy that
+/// is written back when the mapping ends.
+/// \tparam T The element type, \c const for read-only mappings
+template<class T>
+class mapped_array
+{
+public:
+  using value_type = T;
+  using element_type = typename std::remove_const<T>::type;
+  using iterator = T*;
+
+  /// \param array The mapped array
+  /// \param flags The map flags
+  /// \param begin The position of the first mapped element
+  /// \param end The position after the last mapped element
+  /// \param queue The command queue used for the mapping
+  mapped_array(const device_array<element_type>& array,
+               cl_map_flags flags,
+               std::size_t begin,
+               std::size_t end,
+               command_queue_id queue)
+    : _array{array},
+      _flags{flags},
+      _begin{begin},
+      _num_elements{end - begin},
+      _queue{queue},
+      _data{nullptr},
+      _zero_copy{array.get_context()->has_unified_memory()}
+  {
+    assert(begin <= end && end <= array.size());
+    assert(!std::is_const<T>::value || flags == CL_MAP_READ);
+
+    if(_num_elements == 0)
+      return;
+
+    if(_zero_copy)
+    {
+      std::vector<cl::Event> dependencies;
+      if(is_writing())
+        _array.get_access_tracker()->get_write_dependencies(dependencies);
+      else
+        _array.get_access_tracker()->get_read_dependencies(dependencies);
+
+      cl_int err;
+      void* ptr = _array.get_context()->get_command_queue(_queue).enqueueMapBuffer(
+            _array.get_buffer(), CL_TRUE, _flags,
+            _begin * sizeof(element_type),
+            _num_elements * sizeof(element_type),
+            dependencies.empty() ? nullptr : &dependencies,
+            nullptr, &err);
+      check_cl_error(err, "Could not map buffer!");
+      _data = static_cast<T*>(ptr);
+    }
+    else
+    {
+      _staging.resize(_num_elements);
+      if(_flags & CL_MAP_READ)
+        _array.read(_staging.data(),
+                    _array.begin() + _begin,
+                    _array.begin() + _begin + _num_elements,
+                    _queue);
+      else
+        // Even if the data is not read, the staging memory must not be
+        // written back before conflicting commands have completed
+        _array.wait();
+      _data = _staging.data();
+    }
+  }
+
+  mapped_array(const mapped_array&) = delete;
+  mapped_array& operator=(const mapped_array&) = delete;
+
+  mapped_array(mapped_array&& other)
+    : _array{std::move(other._array)},
+      _flags{other._flags},
+      _begin{other._begin},
+      _num_elements{other._num_elements},
+      _queue{other._queue},
+      _data{other._data},
+      _zero_copy{other._zero_copy},
+      _staging{std::move(other._staging)}
+  {
+    other._data = nullptr;
+  }
+
+  /// Ends the mapping. Errors are ignored; call \c unmap() before
+  /// destruction to handle them.
+  ~mapped_array()
+  {
+    try
+    {
+      unmap();
+    }
+    catch(...)
+    {}
+  }
+
+  /// Ends the mapping, i.e. unmaps the memory or writes the host copy back
+  /// to the array. Afterwards, the data must no longer be accessed.
+  /// Does nothing if the mapping has already ended.
+  void unmap()
+  {
+    if(!_data)
+      return;
+
+    T* data = _data;
+    _data = nullptr;
+
+    const std::shared_ptr<detail::access_tracker>& tracker = _array.get_access_tracker();
+    if(_zero_copy)
+    {
+      cl::Event evt;
+      check_cl_error(_array.get_context()->get_command_queue(_queue).enqueueUnmapMemObject(
+                       _array.get_buffer(), const_cast<element_type*>(data), nullptr, &evt),
+                     "Could not unmap buffer!");
+      if(is_writing())
+        tracker->record_write(evt);
+      else
+        tracker->record_read(evt);
+    }
+    else if(is_writing())
+    {
+      _array.write_async(_staging.data(),
+                         _array.begin() + _begin,
+                         _array.begin() + _begin + _num_elements,
+                         nullptr, nullptr, _queue);
+      // The staging memory must remain valid until the write has completed
+      _array.wait();
+    }
+    _staging = std::vector<element_type>{};
+  }
+
+  /// \return A pointer to the first mapped element, \c nullptr after
+  /// the mapping has ended.
+  T* data() const noexcept
+  {
+    return _data;
+  }
+
+  /// \return The number of mapped elements
+  std::size_t size() const noexcept
+  {
+    return _num_elements;
+  }
+
+  T& operator[](std::size_t i) const noexcept
+  {
+    assert(i < _num_elements);
+    return _data[i];
+  }
+
+  iterator begin() const noexcept
+  {
+    return _data;
+  }
+
+  iterator end() const noexcept
+  {
+    return _data + _num_elements;
+  }
+
+  /// \return Whether the host directly accesses the memory of the buffer,
+  /// as opposed to a copy.
+  bool is_zero_copy() const noexcept
+  {
+    return _zero_copy;
+  }
+private:
+  bool is_writing() const noexcept
+  {
+    return (_flags & (CL_MAP_WRITE | CL_MAP_WRITE_INVALIDATE_REGION)) != 0;
+  }
+
+  device_array<element_type> _array;
+  cl_map_flags _flags;
+  std::size_t _begin;
+  std::size_t _num_elements;
+  command_queue_id _queue;
+  T* _data;
+  bool _zero_copy;
+  /// The host copy, if the memory is not mapped directly
+  std::vector<element_type> _staging;
 };
 
 namespace  detail {
@@ -452,6 +1195,33 @@ cl_int set_kernel_arg(std::size_t pos,
   return kernel->setArg(pos, data.get_buffer());
 }
 
+/// Device arrays passed to kernel calls are tracked as being read
+/// and written by the kernel
+template<class T>
+void collect_tracked_access(const device_array<T>& array,
+                            std::vector<tracked_access>& accesses)
+{
+  if(array.get_access_tracker())
+    accesses.push_back(tracked_access{array.get_access_tracker(), true});
+}
+
+template<class T>
+void collect_tracked_access(const read_only_array<T>& array,
+                            std::vector<tracked_access>& accesses)
+{
+  if(array.get_array().get_access_tracker())
+    accesses.push_back(tracked_access{array.get_array().get_access_tracker(), false});
+}
+
+/// Device arrays are identified by the handle of their buffer,
+/// see \c qcl::kernel_argument_list
+template<class T>
+bool get_kernel_arg_identity(const device_array<T>& array,
+                             kernel_arg_identity& identity)
+{
+  return get_kernel_arg_identity(array.get_buffer(), identity);
+}
+
 }
 
 }
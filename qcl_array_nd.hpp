@@ -0,0 +1,631 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef QCL_ARRAY_ND_HPP
+#define QCL_ARRAY_ND_HPP
+
+#include "qcl.hpp"
+
+#include <array>
+#include <cassert>
+#include <vector>
+
+namespace qcl {
+namespace detail {
+
+/// Converts a position or size in elements into the three-component
+/// form expected by the OpenCL rect and image functions.
+/// \param idx The position or size
+/// \param element_size The factor for the first component, e.g.
+/// \c sizeof(T) for buffers (which expect bytes) or 1 for images
+/// \param fill The value of the components beyond \c Dim
+template<std::size_t Dim>
+cl::array<cl::size_type, 3> to_cl_region(const std::array<std::size_t, Dim>& idx,
+                                         std::size_t element_size,
+                                         std::size_t fill)
+{
+  cl::array<cl::size_type, 3> result;
+  for(std::size_t i = 0; i < 3; ++i)
+    result[i] = i < Dim ? idx[i] : fill;
+  result[0] *= element_size;
+  return result;
+}
+
+/// \return The number of elements of an extent
+template<std::size_t Dim>
+std::size_t get_num_elements(const std::array<std::size_t, Dim>& extent)
+{
+  std::size_t result = 1;
+  for(std::size_t i = 0; i < Dim; ++i)
+    result *= extent[i];
+  return result;
+}
+
+/// \return Whether a region lies within an extent
+template<std::size_t Dim>
+bool is_inside(const std::array<std::size_t, Dim>& origin,
+               const std::array<std::size_t, Dim>& region,
+               const std::array<std::size_t, Dim>& extent)
+{
+  for(std::size_t i = 0; i < Dim; ++i)
+    if(origin[i] + region[i] > extent[i])
+      return false;
+  return true;
+}
+
+/// Describes the image format corresponding to a data type. Only
+/// the specialized types can be stored in images.
+template<class T>
+struct image_format_traits;
+
+#define QCL_IMAGE_FORMAT(type, channel_order, channel_type) \
+template<> \
+struct image_format_traits<type> \
+{ \
+  static cl::ImageFormat get() \
+  { return cl::ImageFormat{channel_order, channel_type}; } \
+}
+
+QCL_IMAGE_FORMAT(cl_float,  CL_R,    CL_FLOAT);
+QCL_IMAGE_FORMAT(cl_float2, CL_RG,   CL_FLOAT);
+QCL_IMAGE_FORMAT(cl_float4, CL_RGBA, CL_FLOAT);
+QCL_IMAGE_FORMAT(cl_int,    CL_R,    CL_SIGNED_INT32);
+QCL_IMAGE_FORMAT(cl_int4,   CL_RGBA, CL_SIGNED_INT32);
+QCL_IMAGE_FORMAT(cl_uint,   CL_R,    CL_UNSIGNED_INT32);
+QCL_IMAGE_FORMAT(cl_uint4,  CL_RGBA, CL_UNSIGNED_INT32);
+QCL_IMAGE_FORMAT(cl_short,  CL_R,    CL_SIGNED_INT16);
+QCL_IMAGE_FORMAT(cl_ushort, CL_R,    CL_UNSIGNED_INT16);
+QCL_IMAGE_FORMAT(cl_char,   CL_R,    CL_SIGNED_INT8);
+QCL_IMAGE_FORMAT(cl_uchar,  CL_R,    CL_UNSIGNED_INT8);
+QCL_IMAGE_FORMAT(cl_uchar4, CL_RGBA, CL_UNSIGNED_INT8);
+
+#undef QCL_IMAGE_FORMAT
+
+}
+
+/// A 2D or 3D array in device memory. Each row is padded such that
+/// its size in bytes is a multiple of the device's base address alignment,
+/// hence all rows start at aligned addresses, which allows for coalesced
+/// accesses of work groups processing rows. Rectangular parts of the array
+/// can be read and written without repacking on the host.
+///
+/// When passed to a kernel call, the array expands into the buffer followed
+/// by the row pitch (and for 3D arrays the slice pitch) in elements as
+/// \c uint. A kernel processing a 2D array hence has the signature
+/// \code
+/// __kernel void my_kernel(__global float* data, uint row_pitch, ...)
+/// {
+///   float x = data[get_global_id(1) * row_pitch + get_global_id(0)];
+/// }
+/// \endcode
+/// Accesses by kernels and transfers are tracked like for \c device_array.
+/// \tparam T The element type
+/// \tparam Dim The number of dimensions, 2 or 3
+template<class T, std::size_t Dim>
+class device_array_nd
+{
+  static_assert(Dim == 2 || Dim == 3, "device_array_nd supports 2 or 3 dimensions");
+public:
+  using value_type = T;
+  /// A position or size in elements, with the contiguous dimension first
+  using index_type = std::array<std::size_t, Dim>;
+
+  /// Allocates the array. The contents are undefined.
+  /// \param ctx The device context
+  /// \param extent The size of the array in elements
+  /// \param row_alignment The alignment of the rows in bytes. If 0,
+  /// the base address alignment of the device is used.
+  device_array_nd(const device_context_ptr& ctx,
+                  const index_type& extent,
+                  std::size_t row_alignment = 0)
+    : _ctx{ctx},
+      _extent(extent),
+      _tracker{std::make_shared<detail::access_tracker>()}
+  {
+    assert(ctx != nullptr);
+    if(row_alignment == 0)
+      row_alignment = ctx->get_sub_buffer_alignment();
+
+    _row_pitch = get_aligned_row_pitch(extent[0], row_alignment);
+    _slice_pitch = _row_pitch * extent[1];
+
+    _ctx->create_buffer<T>(_buff, get_num_allocated_elements());
+  }
+
+  /// \return The size of the array in elements
+  const index_type& get_extent() const
+  {
+    return _extent;
+  }
+
+  /// \return The number of elements of the array, excluding padding
+  std::size_t get_num_elements() const
+  {
+    return detail::get_num_elements(_extent);
+  }
+
+  /// \return The number of elements of the buffer, including padding
+  std::size_t get_num_allocated_elements() const
+  {
+    return _slice_pitch * (Dim == 3 ? _extent[Dim - 1] : 1);
+  }
+
+  /// \return The distance between two rows in elements
+  std::size_t get_row_pitch() const
+  {
+    return _row_pitch;
+  }
+
+  /// \return The distance between two 2D slices in elements
+  std::size_t get_slice_pitch() const
+  {
+    return _slice_pitch;
+  }
+
+  /// \return The underlying buffer
+  const cl::Buffer& get_buffer() const
+  {
+    return _buff;
+  }
+
+  const device_context_ptr& get_context() const
+  {
+    return _ctx;
+  }
+
+  /// \return The tracker of the commands accessing the array
+  const std::shared_ptr<detail::access_tracker>& get_access_tracker() const
+  {
+    return _tracker;
+  }
+
+  /// Writes the whole array from densely packed host memory
+  /// \param data The source, must hold \c get_num_elements() elements
+  void write(const T* data, command_queue_id queue = 0)
+  {
+    write(data, index_type{}, _extent, 0, queue);
+  }
+
+  /// Writes a rectangular region of the array and waits for completion
+  /// \param data The source
+  /// \param origin The position of the region in the array
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c data in
+  /// elements. If 0, \c data is assumed to be densely packed.
+  void write(const T* data,
+             const index_type& origin,
+             const index_type& region,
+             std::size_t host_row_pitch = 0,
+             command_queue_id queue = 0)
+  {
+    cl::Event evt;
+    write_async(data, origin, region, host_row_pitch, &evt, nullptr, queue);
+    check_cl_error(evt.wait(), "Could not wait for rectangular buffer write!");
+  }
+
+  /// Writes a rectangular region of the array asynchronously. In addition
+  /// to the given dependencies, the write waits for all previous commands
+  /// accessing the array.
+  /// \param data The source, must remain valid until the write has completed
+  /// \param origin The position of the region in the array
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c data in
+  /// elements. If 0, \c data is assumed to be densely packed.
+  void write_async(const T* data,
+                   const index_type& origin,
+                   const index_type& region,
+                   std::size_t host_row_pitch = 0,
+                   cl::Event* evt = nullptr,
+                   std::vector<cl::Event>* dependencies = nullptr,
+                   command_queue_id queue = 0)
+  {
+    assert(detail::is_inside(origin, region, _extent));
+    if(host_row_pitch == 0)
+      host_row_pitch = region[0];
+
+    std::vector<cl::Event> all_dependencies;
+    if(dependencies)
+      all_dependencies = *dependencies;
+    _tracker->get_write_dependencies(all_dependencies);
+
+    cl::Event local_evt;
+    if(!evt)
+      evt = &local_evt;
+
+    _ctx->memcpy_h2d_rect_async(_buff, data,
+                                detail::to_cl_region(origin, sizeof(T), 0),
+                                cl::array<cl::size_type, 3>{{0, 0, 0}},
+                                detail::to_cl_region(region, sizeof(T), 1),
+                                _row_pitch * sizeof(T),
+                                _slice_pitch * sizeof(T),
+                                host_row_pitch * sizeof(T),
+                                host_row_pitch * region[1] * sizeof(T),
+                                evt,
+                                all_dependencies.empty() ? nullptr : &all_dependencies,
+                                queue);
+    _tracker->record_write(*evt);
+  }
+
+  /// Reads the whole array into densely packed host memory
+  /// \param out The destination, must hold \c get_num_elements() elements
+  void read(T* out, command_queue_id queue = 0) const
+  {
+    read(out, index_type{}, _extent, 0, queue);
+  }
+
+  /// Reads the whole array into a densely packed vector
+  void read(std::vector<T>& out, command_queue_id queue = 0) const
+  {
+    out.resize(get_num_elements());
+    read(out.data(), queue);
+  }
+
+  /// Reads a rectangular region of the array and waits for completion
+  /// \param out The destination
+  /// \param origin The position of the region in the array
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c out in
+  /// elements. If 0, \c out is assumed to be densely packed.
+  void read(T* out,
+            const index_type& origin,
+            const index_type& region,
+            std::size_t host_row_pitch = 0,
+            command_queue_id queue = 0) const
+  {
+    cl::Event evt;
+    read_async(out, origin, region, host_row_pitch, &evt, nullptr, queue);
+    check_cl_error(evt.wait(), "Could not wait for rectangular buffer read!");
+  }
+
+  /// Reads a rectangular region of the array asynchronously. In addition
+  /// to the given dependencies, the read waits for the last command that
+  /// has written to the array.
+  /// \param out The destination
+  /// \param origin The position of the region in the array
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c out in
+  /// elements. If 0, \c out is assumed to be densely packed.
+  void read_async(T* out,
+                  const index_type& origin,
+                  const index_type& region,
+                  std::size_t host_row_pitch = 0,
+                  cl::Event* evt = nullptr,
+                  std::vector<cl::Event>* dependencies = nullptr,
+                  command_queue_id queue = 0) const
+  {
+    assert(detail::is_inside(origin, region, _extent));
+    if(host_row_pitch == 0)
+      host_row_pitch = region[0];
+
+    std::vector<cl::Event> all_dependencies;
+    if(dependencies)
+      all_dependencies = *dependencies;
+    _tracker->get_read_dependencies(all_dependencies);
+
+    cl::Event local_evt;
+    if(!evt)
+      evt = &local_evt;
+
+    _ctx->memcpy_d2h_rect_async(out, _buff,
+                                detail::to_cl_region(origin, sizeof(T), 0),
+                                cl::array<cl::size_type, 3>{{0, 0, 0}},
+                                detail::to_cl_region(region, sizeof(T), 1),
+                                _row_pitch * sizeof(T),
+                                _slice_pitch * sizeof(T),
+                                host_row_pitch * sizeof(T),
+                                host_row_pitch * region[1] * sizeof(T),
+                                evt,
+                                all_dependencies.empty() ? nullptr : &all_dependencies,
+                                queue);
+    _tracker->record_read(*evt);
+  }
+
+  /// Blocks until all commands accessing the array have completed
+  void wait() const
+  {
+    _tracker->wait();
+  }
+private:
+  /// \return The smallest number of elements not less than \c width whose
+  /// size in bytes is a multiple of the alignment
+  static std::size_t get_aligned_row_pitch(std::size_t width, std::size_t alignment)
+  {
+    std::size_t a = alignment;
+    std::size_t b = sizeof(T);
+    while(b != 0)
+    {
+      std::size_t r = a % b;
+      a = b;
+      b = r;
+    }
+    std::size_t step = alignment / a;
+    return ((width + step - 1) / step) * step;
+  }
+
+  device_context_ptr _ctx;
+  cl::Buffer _buff;
+  index_type _extent;
+  std::size_t _row_pitch;
+  std::size_t _slice_pitch;
+  std::shared_ptr<detail::access_tracker> _tracker;
+};
+
+/// A 2D or 3D array stored as an image, for data that kernels only read.
+/// Reads from images go through the texture cache of GPUs, which is
+/// optimized for 2D locality and makes accesses to neighbouring elements
+/// (e.g. in stencils) cheap regardless of the access pattern. When passed to
+/// a kernel call, the array is passed as \c image2d_t or \c image3d_t and
+/// must be declared \c __read_only:
+/// \code
+/// __kernel void my_kernel(__read_only image2d_t input, ...)
+/// {
+///   float x = read_imagef(input, sampler, (int2)(get_global_id(0),
+///                                                get_global_id(1))).x;
+/// }
+/// \endcode
+/// Only the element types supported by \c detail::image_format_traits
+/// can be stored. The device must support images, see
+/// \c device_context::has_image_support().
+/// \tparam T The element type
+/// \tparam Dim The number of dimensions, 2 or 3
+template<class T, std::size_t Dim>
+class device_image_nd
+{
+  static_assert(Dim == 2 || Dim == 3, "device_image_nd supports 2 or 3 dimensions");
+public:
+  using value_type = T;
+  /// A position or size in elements, with the contiguous dimension first
+  using index_type = std::array<std::size_t, Dim>;
+
+  /// Allocates the image. The contents are undefined.
+  /// \param ctx The device context
+  /// \param extent The size of the image in elements
+  /// \throws std::runtime_error if the device does not support images
+  device_image_nd(const device_context_ptr& ctx, const index_type& extent)
+    : _ctx{ctx},
+      _extent(extent),
+      _tracker{std::make_shared<detail::access_tracker>()}
+  {
+    assert(ctx != nullptr);
+    if(!ctx->has_image_support())
+      throw std::runtime_error{"Device "+ctx->get_device_name()+" does not support images!"};
+
+    cl_int err = CL_SUCCESS;
+    if(Dim == 2)
+      _image = cl::Image2D{ctx->get_context(), CL_MEM_READ_ONLY,
+                           detail::image_format_traits<T>::get(),
+                           extent[0], extent[1], 0, nullptr, &err};
+    else
+      _image = cl::Image3D{ctx->get_context(), CL_MEM_READ_ONLY,
+                           detail::image_format_traits<T>::get(),
+                           extent[0], extent[1], extent[Dim - 1],
+                           0, 0, nullptr, &err};
+    check_cl_error(err, "Could not create image object!");
+  }
+
+  /// \return The size of the image in elements
+  const index_type& get_extent() const
+  {
+    return _extent;
+  }
+
+  /// \return The number of elements of the image
+  std::size_t get_num_elements() const
+  {
+    return detail::get_num_elements(_extent);
+  }
+
+  /// \return The underlying image
+  const cl::Image& get_image() const
+  {
+    return _image;
+  }
+
+  const device_context_ptr& get_context() const
+  {
+    return _ctx;
+  }
+
+  /// \return The tracker of the commands accessing the image
+  const std::shared_ptr<detail::access_tracker>& get_access_tracker() const
+  {
+    return _tracker;
+  }
+
+  /// Writes the whole image from densely packed host memory
+  /// \param data The source, must hold \c get_num_elements() elements
+  void write(const T* data, command_queue_id queue = 0)
+  {
+    write(data, index_type{}, _extent, 0, queue);
+  }
+
+  /// Writes a rectangular region of the image and waits for completion
+  /// \param data The source
+  /// \param origin The position of the region in the image
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c data in
+  /// elements. If 0, \c data is assumed to be densely packed.
+  void write(const T* data,
+             const index_type& origin,
+             const index_type& region,
+             std::size_t host_row_pitch = 0,
+             command_queue_id queue = 0)
+  {
+    cl::Event evt;
+    write_async(data, origin, region, host_row_pitch, &evt, nullptr, queue);
+    check_cl_error(evt.wait(), "Could not wait for image write!");
+  }
+
+  /// Writes a rectangular region of the image asynchronously. In addition
+  /// to the given dependencies, the write waits for all previous commands
+  /// accessing the image.
+  /// \param data The source, must remain valid until the write has completed
+  /// \param origin The position of the region in the image
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c data in
+  /// elements. If 0, \c data is assumed to be densely packed.
+  void write_async(const T* data,
+                   const index_type& origin,
+                   const index_type& region,
+                   std::size_t host_row_pitch = 0,
+                   cl::Event* evt = nullptr,
+                   std::vector<cl::Event>* dependencies = nullptr,
+                   command_queue_id queue = 0)
+  {
+    assert(detail::is_inside(origin, region, _extent));
+    if(host_row_pitch == 0)
+      host_row_pitch = region[0];
+
+    std::vector<cl::Event> all_dependencies;
+    if(dependencies)
+      all_dependencies = *dependencies;
+    _tracker->get_write_dependencies(all_dependencies);
+
+    cl::Event local_evt;
+    if(!evt)
+      evt = &local_evt;
+
+    cl_int err = _ctx->get_command_queue(queue).enqueueWriteImage(
+          _image, CL_FALSE,
+          detail::to_cl_region(origin, 1, 0),
+          detail::to_cl_region(region, 1, 1),
+          host_row_pitch * sizeof(T),
+          Dim == 3 ? host_row_pitch * region[1] * sizeof(T) : 0,
+          data,
+          all_dependencies.empty() ? nullptr : &all_dependencies,
+          evt);
+    check_cl_error(err, "Could not enqueue async image write!");
+    _tracker->record_write(*evt);
+  }
+
+  /// Reads the whole image into densely packed host memory
+  /// \param out The destination, must hold \c get_num_elements() elements
+  void read(T* out, command_queue_id queue = 0) const
+  {
+    read(out, index_type{}, _extent, 0, queue);
+  }
+
+  /// Reads a rectangular region of the image and waits for completion
+  /// \param out The destination
+  /// \param origin The position of the region in the image
+  /// \param region The size of the region
+  /// \param host_row_pitch The distance between two rows of \c out in
+  /// elements. If 0, \c out is assumed to be densely packed.
+  void read(T* out,
+            const index_type& origin,
+            const index_type& region,
+            std::size_t host_row_pitch = 0,
+            command_queue_id queue = 0) const
+  {
+    assert(detail::is_inside(origin, region, _extent));
+    if(host_row_pitch == 0)
+      host_row_pitch = region[0];
+
+    std::vector<cl::Event> dependencies;
+    _tracker->get_read_dependencies(dependencies);
+
+    cl::Event evt;
+    cl_int err = _ctx->get_command_queue(queue).enqueueReadImage(
+          _image, CL_FALSE,
+          detail::to_cl_region(origin, 1, 0),
+          detail::to_cl_region(region, 1, 1),
+          host_row_pitch * sizeof(T),
+          Dim == 3 ? host_row_pitch * region[1] * sizeof(T) : 0,
+          out,
+          dependencies.empty() ? nullptr : &dependencies,
+          &evt);
+    check_cl_error(err, "Could not enqueue image read!");
+    _tracker->record_read(evt);
+    check_cl_error(evt.wait(), "Could not wait for image read!");
+  }
+
+  /// Blocks until all commands accessing the image have completed
+  void wait() const
+  {
+    _tracker->wait();
+  }
+private:
+  device_context_ptr _ctx;
+  cl::Image _image;
+  index_type _extent;
+  std::shared_ptr<detail::access_tracker> _tracker;
+};
+
+namespace detail {
+
+/// Passes the buffer of the array followed by its pitches
+template<class T, std::size_t Dim>
+cl_int push_kernel_argument(kernel_argument_list& args,
+                            const device_array_nd<T, Dim>& array)
+{
+  assert(array.get_slice_pitch() <= std::numeric_limits<cl_uint>::max());
+
+  cl_int err = args.push(array.get_buffer());
+  cl_int pitch_err = args.push(static_cast<cl_uint>(array.get_row_pitch()));
+  if(err == CL_SUCCESS)
+    err = pitch_err;
+  if(Dim == 3)
+  {
+    pitch_err = args.push(static_cast<cl_uint>(array.get_slice_pitch()));
+    if(err == CL_SUCCESS)
+      err = pitch_err;
+  }
+  return err;
+}
+
+template<class T, std::size_t Dim>
+cl_int push_kernel_argument(kernel_argument_list& args,
+                            const device_image_nd<T, Dim>& image)
+{
+  return args.push(image.get_image());
+}
+
+/// Arrays passed to kernel calls are tracked as being read
+/// and written by the kernel
+template<class T, std::size_t Dim>
+void collect_tracked_access(const device_array_nd<T, Dim>& array,
+                            std::vector<tracked_access>& accesses)
+{
+  accesses.push_back(tracked_access{array.get_access_tracker(), true});
+}
+
+/// Images can only be read by kernels
+template<class T, std::size_t Dim>
+void collect_tracked_access(const device_image_nd<T, Dim>& image,
+                            std::vector<tracked_access>& accesses)
+{
+  accesses.push_back(tracked_access{image.get_access_tracker(), false});
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef QCL_COPY_HPP
+#define QCL_COPY_HPP
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <cassert>
+#include <algorithm>
+
+#include "qcl.hpp"
+#include "qcl_array.hpp"
+
+namespace qcl {
+
+/// The ways in which a \c copy_engine can transfer data between devices
+enum class copy_path
+{
+  /// A single \c enqueueCopyBuffer, since both devices share a
+  /// \c cl::Context
+  same_context,
+  /// A pipelined copy through page-locked host memory
+  staged
+};
+
+/// Copies \c device_array data between device contexts, e.g. for halo
+/// exchanges between the devices of a \c global_context. If both device
+/// contexts share an OpenCL context (see
+/// \c environment::create_shared_global_context()), the data is copied with
+/// a single device-to-device copy. Otherwise, the data is transferred in
+/// chunks through page-locked staging memory: while one chunk is written to
+/// the destination device, the next chunk is already being read from the
+/// source device, so that both halves of the transfer overlap.
+///
+/// OpenCL has no portable peer-to-peer extension between different
+/// contexts, hence no such path is used.
+///
+/// The staging memory is allocated once per source device context and
+/// reused by subsequent copies. A copy engine must not be used by several
+/// threads concurrently.
+///
+/// Example:
+/// \code
+/// qcl::copy_engine engine;
+/// engine.copy(halo_of_gpu1, 0, border_of_gpu0, 0, halo_size);
+/// \endcode
+class copy_engine
+{
+public:
+  /// \param chunk_size The size of the chunks of a staged copy in bytes
+  /// \param num_chunks The number of chunks in flight during a staged copy.
+  /// Must be at least 2 for the reads and writes to overlap, with a single
+  /// chunk the reads and writes are serialized.
+  explicit copy_engine(std::size_t chunk_size = 4 << 20,
+                       std::size_t num_chunks = 2)
+    : _chunk_size{chunk_size}, _num_chunks{num_chunks}
+  {
+    assert(chunk_size > 0);
+    assert(num_chunks > 0);
+  }
+
+  /// \return The path that is used to copy data between two device contexts
+  /// \param dst_ctx The destination context
+  /// \param src_ctx The source context
+  static copy_path get_copy_path(const device_context_ptr& dst_ctx,
+                                 const device_context_ptr& src_ctx)
+  {
+    if(dst_ctx == src_ctx || dst_ctx->shares_context_with(*src_ctx))
+      return copy_path::same_context;
+    return copy_path::staged;
+  }
+
+  /// Copies a whole array and waits until the copy has completed.
+  /// \return The path used for the copy
+  /// \param dst The destination array, must hold at least \c src.size() elements
+  /// \param src The source array
+  template<class T>
+  copy_path copy(device_array<T>& dst, const device_array<T>& src)
+  {
+    return copy(dst, 0, src, 0, src.size());
+  }
+
+  /// Copies the elements [src_begin, src_end) of an array to a different
+  /// array, starting at element \c dst_begin, and waits until the copy
+  /// has completed. The copy waits for the conflicting commands accessing
+  /// the arrays and is registered as read of \c src and write of \c dst.
+  /// \return The path used for the copy
+  /// \param dst The destination array
+  /// \param dst_begin The position of the first copied element in \c dst
+  /// \param src The source array
+  /// \param src_begin The position of the first element to copy
+  /// \param src_end The position after the last element to copy
+  template<class T>
+  copy_path copy(device_array<T>& dst,
+                 std::size_t dst_begin,
+                 const device_array<T>& src,
+                 std::size_t src_begin,
+                 std::size_t src_end)
+  {
+    assert(src_begin <= src_end && src_end <= src.size());
+    assert(dst_begin + (src_end - src_begin) <= dst.size());
+
+    copy_path path = get_copy_path(dst.get_context(), src.get_context());
+    if(src_end == src_begin)
+      return path;
+
+    if(path == copy_path::same_context)
+      copy_in_context(dst, dst_begin, src, src_begin, src_end);
+    else
+      copy_staged(dst, dst_begin, src, src_begin, src_end);
+    return path;
+  }
+
+  /// \return The size of the chunks of a staged copy in bytes
+  std::size_t get_chunk_size() const
+  {
+    return _chunk_size;
+  }
+
+  /// \return The number of chunks in flight during a staged copy
+  std::size_t get_num_chunks() const
+  {
+    return _num_chunks;
+  }
+
+  /// Frees the staging memory
+  void release_staging_memory()
+  {
+    _staging.clear();
+  }
+private:
+  template<class T>
+  void copy_in_context(device_array<T>& dst,
+                       std::size_t dst_begin,
+                       const device_array<T>& src,
+                       std::size_t src_begin,
+                       std::size_t src_end)
+  {
+    std::vector<cl::Event> dependencies;
+    if(src.get_access_tracker())
+      src.get_access_tracker()->get_read_dependencies(dependencies);
+    if(dst.get_access_tracker())
+      dst.get_access_tracker()->get_write_dependencies(dependencies);
+
+    cl::Event evt;
+    dst.get_context()->template memcpy_d2d_async<T>(dst.get_buffer(), dst_begin,
+                                                    src.get_buffer(), src_begin, src_end,
+                                                    &evt,
+                                                    dependencies.empty() ? nullptr : &dependencies);
+    if(src.get_access_tracker())
+      src.get_access_tracker()->record_read(evt);
+    if(dst.get_access_tracker())
+      dst.get_access_tracker()->record_write(evt);
+
+    check_cl_error(evt.wait(), "Could not wait for buffer copy!");
+  }
+
+  template<class T>
+  void copy_staged(device_array<T>& dst,
+                   std::size_t dst_begin,
+                   const device_array<T>& src,
+                   std::size_t src_begin,
+                   std::size_t src_end)
+  {
+    const device_context_ptr& src_ctx = src.get_context();
+    const device_context_ptr& dst_ctx = dst.get_context();
+
+    std::size_t chunk_elements = std::max<std::size_t>(_chunk_size / sizeof(T), 1);
+    std::size_t num_elements = src_end - src_begin;
+    std::size_t num_chunks = (num_elements + chunk_elements - 1) / chunk_elements;
+
+    detail::pinned_host_region& staging =
+        get_staging_memory(src_ctx, chunk_elements * sizeof(T) * _num_chunks);
+    T* staging_data = static_cast<T*>(staging.get_data());
+
+    // Events of different OpenCL contexts cannot depend on each other,
+    // hence the two halves are synchronized on the host.
+    std::vector<cl::Event> src_dependencies;
+    if(src.get_access_tracker())
+      src.get_access_tracker()->get_read_dependencies(src_dependencies);
+    std::vector<cl::Event> dst_dependencies;
+    if(dst.get_access_tracker())
+      dst.get_access_tracker()->get_write_dependencies(dst_dependencies);
+
+    std::vector<cl::Event> reads(num_chunks);
+    std::vector<cl::Event> writes(_num_chunks);
+    std::vector<bool> slot_in_use(_num_chunks, false);
+
+    auto enqueue_read = [&](std::size_t chunk)
+    {
+      std::size_t slot = chunk % _num_chunks;
+      if(slot_in_use[slot])
+        check_cl_error(writes[slot].wait(), "Could not wait for staged write!");
+
+      std::size_t begin = src_begin + chunk * chunk_elements;
+      std::size_t end = std::min(begin + chunk_elements, src_end);
+      src_ctx->template memcpy_d2h_async<T>(staging_data + slot * chunk_elements,
+                                            src.get_buffer(), begin, end,
+                                            &reads[chunk],
+                                            src_dependencies.empty() ? nullptr : &src_dependencies);
+      check_cl_error(src_ctx->get_command_queue().flush(),
+                     "Could not flush command queue!");
+    };
+
+    enqueue_read(0);
+    for(std::size_t chunk = 0; chunk < num_chunks; ++chunk)
+    {
+      // The next chunk can only be prefetched into a different slot
+      bool prefetch = _num_chunks > 1 && chunk + 1 < num_chunks;
+      if(prefetch)
+        enqueue_read(chunk + 1);
+
+      check_cl_error(reads[chunk].wait(), "Could not wait for staged read!");
+
+      std::size_t slot = chunk % _num_chunks;
+      std::size_t begin = dst_begin + chunk * chunk_elements;
+      std::size_t end = std::min(begin + chunk_elements, dst_begin + num_elements);
+      dst_ctx->template memcpy_h2d_async<T>(dst.get_buffer(),
+                                            staging_data + slot * chunk_elements,
+                                            begin, end,
+                                            &writes[slot],
+                                            dst_dependencies.empty() ? nullptr : &dst_dependencies);
+      check_cl_error(dst_ctx->get_command_queue().flush(),
+                     "Could not flush command queue!");
+      slot_in_use[slot] = true;
+
+      // With a single slot, the next read has to wait for this write
+      if(!prefetch && chunk + 1 < num_chunks)
+        enqueue_read(chunk + 1);
+    }
+
+    for(std::size_t slot = 0; slot < _num_chunks; ++slot)
+      if(slot_in_use[slot])
+        check_cl_error(writes[slot].wait(), "Could not wait for staged write!");
+
+    // All transfers have completed, so the last read and write
+    // stand in for the whole copy
+    if(src.get_access_tracker())
+      src.get_access_tracker()->record_read(reads.back());
+    if(dst.get_access_tracker())
+      dst.get_access_tracker()->record_write(writes[(num_chunks - 1) % _num_chunks]);
+  }
+
+  /// \return Staging memory of at least the given size, allocated
+  /// in the given context
+  detail::pinned_host_region& get_staging_memory(const device_context_ptr& ctx,
+                                                 std::size_t num_bytes)
+  {
+    std::unique_ptr<detail::pinned_host_region>& staging = _staging[ctx.get()];
+    if(!staging || staging->get_size() < num_bytes)
+    {
+      staging.reset();
+      staging.reset(new detail::pinned_host_region{ctx, num_bytes});
+    }
+    return *staging;
+  }
+
+  std::size_t _chunk_size;
+  std::size_t _num_chunks;
+  /// The staging memory of each source context. The regions keep
+  /// their context alive, hence the keys remain valid.
+  std::map<const device_context*, std::unique_ptr<detail::pinned_host_region>> _staging;
+};
+
+/// Copies a whole array between device contexts with a temporary
+/// \c copy_engine. For repeated copies, e.g. halo exchanges in every
+/// iteration, use a persistent \c copy_engine to reuse its staging memory.
+/// \return The path used for the copy
+/// \param dst The destination array, must hold at least \c src.size() elements
+/// \param src The source array
+template<class T>
+copy_path copy(device_array<T>& dst, const device_array<T>& src)
+{
+  copy_engine engine;
+  return engine.copy(dst, src);
+}
+
+}
+
+#endif
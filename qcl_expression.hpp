@@ -0,0 +1,497 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_EXPRESSION_HPP
+#define QCL_EXPRESSION_HPP
+
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+#include "qcl.hpp"
+#include "qcl_module.hpp"
+#include "qcl_array.hpp"
+
+/// \file Lazy elementwise expressions over \c device_array objects.
+/// Arithmetic on arrays and scalars does not launch any kernels, but builds
+/// an expression tree. Assigning the expression to a \c device_array
+/// generates a single fused kernel that evaluates the whole tree per
+/// element, without temporary arrays:
+/// \code
+/// qcl::device_array<float> a{ctx, n}, b{ctx, n}, d{ctx, n};
+/// d = (a + b) * 2.0f - qcl::sqrt(a);
+/// \endcode
+/// The kernel is generated from the structure of the expression, i.e. the
+/// operations and the element types, but not from the arrays or scalar
+/// values. Each distinct expression is therefore compiled only once per
+/// device context and then launched through the same fast path
+/// as module entrypoints.
+/// Note that assigning a plain array (<tt>d = a;</tt>) is still the
+/// (shallow) copy assignment of \c device_array.
+
+namespace qcl {
+namespace detail {
+
+/// Base class of all expression nodes
+struct expression_base
+{
+  using qcl_expression_tag = void;
+};
+
+template<class T>
+struct is_expression
+  : public std::integral_constant<bool,
+      std::is_base_of<expression_base, T>::value>
+{};
+
+template<class T>
+struct is_expression_operand
+  : public is_expression<T>
+{};
+
+template<class T>
+struct is_expression_operand<device_array<T>>
+  : public std::true_type
+{};
+
+inline std::string get_expression_argument_name(std::size_t index)
+{
+  return "qcl_arg" + std::to_string(index);
+}
+
+/// Reads the elements of an array
+template<class T>
+class array_terminal : public expression_base
+{
+public:
+  using value_type = T;
+
+  array_terminal(const device_array<T>& array)
+    : _array{array}
+  {}
+
+  static void append_code(std::string& parameters,
+                          std::string& code,
+                          std::size_t& argument_index)
+  {
+    std::string name = get_expression_argument_name(argument_index++);
+    parameters += std::string{", __global const "}
+                + cl_type_translator<T>::value + "* " + name;
+    code += name + "[qcl_gid]";
+  }
+
+  void push_arguments(kernel_call& call) const
+  {
+    call.partial_argument_list(read_only(_array));
+  }
+
+  std::size_t get_min_size() const
+  {
+    return _array.size();
+  }
+
+  const device_context_ptr* get_context() const
+  {
+    return &_array.get_context();
+  }
+private:
+  device_array<T> _array;
+};
+
+/// A scalar value, which is passed as kernel argument
+template<class T>
+class scalar_terminal : public expression_base
+{
+public:
+  using value_type = T;
+
+  scalar_terminal(const T& value)
+    : _value{value}
+  {}
+
+  static void append_code(std::string& parameters,
+                          std::string& code,
+                          std::size_t& argument_index)
+  {
+    std::string name = get_expression_argument_name(argument_index++);
+    parameters += std::string{", "} + cl_type_translator<T>::value + " " + name;
+    code += name;
+  }
+
+  void push_arguments(kernel_call& call) const
+  {
+    call.partial_argument_list(_value);
+  }
+
+  std::size_t get_min_size() const
+  {
+    return std::numeric_limits<std::size_t>::max();
+  }
+
+  const device_context_ptr* get_context() const
+  {
+    return nullptr;
+  }
+private:
+  T _value;
+};
+
+/// The element type of a binary operation. Mixed scalar types follow the
+/// usual arithmetic conversions; if one of the types is a vector type,
+/// the result is that vector type.
+template<class L, class R>
+struct expression_result_type
+{
+  using type = typename std::conditional<
+    std::is_arithmetic<L>::value && std::is_arithmetic<R>::value,
+    typename std::common_type<L, R>::type,
+    typename std::conditional<std::is_arithmetic<L>::value, R, L>::type
+  >::type;
+};
+
+template<class T>
+struct expression_result_type<T, T>
+{
+  using type = T;
+};
+
+template<class Operator, class Left, class Right>
+class binary_expression : public expression_base
+{
+public:
+  using value_type = typename expression_result_type<
+    typename Left::value_type,
+    typename Right::value_type>::type;
+
+  binary_expression(const Left& left, const Right& right)
+    : _left{left}, _right{right}
+  {}
+
+  static void append_code(std::string& parameters,
+                          std::string& code,
+                          std::size_t& argument_index)
+  {
+    code += "(";
+    Left::append_code(parameters, code, argument_index);
+    code += Operator::get_symbol();
+    Right::append_code(parameters, code, argument_index);
+    code += ")";
+  }
+
+  void push_arguments(kernel_call& call) const
+  {
+    _left.push_arguments(call);
+    _right.push_arguments(call);
+  }
+
+  std::size_t get_min_size() const
+  {
+    return std::min(_left.get_min_size(), _right.get_min_size());
+  }
+
+  const device_context_ptr* get_context() const
+  {
+    const device_context_ptr* ctx = _left.get_context();
+    return ctx ? ctx : _right.get_context();
+  }
+private:
+  Left _left;
+  Right _right;
+};
+
+template<class Function, class Argument>
+class unary_expression : public expression_base
+{
+public:
+  using value_type = typename Argument::value_type;
+
+  unary_expression(const Argument& argument)
+    : _argument{argument}
+  {}
+
+  static void append_code(std::string& parameters,
+                          std::string& code,
+                          std::size_t& argument_index)
+  {
+    code += Function::get_name();
+    code += "(";
+    Argument::append_code(parameters, code, argument_index);
+    code += ")";
+  }
+
+  void push_arguments(kernel_call& call) const
+  {
+    _argument.push_arguments(call);
+  }
+
+  std::size_t get_min_size() const
+  {
+    return _argument.get_min_size();
+  }
+
+  const device_context_ptr* get_context() const
+  {
+    return _argument.get_context();
+  }
+private:
+  Argument _argument;
+};
+
+#define QCL_DECLARE_EXPRESSION_OPERATOR(name, symbol) \
+  struct name                                         \
+  { static const char* get_symbol() { return " " symbol " "; } }
+
+QCL_DECLARE_EXPRESSION_OPERATOR(expression_plus,       "+");
+QCL_DECLARE_EXPRESSION_OPERATOR(expression_minus,      "-");
+QCL_DECLARE_EXPRESSION_OPERATOR(expression_multiplies, "*");
+QCL_DECLARE_EXPRESSION_OPERATOR(expression_divides,    "/");
+
+#define QCL_DECLARE_EXPRESSION_FUNCTION(name, cl_name) \
+  struct name                                          \
+  { static const char* get_name() { return cl_name; } }
+
+QCL_DECLARE_EXPRESSION_FUNCTION(expression_negate, "-");
+QCL_DECLARE_EXPRESSION_FUNCTION(expression_sqrt,   "sqrt");
+QCL_DECLARE_EXPRESSION_FUNCTION(expression_exp,    "exp");
+QCL_DECLARE_EXPRESSION_FUNCTION(expression_log,    "log");
+QCL_DECLARE_EXPRESSION_FUNCTION(expression_fabs,   "fabs");
+
+/// Maps the operands of expression operators to expression nodes.
+/// \tparam T The type of the operand
+/// \tparam Other The type of the other operand of a binary operation.
+/// Scalars adopt the element type of the other operand, unless they
+/// are combined with vector types.
+template<class T, class Other, class Enable = void>
+struct expression_operand
+{};
+
+template<class T, class Other>
+struct expression_operand<T, Other,
+    typename std::enable_if<is_expression<T>::value>::type>
+{
+  using type = T;
+
+  static const T& get(const T& x)
+  { return x; }
+};
+
+template<class T, class Other>
+struct expression_operand<device_array<T>, Other>
+{
+  using type = array_terminal<T>;
+
+  static type get(const device_array<T>& x)
+  { return type{x}; }
+};
+
+template<class T, class Other>
+struct expression_operand<T, Other,
+    typename std::enable_if<std::is_arithmetic<T>::value &&
+                            is_expression_operand<Other>::value>::type>
+{
+  using other_value_type =
+    typename expression_operand<Other, T>::type::value_type;
+
+  using element_type = typename std::conditional<
+    std::is_arithmetic<other_value_type>::value, other_value_type, T>::type;
+
+  using type = scalar_terminal<element_type>;
+
+  static type get(const T& x)
+  { return type{static_cast<element_type>(x)}; }
+};
+
+template<class Operator, class L, class R>
+struct binary_expression_type
+{
+  using type = binary_expression<Operator,
+                                 typename expression_operand<L, R>::type,
+                                 typename expression_operand<R, L>::type>;
+};
+
+template<class Operator, class L, class R>
+typename binary_expression_type<Operator, L, R>::type
+make_binary_expression(const L& left, const R& right)
+{
+  return typename binary_expression_type<Operator, L, R>::type{
+    expression_operand<L, R>::get(left),
+    expression_operand<R, L>::get(right)
+  };
+}
+
+template<class Function, class T>
+unary_expression<Function, typename expression_operand<T, T>::type>
+make_unary_expression(const T& argument)
+{
+  return unary_expression<Function, typename expression_operand<T, T>::type>{
+    expression_operand<T, T>::get(argument)
+  };
+}
+
+/// Generates and launches the fused kernel of an expression type.
+/// Every combination of target type and expression type is a separate
+/// module with its own entrypoint id.
+template<class T, class Expression>
+class fused_expression_kernel
+{
+public:
+  static std::string get_source()
+  {
+    std::string parameters;
+    std::string code;
+    std::size_t argument_index = 0;
+    Expression::append_code(parameters, code, argument_index);
+
+    std::string target_type = cl_type_translator<T>::value;
+    std::string expression_type =
+        cl_type_translator<typename Expression::value_type>::value;
+    if(expression_type != target_type)
+      code = "(" + target_type + ")(" + code + ")";
+
+    return "__kernel void qcl_fused_expression(__global " + target_type
+         + "* qcl_target, uint qcl_n" + parameters + ")\n"
+           "{\n"
+           "  uint qcl_gid = get_global_id(0);\n"
+           "  if(qcl_gid < qcl_n)\n"
+           "    qcl_target[qcl_gid] = " + code + ";\n"
+           "}\n";
+  }
+
+  /// \return The name of the generated program. It serves as signature of
+  /// the expression in the program cache of the device context.
+  static std::string get_program_name()
+  {
+    std::string parameters;
+    std::string code;
+    std::size_t argument_index = 0;
+    Expression::append_code(parameters, code, argument_index);
+
+    return std::string{"qcl_fused_expression<"} + cl_type_translator<T>::value
+         + parameters + ">(" + code + ")";
+  }
+
+  static kernel_call get_call(const device_context_ptr& ctx,
+                              std::size_t num_elements)
+  {
+    static const std::size_t entrypoint_id = allocate_entrypoint_id();
+
+    entrypoint_kernel entrypoint = ctx->get_entrypoint_kernel(entrypoint_id);
+    if(!entrypoint.kernel)
+    {
+      std::string program_name = get_program_name();
+      ctx->register_source_code(get_source(),
+                                std::vector<std::string>{"qcl_fused_expression"},
+                                program_name,
+                                program_name);
+      entrypoint = ctx->set_entrypoint_kernel(entrypoint_id,
+        ctx->get_kernel(program_name + "::qcl_fused_expression"));
+    }
+
+    return kernel_call{ctx, entrypoint, cl::NDRange{num_elements}, cl::NullRange};
+  }
+};
+
+} // detail
+
+/// Evaluates an expression into an array with a single fused kernel.
+/// The kernel waits for the commands accessing the involved arrays
+/// as tracked by the arrays, but the host does not wait for the kernel.
+/// The target may also appear in the expression, since each element is
+/// only combined with the elements at the same position.
+/// \param target The array that receives the result. All arrays in the
+/// expression must have at least as many elements.
+/// \param expr The expression
+/// \param queue The command queue into which the kernel is enqueued
+/// \return The OpenCL error code of the kernel launch
+template<class T, class Expression>
+cl_int assign(device_array<T>& target,
+              const Expression& expr,
+              command_queue_id queue = 0)
+{
+  static_assert(detail::is_expression<Expression>::value,
+                "assign() requires an elementwise expression");
+  assert(expr.get_min_size() >= target.size());
+  assert(!expr.get_context() || *expr.get_context() == target.get_context());
+
+  if(target.size() == 0)
+    return CL_SUCCESS;
+
+  kernel_call call = detail::fused_expression_kernel<T, Expression>::get_call(
+        target.get_context(), target.size());
+  call.set_command_queue(queue);
+
+  call.partial_argument_list(target, static_cast<cl_uint>(target.size()));
+  expr.push_arguments(call);
+  return call.enqueue_kernel();
+}
+
+#define QCL_DEFINE_EXPRESSION_OPERATOR(op, name)                         \
+  template<class L, class R,                                              \
+           class = typename std::enable_if<                               \
+             detail::is_expression_operand<L>::value ||                   \
+             detail::is_expression_operand<R>::value>::type>              \
+  typename detail::binary_expression_type<detail::name, L, R>::type       \
+  operator op(const L& left, const R& right)                              \
+  { return detail::make_binary_expression<detail::name>(left, right); }
+
+QCL_DEFINE_EXPRESSION_OPERATOR(+, expression_plus)
+QCL_DEFINE_EXPRESSION_OPERATOR(-, expression_minus)
+QCL_DEFINE_EXPRESSION_OPERATOR(*, expression_multiplies)
+QCL_DEFINE_EXPRESSION_OPERATOR(/, expression_divides)
+
+#define QCL_DEFINE_EXPRESSION_FUNCTION(function, name)                   \
+  template<class T,                                                       \
+           class = typename std::enable_if<                               \
+             detail::is_expression_operand<T>::value>::type>              \
+  detail::unary_expression<detail::name,                                  \
+                           typename detail::expression_operand<T, T>::type> \
+  function(const T& argument)                                             \
+  { return detail::make_unary_expression<detail::name>(argument); }
+
+QCL_DEFINE_EXPRESSION_FUNCTION(operator-, expression_negate)
+QCL_DEFINE_EXPRESSION_FUNCTION(sqrt,      expression_sqrt)
+QCL_DEFINE_EXPRESSION_FUNCTION(exp,       expression_exp)
+QCL_DEFINE_EXPRESSION_FUNCTION(log,       expression_log)
+QCL_DEFINE_EXPRESSION_FUNCTION(fabs,      expression_fabs)
+
+namespace detail {
+// Makes the operators visible to argument-dependent lookup
+// for expression nodes
+using qcl::operator+;
+using qcl::operator-;
+using qcl::operator*;
+using qcl::operator/;
+}
+
+}
+
+#endif
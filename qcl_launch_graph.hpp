@@ -0,0 +1,525 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_LAUNCH_GRAPH_HPP
+#define QCL_LAUNCH_GRAPH_HPP
+
+#include <vector>
+#include <functional>
+#include <cassert>
+#include <algorithm>
+
+#include "qcl.hpp"
+#include "qcl_array.hpp"
+
+namespace qcl {
+
+/// Identifies a command recorded in a \c launch_graph
+using launch_graph_node = std::size_t;
+
+/// A sequence of kernel launches and memory transfers that is recorded
+/// once and can then be submitted repeatedly with a single call to \c replay().
+/// Every recorded kernel launch uses a private kernel object whose arguments
+/// are set once during recording, such that replaying the graph does not
+/// require any argument packing or \c setArg calls.
+///
+/// Commands recorded into the same command queue are executed in the order
+/// of recording (assuming in-order queues). Dependencies between commands
+/// in different command queues must be declared with \c add_dependency().
+///
+/// Example:
+/// \code
+/// qcl::launch_graph graph{ctx};
+/// graph.add_kernel(my_module::step_a(ctx, work, group), a, b);
+/// qcl::launch_graph_node n = graph.add_kernel(my_module::step_b(ctx, work, group), b, c);
+/// qcl::launch_graph_node d = graph.add_d2h(host_c.data(), c, host_c.size(), 1);
+/// graph.add_dependency(d, n);
+///
+/// for(int i = 0; i < num_iterations; ++i)
+///   graph.replay();
+/// \endcode
+///
+/// Buffers, host pointers and scalar arguments are captured at recording
+/// time and must remain valid as long as the graph is replayed. Scalar
+/// arguments can be changed later on with \c set_kernel_argument().
+///
+/// Like \c kernel_call, the graph tracks the accesses of the arrays passed
+/// to kernels and to the transfer overloads taking a \c device_array:
+/// On each replay, the first command of the graph accessing an array waits
+/// for the conflicting commands enqueued outside of the graph, and all
+/// commands are recorded as accesses of their arrays. Transfers recorded
+/// with a \c cl::Buffer are not tracked.
+class launch_graph
+{
+public:
+  /// Creates an empty graph
+  /// \param ctx The device context in which the commands are executed
+  explicit launch_graph(const device_context_ptr& ctx)
+    : _ctx{ctx}, _is_prepared{false}
+  {
+    assert(ctx != nullptr);
+  }
+
+  launch_graph(const launch_graph& other) = delete;
+  launch_graph& operator=(const launch_graph& other) = delete;
+
+  /// Records a kernel launch. The launch uses the kernel, problem size,
+  /// work group size and command queue of the given kernel call, but
+  /// a private kernel object to which the arguments are bound immediately.
+  /// The event and dependencies of the kernel call are ignored.
+  /// \return The node of the launch
+  /// \param call The kernel call, e.g. obtained from a module entrypoint
+  /// \param arguments The arguments of the kernel
+  template<typename... Args>
+  launch_graph_node add_kernel(const kernel_call& call, Args... arguments)
+  {
+    assert(call.get_device_context() == _ctx);
+
+    node n;
+    n.kernel = detail::create_kernel_instance(*call.get_kernel());
+    n.kernel_name = call.get_kernel_name();
+    n.global_size = call.get_work_dim();
+    n.local_size = call.get_group_dim();
+    n.queue = call.get_command_queue();
+
+    kernel_argument_list args{n.kernel};
+    // Some arguments expand to several kernel arguments, hence the
+    // position of the first kernel argument of each argument is stored
+    int expand[] = {0, (n.argument_positions.push_back(args.get_num_pushed_arguments()),
+                        check_cl_error(detail::push_kernel_argument(args, arguments),
+                                       "Could not set kernel argument!"),
+                        n.argument_accesses.push_back({}),
+                        detail::collect_tracked_access(arguments, n.argument_accesses.back()),
+                        0)...};
+    (void)expand;
+    n.argument_positions.push_back(args.get_num_pushed_arguments());
+
+    return add_node(n);
+  }
+
+  /// Records a host to device transfer
+  /// \return The node of the transfer
+  /// \param buff The destination buffer
+  /// \param data The source data
+  /// \param size The number of elements
+  /// \param queue The command queue of the transfer
+  template<class T>
+  launch_graph_node add_h2d(const cl::Buffer& buff,
+                            const T* data,
+                            std::size_t size,
+                            command_queue_id queue = 0)
+  {
+    node n;
+    n.queue = queue;
+    n.transfer = [this, buff, data, size, queue](const std::vector<cl::Event>* deps,
+                                                 cl::Event* evt)
+    {
+      _ctx->memcpy_h2d_async(buff, data, size, evt, deps, queue);
+    };
+    return add_node(n);
+  }
+
+  /// Records a host to device transfer into an array, which is tracked
+  /// as a write of the array.
+  /// \return The node of the transfer
+  /// \param dst The destination array
+  /// \param data The source data
+  /// \param size The number of elements
+  /// \param queue The command queue of the transfer
+  template<class T>
+  launch_graph_node add_h2d(device_array<T>& dst,
+                            const T* data,
+                            std::size_t size,
+                            command_queue_id queue = 0)
+  {
+    assert(dst.get_context() == _ctx);
+    assert(size <= dst.size());
+
+    launch_graph_node n = add_h2d(dst.get_buffer(), data, size, queue);
+    add_tracked_access(n, dst.get_access_tracker(), true);
+    return n;
+  }
+
+  /// Records a device to host transfer
+  /// \return The node of the transfer
+  /// \param data The destination memory
+  /// \param buff The source buffer
+  /// \param size The number of elements
+  /// \param queue The command queue of the transfer
+  template<class T>
+  launch_graph_node add_d2h(T* data,
+                            const cl::Buffer& buff,
+                            std::size_t size,
+                            command_queue_id queue = 0)
+  {
+    node n;
+    n.queue = queue;
+    n.transfer = [this, buff, data, size, queue](const std::vector<cl::Event>* deps,
+                                                 cl::Event* evt)
+    {
+      _ctx->memcpy_d2h_async(data, buff, size, evt, deps, queue);
+    };
+    return add_node(n);
+  }
+
+  /// Records a device to host transfer from an array, which is tracked
+  /// as a read of the array.
+  /// \return The node of the transfer
+  /// \param data The destination memory
+  /// \param src The source array
+  /// \param size The number of elements
+  /// \param queue The command queue of the transfer
+  template<class T>
+  launch_graph_node add_d2h(T* data,
+                            const device_array<T>& src,
+                            std::size_t size,
+                            command_queue_id queue = 0)
+  {
+    assert(src.get_context() == _ctx);
+    assert(size <= src.size());
+
+    launch_graph_node n = add_d2h(data, src.get_buffer(), size, queue);
+    add_tracked_access(n, src.get_access_tracker(), false);
+    return n;
+  }
+
+  /// Records a device to device transfer
+  /// \return The node of the transfer
+  /// \param dst The destination buffer
+  /// \param src The source buffer
+  /// \param size The number of elements
+  /// \param queue The command queue of the transfer
+  template<class T>
+  launch_graph_node add_d2d(const cl::Buffer& dst,
+                            const cl::Buffer& src,
+                            std::size_t size,
+                            command_queue_id queue = 0)
+  {
+    node n;
+    n.queue = queue;
+    n.transfer = [this, dst, src, size, queue](const std::vector<cl::Event>* deps,
+                                               cl::Event* evt)
+    {
+      _ctx->memcpy_d2d_async<T>(dst, src, size, evt, deps, queue);
+    };
+    return add_node(n);
+  }
+
+  /// Records a device to device transfer between arrays, which is tracked
+  /// as a write of \c dst and a read of \c src.
+  /// \return The node of the transfer
+  /// \param dst The destination array
+  /// \param src The source array
+  /// \param size The number of elements
+  /// \param queue The command queue of the transfer
+  template<class T>
+  launch_graph_node add_d2d(device_array<T>& dst,
+                            const device_array<T>& src,
+                            std::size_t size,
+                            command_queue_id queue = 0)
+  {
+    assert(dst.get_context() == _ctx && src.get_context() == _ctx);
+    assert(size <= dst.size() && size <= src.size());
+
+    launch_graph_node n = add_d2d<T>(dst.get_buffer(), src.get_buffer(), size, queue);
+    add_tracked_access(n, dst.get_access_tracker(), true);
+    add_tracked_access(n, src.get_access_tracker(), false);
+    return n;
+  }
+
+  /// Declares that a command must not start before another command
+  /// has completed.
+  /// \param n The dependent node
+  /// \param prerequisite The node that must complete first. Must have
+  /// been recorded before \c n.
+  void add_dependency(launch_graph_node n, launch_graph_node prerequisite)
+  {
+    assert(n < _nodes.size());
+    assert(prerequisite < n);
+
+    _nodes[n].prerequisites.push_back(prerequisite);
+    _is_prepared = false;
+  }
+
+  /// Changes an argument of a recorded kernel launch, e.g. a scalar
+  /// that differs between iterations.
+  /// \param n The node of the kernel launch
+  /// \param argument_index The index of the argument among the arguments
+  /// passed to \c add_kernel(). Arguments that expand to several kernel
+  /// arguments (e.g. a \c device_array_nd) count as one argument.
+  /// \param value The new value of the argument. Must expand to the same
+  /// number of kernel arguments as the recorded argument.
+  template<class T>
+  void set_kernel_argument(launch_graph_node n,
+                           unsigned argument_index,
+                           const T& value)
+  {
+    assert(n < _nodes.size());
+    node& kernel_node = _nodes[n];
+    assert(kernel_node.kernel != nullptr);
+    assert(argument_index + 1 < kernel_node.argument_positions.size());
+
+    kernel_argument_list args{kernel_node.kernel};
+    args.reset(kernel_node.argument_positions[argument_index]);
+    check_cl_error(detail::push_kernel_argument(args, value),
+                   "Could not set kernel argument!");
+    assert(args.get_num_pushed_arguments() ==
+           kernel_node.argument_positions[argument_index + 1]);
+
+    std::vector<detail::tracked_access>& accesses =
+        kernel_node.argument_accesses[argument_index];
+    accesses.clear();
+    detail::collect_tracked_access(value, accesses);
+    _is_prepared = false;
+  }
+
+  /// Enqueues all recorded commands.
+  /// \param dependencies Events that must complete before the first command
+  /// of each command queue starts. May be \c nullptr.
+  /// \param completion If not \c nullptr, will contain an event that
+  /// completes once all commands of the graph have completed.
+  void replay(const std::vector<cl::Event>* dependencies = nullptr,
+              cl::Event* completion = nullptr)
+  {
+    if(!_is_prepared)
+      prepare();
+
+    for(std::size_t i = 0; i < _nodes.size(); ++i)
+    {
+      const node& n = _nodes[i];
+
+      std::vector<cl::Event>& wait_list = _wait_lists[i];
+      wait_list.clear();
+      for(launch_graph_node prerequisite : n.prerequisites)
+        wait_list.push_back(_events[prerequisite]);
+      if(n.is_first_in_queue && dependencies)
+        wait_list.insert(wait_list.end(), dependencies->begin(), dependencies->end());
+      for(const detail::tracked_access& access : n.external_accesses)
+      {
+        if(access.is_write)
+          access.tracker->get_write_dependencies(wait_list);
+        else
+          access.tracker->get_read_dependencies(wait_list);
+      }
+
+      const std::vector<cl::Event>* deps = wait_list.empty() ? nullptr : &wait_list;
+      cl::Event* evt = n.needs_event ? &_events[i] : nullptr;
+
+      if(n.kernel)
+        check_cl_error(_ctx->enqueue_ndrange_kernel(n.kernel, n.global_size, n.local_size,
+                                                    evt, cl::NullRange, deps, n.queue,
+                                                    n.kernel_name.get()),
+                       "Could not enqueue kernel of launch graph!");
+      else
+        n.transfer(deps, evt);
+
+      for(const detail::tracked_access& access : n.accesses)
+      {
+        if(access.is_write)
+          access.tracker->record_write(*evt);
+        else
+          access.tracker->record_read(*evt);
+      }
+    }
+
+    if(completion)
+    {
+      if(_final_events.size() == 1)
+        *completion = _events[_final_events[0]];
+      else if(!_final_events.empty())
+      {
+        std::vector<cl::Event> final_events;
+        for(launch_graph_node final_node : _final_events)
+          final_events.push_back(_events[final_node]);
+
+        check_cl_error(_ctx->get_command_queue(_nodes[_final_events[0]].queue)
+                         .enqueueMarkerWithWaitList(&final_events, completion),
+                       "Could not enqueue marker!");
+      }
+    }
+  }
+
+  /// Enqueues all recorded commands and waits until they have completed.
+  void replay_and_wait()
+  {
+    cl::Event completion;
+    replay(nullptr, &completion);
+    if(!_nodes.empty())
+      check_cl_error(completion.wait(), "Could not wait for launch graph!");
+  }
+
+  /// \return The number of recorded commands
+  std::size_t get_num_nodes() const
+  {
+    return _nodes.size();
+  }
+
+  /// \return The device context of the graph
+  const device_context_ptr& get_device_context() const
+  {
+    return _ctx;
+  }
+
+private:
+  struct node
+  {
+    /// The kernel with bound arguments, or \c nullptr for transfers
+    kernel_ptr kernel;
+    /// The scoped name of the kernel, or \c nullptr if unknown
+    std::shared_ptr<const std::string> kernel_name;
+    cl::NDRange global_size;
+    cl::NDRange local_size;
+    /// The index of the first kernel argument of each argument passed to
+    /// \c add_kernel(), followed by the number of kernel arguments
+    std::vector<unsigned> argument_positions;
+
+    /// The tracked arrays accessed through each argument passed to
+    /// \c add_kernel(), or through the transfer
+    std::vector<std::vector<detail::tracked_access>> argument_accesses;
+    /// All tracked accesses of the command, recorded on each replay
+    std::vector<detail::tracked_access> accesses;
+    /// The arrays which the graph accesses first in this command.
+    /// The command waits for their conflicting accesses outside of
+    /// the graph; an access counts as write if any command of the graph
+    /// writes the array.
+    std::vector<detail::tracked_access> external_accesses;
+
+    /// Enqueues a transfer, given the wait list and the event
+    std::function<void (const std::vector<cl::Event>*, cl::Event*)> transfer;
+
+    command_queue_id queue = 0;
+    std::vector<launch_graph_node> prerequisites;
+
+    /// Whether the event of the command is needed by other commands
+    /// or for the completion event
+    bool needs_event = false;
+    /// Whether this is the first command of its command queue
+    bool is_first_in_queue = false;
+  };
+
+  launch_graph_node add_node(const node& n)
+  {
+    assert(n.queue < _ctx->get_num_command_queues());
+
+    _nodes.push_back(n);
+    _is_prepared = false;
+    return _nodes.size() - 1;
+  }
+
+  void add_tracked_access(launch_graph_node n,
+                          const std::shared_ptr<detail::access_tracker>& tracker,
+                          bool is_write)
+  {
+    if(!tracker)
+      return;
+    std::vector<std::vector<detail::tracked_access>>& accesses = _nodes[n].argument_accesses;
+    if(accesses.empty())
+      accesses.push_back({});
+    accesses.back().push_back(detail::tracked_access{tracker, is_write});
+  }
+
+  /// Determines which commands need events, which commands are
+  /// the first and last commands of their command queues, and
+  /// which commands first access each tracked array.
+  void prepare()
+  {
+    // Whether the graph writes each tracked array, and the command
+    // that accesses it first
+    std::vector<detail::tracked_access> tracked_arrays;
+    std::vector<launch_graph_node> first_access;
+    for(std::size_t i = 0; i < _nodes.size(); ++i)
+    {
+      node& n = _nodes[i];
+      n.accesses.clear();
+      n.external_accesses.clear();
+      for(const std::vector<detail::tracked_access>& accesses : n.argument_accesses)
+        n.accesses.insert(n.accesses.end(), accesses.begin(), accesses.end());
+
+      for(const detail::tracked_access& access : n.accesses)
+      {
+        auto known = std::find_if(tracked_arrays.begin(), tracked_arrays.end(),
+                                  [&access](const detail::tracked_access& a)
+                                  { return a.tracker == access.tracker; });
+        if(known == tracked_arrays.end())
+        {
+          tracked_arrays.push_back(access);
+          first_access.push_back(i);
+        }
+        else
+          known->is_write = known->is_write || access.is_write;
+      }
+    }
+    for(std::size_t i = 0; i < tracked_arrays.size(); ++i)
+      _nodes[first_access[i]].external_accesses.push_back(tracked_arrays[i]);
+
+    _events.assign(_nodes.size(), cl::Event());
+    _wait_lists.assign(_nodes.size(), std::vector<cl::Event>());
+    _final_events.clear();
+
+    std::vector<launch_graph_node> last_in_queue(_ctx->get_num_command_queues(),
+                                                 _nodes.size());
+    for(std::size_t i = 0; i < _nodes.size(); ++i)
+    {
+      node& n = _nodes[i];
+      n.needs_event = !n.accesses.empty();
+      n.is_first_in_queue = (last_in_queue[n.queue] == _nodes.size());
+      last_in_queue[n.queue] = i;
+
+      for(launch_graph_node prerequisite : n.prerequisites)
+        _nodes[prerequisite].needs_event = true;
+    }
+
+    for(launch_graph_node last : last_in_queue)
+    {
+      if(last != _nodes.size())
+      {
+        _nodes[last].needs_event = true;
+        _final_events.push_back(last);
+      }
+    }
+
+    _is_prepared = true;
+  }
+
+  device_context_ptr _ctx;
+  std::vector<node> _nodes;
+
+  /// The events of the commands of the last replay
+  std::vector<cl::Event> _events;
+  /// Reused storage for the wait lists of the commands
+  std::vector<std::vector<cl::Event>> _wait_lists;
+  /// The last commands of each used command queue
+  std::vector<launch_graph_node> _final_events;
+
+  bool _is_prepared;
+};
+
+}
+
+#endif
@@ -201,8 +201,202 @@ DECLARE_TYPE_TRANSLATOR(cl_ulong4,  ulong4);
 DECLARE_TYPE_TRANSLATOR(cl_ulong8,  ulong8);
 DECLARE_TYPE_TRANSLATOR(cl_ulong16, ulong16);
 
+/// Maps scalar types to the device queries of their vector widths
+template<class T>
+struct vector_width_query
+{
+};
+
+#define DECLARE_VECTOR_WIDTH_QUERY(T, cl_name) \
+  template<> struct vector_width_query<T>     \
+  {                                           \
+    static cl_device_info preferred()         \
+    { return CL_DEVICE_PREFERRED_VECTOR_WIDTH_##cl_name; } \
+    static cl_device_info native()            \
+    { return CL_DEVICE_NATIVE_VECTOR_WIDTH_##cl_name; }    \
+  }
+
+DECLARE_VECTOR_WIDTH_QUERY(char,              CHAR);
+DECLARE_VECTOR_WIDTH_QUERY(unsigned char,     CHAR);
+DECLARE_VECTOR_WIDTH_QUERY(short,             SHORT);
+DECLARE_VECTOR_WIDTH_QUERY(unsigned short,    SHORT);
+DECLARE_VECTOR_WIDTH_QUERY(int,               INT);
+DECLARE_VECTOR_WIDTH_QUERY(unsigned,          INT);
+DECLARE_VECTOR_WIDTH_QUERY(long,              INT);
+DECLARE_VECTOR_WIDTH_QUERY(unsigned long,     INT);
+DECLARE_VECTOR_WIDTH_QUERY(long long,         LONG);
+DECLARE_VECTOR_WIDTH_QUERY(unsigned long long,LONG);
+DECLARE_VECTOR_WIDTH_QUERY(float,             FLOAT);
+DECLARE_VECTOR_WIDTH_QUERY(double,            DOUBLE);
+
+/// \return The function returning the interface of a module, if the
+/// module declares one with \c QCL_MODULE_INTERFACE()
+template<class Module>
+auto get_module_interface(int) -> decltype(&Module::_qcl_interface)
+{
+  return &Module::_qcl_interface;
+}
+
+/// \return \c nullptr for modules without interface
+template<class Module>
+module_registry::source_function get_module_interface(long)
+{
+  return nullptr;
+}
+
+/// \return The interface of a module, or an empty string if the module
+/// has no interface
+template<class Module>
+std::string get_module_interface_source()
+{
+  module_registry::source_function interface = get_module_interface<Module>(0);
+  return interface ? interface() : std::string{};
+}
+
+/// \return The id of a module in the \c module_registry. The module
+/// is registered on the first call.
+template<class Module>
+std::size_t get_module_id()
+{
+  static const std::size_t id =
+      module_registry::get().add(Module::_qcl_get_module_name(),
+                                 &Module::_qcl_private_source,
+                                 get_module_interface<Module>(0));
+  return id;
+}
 
+/// \return The meta command that includes a module
+template<class Module>
+std::string get_module_include_command()
+{
+  return "$include "+std::to_string(get_module_id<Module>())+"$";
 }
+
+}
+
+/// A specialization (see \c qcl::specialization) that makes a vector width
+/// and the corresponding vector type available in the module source:
+///   - \c QCL_VEC_WIDTH: The vector width
+///   - \c QCL_VEC_SCALAR: The scalar type
+///   - \c QCL_VEC_TYPE: The vector type, or the scalar type if the width is 1
+///   - \c QCL_VLOAD(offset, p), \c QCL_VSTORE(data, offset, p): Load and store
+///     a vector from the scalar pointer \c p like \c vloadn and \c vstoren
+///
+/// When passed to a module entrypoint, the first dimension of the NDRange
+/// is divided by the vector width, such that each work item processes
+/// \c QCL_VEC_WIDTH elements. Example:
+/// \code
+/// __kernel void scale(__global float* data, uint n, float factor)
+/// {
+///   uint i = get_global_id(0);
+///   if((i + 1) * QCL_VEC_WIDTH <= n)
+///     QCL_VSTORE(factor * QCL_VLOAD(i, data), i, data);
+///   else
+///     for(uint j = i * QCL_VEC_WIDTH; j < n; ++j)
+///       data[j] *= factor;
+/// }
+/// \endcode
+/// \code
+/// my_module::scale(ctx, qcl::make_vector_specialization<float>(ctx),
+///                  cl::NDRange{n}, cl::NDRange{64})(data, n, 2.f);
+/// \endcode
+class vector_specialization : public specialization
+{
+public:
+  /// \param scalar_type The name of the scalar type in CL
+  /// \param width The vector width. Must be 1, 2, 4, 8 or 16.
+  vector_specialization(const std::string& scalar_type, cl_uint width)
+    : _width{width}
+  {
+    assert(width == 1 || width == 2 || width == 4 || width == 8 || width == 16);
+
+    std::string n = std::to_string(width);
+    set("QCL_VEC_WIDTH", static_cast<int>(width));
+    set_literal("QCL_VEC_SCALAR", scalar_type);
+    if(width == 1)
+    {
+      set_literal("QCL_VEC_TYPE", scalar_type);
+      set_literal("QCL_VLOAD(offset,p)", "((p)[offset])");
+      set_literal("QCL_VSTORE(data,offset,p)", "((p)[offset] = (data))");
+    }
+    else
+    {
+      set_literal("QCL_VEC_TYPE", scalar_type + n);
+      set_literal("QCL_VLOAD(offset,p)", "vload" + n + "(offset, p)");
+      set_literal("QCL_VSTORE(data,offset,p)", "vstore" + n + "(data, offset, p)");
+    }
+  }
+
+  /// \return The vector width
+  cl_uint get_width() const
+  {
+    return _width;
+  }
+
+  /// \return The NDRange of a vectorized launch: The first dimension
+  /// is divided by the vector width, rounding up.
+  /// \param work_items The number of elements in each dimension
+  cl::NDRange scale(const cl::NDRange& work_items) const
+  {
+    const std::size_t* sizes = work_items.get();
+    std::size_t scaled = (sizes[0] + _width - 1) / _width;
+
+    switch(work_items.dimensions())
+    {
+    case 1:
+      return cl::NDRange{scaled};
+    case 2:
+      return cl::NDRange{scaled, sizes[1]};
+    case 3:
+      return cl::NDRange{scaled, sizes[1], sizes[2]};
+    default:
+      return work_items;
+    }
+  }
+private:
+  cl_uint _width;
+};
+
+/// \return The vector width for a scalar type recommended by a device. Valid
+/// OpenCL vector widths are returned, i.e. 1 if the device does not support
+/// the type (e.g. \c double without \c cl_khr_fp64).
+/// \tparam T The scalar type
+/// \param ctx The device context
+/// \param native If true, the native vector width (the width of the
+/// hardware vector units) is returned instead of the preferred vector width
+/// reported by the compiler.
+template<class T>
+cl_uint get_vector_width(const device_context_ptr& ctx, bool native = false)
+{
+  cl_device_info info = native ? detail::vector_width_query<T>::native()
+                               : detail::vector_width_query<T>::preferred();
+  cl_uint width = 1;
+  check_cl_error(ctx->get_device().getInfo(info, &width),
+                 "Could not obtain device information!");
+
+  cl_uint valid_width = 1;
+  while(valid_width * 2 <= std::min(width, 16u))
+    valid_width *= 2;
+  return valid_width;
+}
+
+/// \return A vector specialization for the vector width of a scalar type
+/// recommended by a device, see \c get_vector_width()
+/// \tparam T The scalar type
+/// \param ctx The device context
+/// \param native Whether to use the native instead of the preferred width
+/// \param max_width An upper bound for the vector width
+template<class T>
+vector_specialization make_vector_specialization(const device_context_ptr& ctx,
+                                                 bool native = false,
+                                                 cl_uint max_width = 16)
+{
+  cl_uint width = std::min(get_vector_width<T>(ctx, native), std::max(max_width, 1u));
+  while((width & (width - 1)) != 0)
+    width &= width - 1;
+  return vector_specialization{detail::cl_type_translator<T>::value, width};
+}
+
 }
 
 /// This macro, together with \c QCL_MAKE_SOURCE is required
@@ -236,7 +430,9 @@ DECLARE_TYPE_TRANSLATOR(cl_ulong16, ulong16);
 #define QCL_MAKE_SOURCE(source_code) \
   static std::string _qcl_private_source()      \
   {                                             \
-    std::string code = source_code;             \
+    std::string code =                          \
+      qcl::detail::get_module_interface_source<_qcl_this_type>(); \
+    code += source_code;                        \
     std::string include_guard = "QCL_MODULE_"+_qcl_get_module_name()+"_CL"; \
     return "#ifndef "+include_guard             \
         +"\n#define "+include_guard             \
@@ -275,7 +471,18 @@ DECLARE_TYPE_TRANSLATOR(cl_ulong16, ulong16);
 ///
 /// Defines a function that compiles the source (if not already
 /// compiled) and returns a \c qcl::kernel_call object to execute
-/// the kernel.
+/// the kernel. The kernel is resolved only once per device context,
+/// subsequent calls retrieve it directly from the context's entrypoint
+/// table without assembling the module source or looking up any names.
+/// If thread-safe launches are enabled for the context (see
+/// \c qcl::device_context::enable_thread_safe_launches()), the
+/// entrypoint may be called concurrently from several threads.
+/// A second overload takes a \c qcl::specialization as additional argument
+/// after the device context. It returns a call of the kernel from the module
+/// compiled with the values of the specialization defined as macros,
+/// see \c qcl::specialization.
+/// For a \c qcl::vector_specialization, the first dimension of the
+/// NDRange is additionally divided by the vector width.
 /// \param kernel_name The entrypoint's name. Must correspond to
 /// a kernel in the CL source
 #define QCL_ENTRYPOINT(kernel_name) \
@@ -286,27 +493,113 @@ DECLARE_TYPE_TRANSLATOR(cl_ulong16, ulong16);
                                cl::Event* evt = nullptr,            \
                                std::vector<cl::Event>* dependencies = nullptr) \
   { \
-    std::string kernel_name = BOOST_PP_STRINGIZE(kernel_name);                \
-    ctx->register_source_code(_qcl_source(),                                  \
-                             std::vector<std::string>{kernel_name},           \
-                             _qcl_get_module_name(),                          \
-                             _qcl_get_module_name());                         \
+    static const std::size_t _qcl_entrypoint_id =                             \
+      qcl::detail::allocate_entrypoint_id();                                  \
+    qcl::detail::entrypoint_kernel _qcl_entrypoint =                          \
+      ctx->get_entrypoint_kernel(_qcl_entrypoint_id);                         \
+    if(!_qcl_entrypoint.kernel)                                               \
+    {                                                                         \
+      std::string kernel_name = BOOST_PP_STRINGIZE(kernel_name);              \
+      ctx->register_source_code(_qcl_source(),                                \
+                               std::vector<std::string>{kernel_name},         \
+                               _qcl_get_module_name(),                        \
+                               _qcl_get_module_name());                       \
+      _qcl_entrypoint = ctx->set_entrypoint_kernel(_qcl_entrypoint_id,        \
+        ctx->get_kernel(_qcl_get_module_name()+"::"+kernel_name));            \
+    }                                                                         \
     return qcl::kernel_call(ctx,                                              \
-                            ctx->get_kernel(_qcl_get_module_name()+"::"+kernel_name),\
+                            _qcl_entrypoint,                                  \
                             minimum_work_dim,                                 \
                             group_dim,                                        \
                             evt,                                              \
                             dependencies);                                    \
+  }                                                                           \
+  static                                                                      \
+  qcl::kernel_call kernel_name(const qcl::device_context_ptr& ctx,            \
+                               const qcl::specialization& spec,               \
+                               const cl::NDRange& minimum_work_dim,           \
+                               const cl::NDRange& group_dim,                  \
+                               cl::Event* evt = nullptr,                      \
+                               std::vector<cl::Event>* dependencies = nullptr) \
+  {                                                                           \
+    static const std::size_t _qcl_entrypoint_id =                             \
+      qcl::detail::allocate_entrypoint_id();                                  \
+    return qcl::kernel_call(ctx,                                              \
+                            ctx->get_specialized_kernel(_qcl_entrypoint_id,   \
+                                     BOOST_PP_STRINGIZE(kernel_name),         \
+                                     spec,                                    \
+                                     []{ return _qcl_source(); },             \
+                                     []{ return _qcl_get_module_name(); }),   \
+                            minimum_work_dim,                                 \
+                            group_dim,                                        \
+                            evt,                                              \
+                            dependencies);                                    \
+  }                                                                           \
+  static                                                                      \
+  qcl::kernel_call kernel_name(const qcl::device_context_ptr& ctx,            \
+                               const qcl::vector_specialization& spec,        \
+                               const cl::NDRange& minimum_work_dim,           \
+                               const cl::NDRange& group_dim,                  \
+                               cl::Event* evt = nullptr,                      \
+                               std::vector<cl::Event>* dependencies = nullptr) \
+  {                                                                           \
+    static const std::size_t _qcl_entrypoint_id =                             \
+      qcl::detail::allocate_entrypoint_id();                                  \
+    return qcl::kernel_call(ctx,                                              \
+                            ctx->get_specialized_kernel(_qcl_entrypoint_id,   \
+                                     BOOST_PP_STRINGIZE(kernel_name),         \
+                                     spec,                                    \
+                                     []{ return _qcl_source(); },             \
+                                     []{ return _qcl_get_module_name(); }),   \
+                            spec.scale(minimum_work_dim),                     \
+                            group_dim,                                        \
+                            evt,                                              \
+                            dependencies);                                    \
   }
 
 
+/// Declares the interface of a module, i.e. the declarations (function
+/// prototypes, types, macros) that other modules need to use it. For
+/// standalone modules, must be called between \c QCL_STANDALONE_MODULE()
+/// and \c QCL_STANDALONE_SOURCE(). The interface is prepended to the source
+/// of the module, hence the declarations must not be repeated there.
+/// The argument can contain the same nested calls as \c QCL_MAKE_SOURCE().
+/// If separate compilation is enabled (see
+/// \c qcl::device_context::enable_separate_compilation()), modules including
+/// this module only see the interface, while the module itself is compiled
+/// once and linked to them. Example:
+/// \code
+/// QCL_STANDALONE_MODULE(math_utils)
+/// QCL_MODULE_INTERFACE(R"(
+///   float smooth_step(float x);
+/// )")
+/// QCL_STANDALONE_SOURCE(R"(
+///   float smooth_step(float x) { return x * x * (3.0f - 2.0f * x); }
+/// )")
+/// \endcode
+/// \param interface_code A string containing the declarations
+#define QCL_MODULE_INTERFACE(interface_code) \
+  static std::string _qcl_interface()           \
+  {                                             \
+    std::string code = interface_code;          \
+    std::string include_guard = "QCL_MODULE_"+_qcl_get_module_name()+"_INTERFACE_CL"; \
+    return "#ifndef "+include_guard             \
+        +"\n#define "+include_guard             \
+        +"\n"+code                              \
+        +"\n#endif\n";                          \
+  }
+
 /// Makes a different module accessible from the current CL module.
 /// This call must be nested inside a \c QCL_STANDALONE_SOURCE() or
 /// \c QCL_MAKE_SOURCE() call (see their documentation for more information).
-/// Note that currently, there is no dedection of cyclic dependencies,
-/// so be careful when including modules.
+/// The module is inserted as \c $include$ meta command, which is resolved
+/// when the source is compiled (see \c qcl::detail::meta_source_processor):
+/// Each module is emitted only once, even if it is included by several
+/// modules, and cyclic dependencies are reported as error.
+/// With separate compilation, modules that declare an interface are only
+/// included with their interface, see \c QCL_MODULE_INTERFACE().
 /// \param module The name of the source module that shall be included
-#define QCL_INCLUDE_MODULE(module) module::_qcl_source()+
+#define QCL_INCLUDE_MODULE(module) qcl::detail::get_module_include_command<module>()+
 
 /// Make a template type argument accessible from the CL source.
 /// This call must be nested inside a \c QCL_STANDALONE_SOURCE() or
@@ -0,0 +1,676 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_MULTI_DEVICE_HPP
+#define QCL_MULTI_DEVICE_HPP
+
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <cassert>
+#include <thread>
+#include <mutex>
+#include <exception>
+
+#include "qcl.hpp"
+#include "qcl_array.hpp"
+
+namespace qcl {
+
+/// A contiguous range of work items or elements
+struct work_range
+{
+  /// The position of the first element
+  std::size_t offset;
+  /// The number of elements
+  std::size_t size;
+};
+
+/// Splits work across all devices of a global context according to their
+/// relative throughput. By default, the throughput of a device is estimated
+/// as the product of its number of compute units and its clock frequency.
+/// Since this estimate is only rough (in particular when mixing different
+/// device types), the weights can also be measured with \c calibrate() or
+/// set explicitly.
+///
+/// Example:
+/// \code
+/// qcl::device_partitioner partitioner{global_ctx};
+/// qcl::distributed_array<float> data{global_ctx, partitioner.partition(n, 64)};
+/// data.scatter(host_data.data());
+/// partitioner.launch(data.get_partition(),
+///   [&](std::size_t dev, const qcl::device_context_ptr& ctx,
+///       const qcl::work_range& range, cl::Event* evt)
+///   {
+///     return my_module::my_kernel(ctx, range.size, 64, evt)
+///       (data.local(dev), static_cast<cl_uint>(range.offset));
+///   });
+/// data.gather(host_data.data());
+/// \endcode
+class device_partitioner
+{
+public:
+  /// \param global_ctx The global context containing the devices
+  explicit device_partitioner(const global_context_ptr& global_ctx)
+    : _global_ctx{global_ctx}
+  {
+    for(std::size_t i = 0; i < global_ctx->get_num_devices(); ++i)
+      _weights.push_back(estimate_throughput(global_ctx->device(i)));
+  }
+
+  /// \return An estimate of the relative throughput of a device, based
+  /// on the number of compute units and the clock frequency.
+  /// \param ctx The device context
+  static double estimate_throughput(const device_context_ptr& ctx)
+  {
+    double compute_units = static_cast<double>(ctx->get_max_compute_units());
+    double frequency = static_cast<double>(ctx->get_max_clock_frequency());
+    if(compute_units <= 0.0 || frequency <= 0.0)
+      return 1.0;
+    return compute_units * frequency;
+  }
+
+  /// \return The global context
+  const global_context_ptr& get_global_context() const
+  {
+    return _global_ctx;
+  }
+
+  /// \return The relative weights of the devices
+  const std::vector<double>& get_weights() const
+  {
+    return _weights;
+  }
+
+  /// Sets the relative weights of the devices.
+  /// \param weights The weights, one non-negative value per device.
+  /// Devices with weight 0 do not receive any work.
+  void set_weights(const std::vector<double>& weights)
+  {
+    assert(weights.size() == _global_ctx->get_num_devices());
+    _weights = weights;
+  }
+
+  /// Measures the throughput of the devices by running the same workload
+  /// on each device and sets the weights accordingly. The workload should
+  /// be large enough to saturate the devices. Note that the first launch
+  /// of a kernel may include its compilation; it is hence recommended
+  /// to call the launcher once on each device before calibrating.
+  /// \param problem_size The number of work items of the workload
+  /// \param launcher The launcher for the workload, see \c launch()
+  /// \param repetitions How often the workload is run on each device
+  template<class Launcher>
+  void calibrate(std::size_t problem_size, Launcher launcher,
+                 std::size_t repetitions = 3)
+  {
+    assert(repetitions > 0);
+
+    for(std::size_t i = 0; i < _global_ctx->get_num_devices(); ++i)
+    {
+      const device_context_ptr& ctx = _global_ctx->device(i);
+      work_range range{0, problem_size};
+
+      auto start = std::chrono::steady_clock::now();
+      for(std::size_t r = 0; r < repetitions; ++r)
+      {
+        cl::Event evt;
+        check_cl_error(launcher(i, ctx, range, &evt),
+                       "Could not enqueue calibration kernel!");
+        check_cl_error(evt.wait(), "Could not wait for calibration kernel!");
+      }
+      auto stop = std::chrono::steady_clock::now();
+
+      double seconds = std::chrono::duration<double>(stop - start).count();
+      _weights[i] = seconds > 0.0 ? 1.0 / seconds : 1.0;
+    }
+  }
+
+  /// Splits a range into one contiguous part per device, with sizes
+  /// proportional to the device weights.
+  /// \return The range of each device. Devices may receive empty ranges.
+  /// \param num_elements The size of the whole range
+  /// \param granularity The sizes of all parts except the last one are
+  /// multiples of this value, e.g. the work group size.
+  std::vector<work_range> partition(std::size_t num_elements,
+                                    std::size_t granularity = 1) const
+  {
+    assert(granularity > 0);
+    assert(!_weights.empty());
+
+    double total_weight = 0.0;
+    for(double w : _weights)
+      total_weight += w;
+
+    std::vector<work_range> result;
+    double accumulated_weight = 0.0;
+    std::size_t begin = 0;
+    for(std::size_t i = 0; i < _weights.size(); ++i)
+    {
+      accumulated_weight += _weights[i];
+
+      std::size_t end = num_elements;
+      if(i + 1 < _weights.size() && total_weight > 0.0)
+      {
+        double fraction = accumulated_weight / total_weight;
+        end = static_cast<std::size_t>(fraction * static_cast<double>(num_elements));
+        // Round to the nearest multiple of the granularity
+        end = ((end + granularity / 2) / granularity) * granularity;
+        end = std::min(std::max(end, begin), num_elements);
+      }
+
+      result.push_back(work_range{begin, end - begin});
+      begin = end;
+    }
+    return result;
+  }
+
+  /// Launches work on all devices according to a partition and waits
+  /// until all devices have finished. The launches on the different devices
+  /// are enqueued before waiting, such that the devices run concurrently.
+  /// \param partition The range of each device, e.g. from \c partition()
+  /// \param launcher A callable with the signature
+  /// <tt>cl_int(std::size_t device_index, const device_context_ptr& ctx,
+  /// const work_range& range, cl::Event* evt)</tt>, that enqueues the work
+  /// for a device and signals \c evt when done. The launcher is only called
+  /// for devices with non-empty ranges.
+  template<class Launcher>
+  void launch(const std::vector<work_range>& partition, Launcher launcher) const
+  {
+    assert(partition.size() == _global_ctx->get_num_devices());
+
+    std::vector<cl::Event> events;
+    for(std::size_t i = 0; i < partition.size(); ++i)
+    {
+      if(partition[i].size == 0)
+        continue;
+
+      const device_context_ptr& ctx = _global_ctx->device(i);
+
+      events.push_back(cl::Event{});
+      check_cl_error(launcher(i, ctx, partition[i], &events.back()),
+                     "Could not enqueue work on device "+ctx->get_device_name());
+      ctx->get_command_queue().flush();
+    }
+
+    for(const cl::Event& evt : events)
+      check_cl_error(evt.wait(), "Could not wait for device work!");
+  }
+
+  /// Partitions a range with \c partition() and launches work on all
+  /// devices with \c launch().
+  /// \return The used partition
+  /// \param num_work_items The size of the whole range
+  /// \param granularity The granularity of the partition
+  /// \param launcher The launcher, see \c launch()
+  template<class Launcher>
+  std::vector<work_range> launch(std::size_t num_work_items,
+                                 std::size_t granularity,
+                                 Launcher launcher) const
+  {
+    std::vector<work_range> ranges = partition(num_work_items, granularity);
+    launch(ranges, launcher);
+    return ranges;
+  }
+private:
+  global_context_ptr _global_ctx;
+  std::vector<double> _weights;
+};
+
+/// A tile of a 1D or 2D NDRange, as processed by the
+/// \c work_stealing_scheduler
+struct work_tile
+{
+  /// The global offset of the tile, suitable for
+  /// \c kernel_call::set_global_offset()
+  cl::NDRange offset;
+  /// The global size of the tile
+  cl::NDRange size;
+  /// The linear index of the tile in the tiling of the NDRange
+  std::size_t index;
+};
+
+/// Distributes the tiles of an NDRange dynamically across all devices of a
+/// global context. Initially, each device receives a contiguous chunk of
+/// tiles proportional to its weight (see \c device_partitioner). Once a
+/// device has run out of tiles, it steals tiles from the end of the queue
+/// of the device with the most remaining tiles. This balances the load
+/// even if the weights are inaccurate, e.g. when mixing CPU and GPU devices.
+/// To overlap launches with execution, each device keeps up to a bounded
+/// number of tiles in flight.
+///
+/// Example:
+/// \code
+/// qcl::work_stealing_scheduler scheduler{global_ctx};
+/// scheduler.run(cl::NDRange{width, height}, cl::NDRange{256, 256},
+///   [&](std::size_t dev, const qcl::device_context_ptr& ctx,
+///       const qcl::work_tile& tile, cl::Event* evt)
+///   {
+///     // Border tiles are rounded up to the work group size, hence the
+///     // kernel checks its global id against width and height
+///     return my_module::my_kernel(ctx, tile.size, cl::NDRange{16, 16}, evt)
+///       .set_global_offset(tile.offset)(images[dev], width, height);
+///   });
+/// \endcode
+class work_stealing_scheduler
+{
+public:
+  /// \param global_ctx The global context containing the devices
+  /// \param max_in_flight The maximum number of tiles that may be enqueued
+  /// but not yet completed on a device at any time
+  explicit work_stealing_scheduler(const global_context_ptr& global_ctx,
+                                   std::size_t max_in_flight = 2)
+    : _global_ctx{global_ctx},
+      _max_in_flight{max_in_flight},
+      _num_processed(global_ctx->get_num_devices(), 0),
+      _num_stolen(global_ctx->get_num_devices(), 0)
+  {
+    assert(max_in_flight > 0);
+
+    for(std::size_t i = 0; i < global_ctx->get_num_devices(); ++i)
+      _weights.push_back(device_partitioner::estimate_throughput(global_ctx->device(i)));
+  }
+
+  /// \return The global context
+  const global_context_ptr& get_global_context() const
+  {
+    return _global_ctx;
+  }
+
+  /// \return The relative weights of the devices that determine the
+  /// initial distribution of the tiles
+  const std::vector<double>& get_weights() const
+  {
+    return _weights;
+  }
+
+  /// Sets the relative weights of the devices, e.g. the weights obtained
+  /// by \c device_partitioner::calibrate().
+  /// \param weights The weights, one non-negative value per device.
+  /// Devices with weight 0 initially do not receive any tiles, but still
+  /// steal tiles from other devices.
+  void set_weights(const std::vector<double>& weights)
+  {
+    assert(weights.size() == _global_ctx->get_num_devices());
+    _weights = weights;
+  }
+
+  /// \return The maximum number of tiles in flight per device
+  std::size_t get_max_in_flight() const
+  {
+    return _max_in_flight;
+  }
+
+  /// Sets the maximum number of tiles in flight per device
+  /// \param max_in_flight The new maximum, must be at least 1
+  void set_max_in_flight(std::size_t max_in_flight)
+  {
+    assert(max_in_flight > 0);
+    _max_in_flight = max_in_flight;
+  }
+
+  /// Splits a 1D or 2D NDRange into tiles. Tiles at the upper borders
+  /// are smaller if the tile size does not divide the global size, and
+  /// are then generally no multiple of the work group size.
+  /// \return The tiles in row-major order
+  /// \param global_size The NDRange to split
+  /// \param tile_size The size of the tiles. Should be a multiple of the
+  /// work group size.
+  static std::vector<work_tile> make_tiles(const cl::NDRange& global_size,
+                                           const cl::NDRange& tile_size)
+  {
+    assert(global_size.dimensions() == 1 || global_size.dimensions() == 2);
+    assert(tile_size.dimensions() == global_size.dimensions());
+
+    std::vector<work_tile> tiles;
+    if(global_size.dimensions() == 1)
+    {
+      assert(tile_size[0] > 0);
+      for(std::size_t x = 0; x < global_size[0]; x += tile_size[0])
+        tiles.push_back(work_tile{cl::NDRange{x},
+                                  cl::NDRange{std::min(tile_size[0], global_size[0] - x)},
+                                  tiles.size()});
+    }
+    else
+    {
+      assert(tile_size[0] > 0 && tile_size[1] > 0);
+      for(std::size_t y = 0; y < global_size[1]; y += tile_size[1])
+        for(std::size_t x = 0; x < global_size[0]; x += tile_size[0])
+          tiles.push_back(work_tile{cl::NDRange{x, y},
+                                    cl::NDRange{std::min(tile_size[0], global_size[0] - x),
+                                                std::min(tile_size[1], global_size[1] - y)},
+                                    tiles.size()});
+    }
+    return tiles;
+  }
+
+  /// Processes all tiles of an NDRange and waits until all devices have
+  /// finished. Each device is driven by its own host thread, hence the
+  /// launcher is called concurrently for different devices (but never
+  /// concurrently for the same device). If a launch fails, the remaining
+  /// tiles are dropped and the first error is rethrown after all devices
+  /// have finished their tiles in flight.
+  /// If the tile size does not divide the global size, the sizes of the
+  /// border tiles are not multiples of the work group size. Kernels launched
+  /// through a \c kernel_call (e.g. module entrypoints) are then enqueued with
+  /// the tile size rounded up to the work group size, such that they must
+  /// check their global id against the global size. Launchers that enqueue
+  /// kernels directly with an explicit work group size require a global size
+  /// that is divisible by the tile size on OpenCL 1.x, where non-uniform
+  /// work groups are not supported.
+  /// \param global_size The 1D or 2D NDRange to process
+  /// \param tile_size The size of the tiles, see \c make_tiles(). Should
+  /// be a multiple of the work group size.
+  /// \param launcher A callable with the signature
+  /// <tt>cl_int(std::size_t device_index, const device_context_ptr& ctx,
+  /// const work_tile& tile, cl::Event* evt)</tt>, that enqueues the work
+  /// of a tile and signals \c evt when done. The launcher must not wait
+  /// for the completion of the work.
+  template<class Launcher>
+  void run(const cl::NDRange& global_size, const cl::NDRange& tile_size,
+           Launcher launcher)
+  {
+    std::size_t num_devices = _global_ctx->get_num_devices();
+    assert(num_devices > 0);
+
+    _queues.assign(num_devices, std::deque<work_tile>{});
+    std::fill(_num_processed.begin(), _num_processed.end(), 0);
+    std::fill(_num_stolen.begin(), _num_stolen.end(), 0);
+    _error = std::exception_ptr{};
+
+    distribute(make_tiles(global_size, tile_size));
+
+    std::vector<std::thread> workers;
+    for(std::size_t i = 0; i < num_devices; ++i)
+      workers.push_back(std::thread{[this, i, &launcher]()
+      {
+        this->process_tiles(i, launcher);
+      }});
+
+    for(std::thread& worker : workers)
+      worker.join();
+
+    if(_error)
+      std::rethrow_exception(_error);
+  }
+
+  /// \return The number of tiles that a device has processed in the
+  /// last call to \c run(), including the stolen tiles
+  /// \param device_index The index of the device
+  std::size_t get_num_tiles_processed(std::size_t device_index) const
+  {
+    assert(device_index < _num_processed.size());
+    return _num_processed[device_index];
+  }
+
+  /// \return The number of tiles that a device has stolen from other
+  /// devices in the last call to \c run()
+  /// \param device_index The index of the device
+  std::size_t get_num_tiles_stolen(std::size_t device_index) const
+  {
+    assert(device_index < _num_stolen.size());
+    return _num_stolen[device_index];
+  }
+private:
+  /// Deals the tiles in contiguous chunks according to the weights
+  void distribute(const std::vector<work_tile>& tiles)
+  {
+    device_partitioner partitioner{_global_ctx};
+    partitioner.set_weights(_weights);
+
+    std::vector<work_range> ranges = partitioner.partition(tiles.size());
+    for(std::size_t i = 0; i < ranges.size(); ++i)
+      for(std::size_t j = 0; j < ranges[i].size; ++j)
+        _queues[i].push_back(tiles[ranges[i].offset + j]);
+  }
+
+  /// Takes the next tile of a device from the front of its own queue,
+  /// or steals a tile from the back of the longest queue.
+  /// \return whether a tile was obtained
+  bool obtain_tile(std::size_t device_index, work_tile& tile)
+  {
+    std::lock_guard<std::mutex> lock{_lock};
+
+    if(_error)
+      return false;
+
+    std::deque<work_tile>& own_queue = _queues[device_index];
+    if(!own_queue.empty())
+    {
+      tile = own_queue.front();
+      own_queue.pop_front();
+      return true;
+    }
+
+    std::size_t victim = device_index;
+    for(std::size_t i = 0; i < _queues.size(); ++i)
+      if(_queues[i].size() > _queues[victim].size())
+        victim = i;
+
+    if(_queues[victim].empty())
+      return false;
+
+    tile = _queues[victim].back();
+    _queues[victim].pop_back();
+    ++_num_stolen[device_index];
+    return true;
+  }
+
+  void set_error(std::exception_ptr error)
+  {
+    std::lock_guard<std::mutex> lock{_lock};
+    if(!_error)
+      _error = error;
+  }
+
+  template<class Launcher>
+  void process_tiles(std::size_t device_index, Launcher& launcher)
+  {
+    const device_context_ptr& ctx = _global_ctx->device(device_index);
+    std::deque<cl::Event> in_flight;
+
+    try
+    {
+      work_tile tile;
+      while(obtain_tile(device_index, tile))
+      {
+        if(in_flight.size() >= _max_in_flight)
+        {
+          check_cl_error(in_flight.front().wait(), "Could not wait for tile!");
+          in_flight.pop_front();
+        }
+
+        in_flight.push_back(cl::Event{});
+        check_cl_error(launcher(device_index, ctx, tile, &in_flight.back()),
+                       "Could not enqueue tile on device "+ctx->get_device_name());
+        ctx->get_command_queue().flush();
+        ++_num_processed[device_index];
+      }
+    }
+    catch(...)
+    {
+      set_error(std::current_exception());
+    }
+
+    // Wait for the remaining tiles - also in case of an error, since
+    // the launched kernels may still access the user's data.
+    for(const cl::Event& evt : in_flight)
+    {
+      if(evt() == nullptr)
+        continue;
+
+      cl_int err = evt.wait();
+      if(err != CL_SUCCESS)
+      {
+        try
+        {
+          check_cl_error(err, "Could not wait for tile!");
+        }
+        catch(...)
+        {
+          set_error(std::current_exception());
+        }
+      }
+    }
+  }
+
+  global_context_ptr _global_ctx;
+  std::vector<double> _weights;
+  std::size_t _max_in_flight;
+
+  std::vector<std::deque<work_tile>> _queues;
+  std::vector<std::size_t> _num_processed;
+  std::vector<std::size_t> _num_stolen;
+  std::exception_ptr _error;
+  std::mutex _lock;
+};
+
+/// An array that is distributed across all devices of a global context.
+/// Each device holds the slice of the array given by a partition, e.g.
+/// from \c device_partitioner::partition().
+template<class T>
+class distributed_array
+{
+public:
+  /// \param global_ctx The global context
+  /// \param partition The slice of each device. Must contain one
+  /// entry per device; the slices must not overlap.
+  distributed_array(const global_context_ptr& global_ctx,
+                    const std::vector<work_range>& partition)
+    : _global_ctx{global_ctx}, _partition{partition}, _num_elements{0}
+  {
+    assert(partition.size() == global_ctx->get_num_devices());
+
+    for(std::size_t i = 0; i < partition.size(); ++i)
+    {
+      if(partition[i].size > 0)
+        _slices.push_back(device_array<T>{global_ctx->device(i), partition[i].size});
+      else
+        _slices.push_back(device_array<T>{});
+
+      _num_elements = std::max(_num_elements, partition[i].offset + partition[i].size);
+    }
+  }
+
+  /// \return The total number of elements covered by the partition
+  std::size_t size() const
+  {
+    return _num_elements;
+  }
+
+  /// \return The partition of the array
+  const std::vector<work_range>& get_partition() const
+  {
+    return _partition;
+  }
+
+  /// \return The slice of a device
+  /// \param device The index of the device in the global context
+  device_array<T>& local(std::size_t device)
+  {
+    assert(device < _slices.size());
+    return _slices[device];
+  }
+
+  /// \return The slice of a device
+  /// \param device The index of the device in the global context
+  const device_array<T>& local(std::size_t device) const
+  {
+    assert(device < _slices.size());
+    return _slices[device];
+  }
+
+  /// Copies the matching parts of host data to the slices of all devices.
+  /// The transfers to the different devices run concurrently.
+  /// \param data The host data, must contain \c size() elements
+  void scatter(const T* data)
+  {
+    std::vector<cl::Event> events;
+    for(std::size_t i = 0; i < _slices.size(); ++i)
+    {
+      if(_partition[i].size == 0)
+        continue;
+
+      events.push_back(cl::Event{});
+      _slices[i].write_async(data + _partition[i].offset,
+                             _slices[i].begin(), _slices[i].end(),
+                             &events.back());
+      _slices[i].get_context()->get_command_queue().flush();
+    }
+
+    for(const cl::Event& evt : events)
+      check_cl_error(evt.wait(), "Could not wait for scatter!");
+  }
+
+  /// Copies the slices of all devices to the matching parts of host memory.
+  /// The transfers from the different devices run concurrently.
+  /// \param data The host data, must have room for \c size() elements
+  void gather(T* data) const
+  {
+    std::vector<cl::Event> events;
+    for(std::size_t i = 0; i < _slices.size(); ++i)
+    {
+      if(_partition[i].size == 0)
+        continue;
+
+      events.push_back(cl::Event{});
+      _slices[i].read_async(data + _partition[i].offset,
+                            _slices[i].begin(), _slices[i].end(),
+                            &events.back());
+      _slices[i].get_context()->get_command_queue().flush();
+    }
+
+    for(const cl::Event& evt : events)
+      check_cl_error(evt.wait(), "Could not wait for gather!");
+  }
+
+  /// Copies host data to the slices of all devices.
+  /// \param data The host data, must contain \c size() elements
+  void scatter(const std::vector<T>& data)
+  {
+    assert(data.size() >= _num_elements);
+    scatter(data.data());
+  }
+
+  /// Copies the slices of all devices to host memory.
+  /// \param data Will be resized to \c size() elements
+  void gather(std::vector<T>& data) const
+  {
+    data.resize(_num_elements);
+    gather(data.data());
+  }
+private:
+  global_context_ptr _global_ctx;
+  std::vector<work_range> _partition;
+  std::vector<device_array<T>> _slices;
+  std::size_t _num_elements;
+};
+
+}
+
+#endif
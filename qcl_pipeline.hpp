@@ -0,0 +1,292 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_PIPELINE_HPP
+#define QCL_PIPELINE_HPP
+
+#include <vector>
+#include <cassert>
+
+#include "qcl.hpp"
+#include "qcl_array.hpp"
+
+namespace qcl {
+
+/// Describes one chunk of a \c streaming_pipeline run. An object
+/// of this type is passed to the kernel launcher of the pipeline,
+/// which must enqueue the processing of the chunk.
+template<class T_in, class T_out>
+struct pipeline_chunk
+{
+  /// The device buffer containing the input data of the chunk, starting
+  /// at element 0. The buffer may be larger than the chunk.
+  const device_array<T_in>& input;
+  /// The device buffer to which the results of the chunk must be written,
+  /// starting at element 0. The buffer may be larger than the chunk.
+  device_array<T_out>& output;
+  /// The position of the first element of the chunk within the whole range
+  std::size_t offset;
+  /// The number of elements in the chunk
+  std::size_t size;
+
+  /// The event which must be signalled by the kernel launch
+  cl::Event* event;
+  /// The events the kernel launch must wait for
+  std::vector<cl::Event>* dependencies;
+  /// The command queue into which the kernel must be enqueued
+  command_queue_id queue;
+
+  /// Applies the event, dependencies and command queue of the chunk
+  /// to a kernel call.
+  /// \return The kernel call
+  kernel_call& bind(kernel_call& call) const
+  {
+    call.set_event(event);
+    call.set_dependencies(dependencies);
+    call.set_command_queue(queue);
+    return call;
+  }
+
+  /// Applies the event, dependencies and command queue of the chunk
+  /// to a kernel call. This overload allows to directly bind the
+  /// temporary kernel call returned by a module entrypoint, e.g.
+  /// \code
+  /// chunk.bind(my_module::my_kernel(ctx, chunk.size, 64))(chunk.input, chunk.output);
+  /// \endcode
+  /// \return The kernel call
+  kernel_call bind(kernel_call&& call) const
+  {
+    bind(static_cast<kernel_call&>(call));
+    return std::move(call);
+  }
+};
+
+/// Processes a host range that may be larger than the device memory by
+/// streaming it through the device in chunks. Several device buffers are
+/// rotated across three command queues (upload, compute, download), such
+/// that the upload of chunk i+1, the kernel on chunk i and the download of
+/// chunk i-1 overlap. All event dependencies between the stages, including
+/// those arising from the reuse of device buffers, are handled by the pipeline.
+/// Transfers are only truly asynchronous if the host memory is page-locked
+/// (see \c pinned_host_array).
+///
+/// Example:
+/// \code
+/// qcl::streaming_pipeline<float> pipeline{ctx, 1 << 20};
+/// pipeline.run(input.data(), output.data(), input.size(),
+///   [&](const qcl::pipeline_chunk<float, float>& chunk)
+///   {
+///     return chunk.bind(my_module::scale(ctx, chunk.size, 64))
+///       (chunk.input, chunk.output, static_cast<cl_uint>(chunk.size));
+///   });
+/// \endcode
+template<class T_in, class T_out = T_in>
+class streaming_pipeline
+{
+public:
+  using chunk_type = pipeline_chunk<T_in, T_out>;
+
+  /// \param ctx The device context
+  /// \param chunk_size The maximum number of elements per chunk
+  /// \param num_buffers The number of device buffer pairs that are rotated.
+  /// At least three are required for a full overlap of all stages.
+  explicit streaming_pipeline(const device_context_ptr& ctx,
+                              std::size_t chunk_size,
+                              std::size_t num_buffers = 3)
+    : _ctx{ctx}, _chunk_size{chunk_size}
+  {
+    assert(chunk_size > 0);
+    assert(num_buffers > 0);
+
+    _ctx->require_several_command_queues(3);
+
+    for(std::size_t i = 0; i < num_buffers; ++i)
+      _slots.push_back(slot{device_array<T_in>{ctx, chunk_size},
+                            device_array<T_out>{ctx, chunk_size}});
+  }
+
+  /// \return The maximum number of elements per chunk
+  std::size_t get_chunk_size() const
+  {
+    return _chunk_size;
+  }
+
+  /// \return The number of rotated device buffer pairs
+  std::size_t get_num_buffers() const
+  {
+    return _slots.size();
+  }
+
+  /// Streams a host range through the device and waits until
+  /// all results have arrived in host memory.
+  /// \param input The input data
+  /// \param output The output data. Must hold \c num_elements elements.
+  /// \param num_elements The number of elements to process
+  /// \param launcher A callable with the signature
+  /// <tt>cl_int(const pipeline_chunk<T_in, T_out>&)</tt>, which enqueues the
+  /// kernel for a chunk using the event, dependencies and queue of the chunk.
+  template<class Launcher>
+  void run(const T_in* input, T_out* output,
+           std::size_t num_elements, Launcher launcher)
+  {
+    const command_queue_id upload_queue = 0;
+    const command_queue_id compute_queue = 1;
+    const command_queue_id download_queue = 2;
+
+    std::vector<cl::Event> dependencies;
+
+    std::size_t num_chunks = (num_elements + _chunk_size - 1) / _chunk_size;
+    for(std::size_t c = 0; c < num_chunks; ++c)
+    {
+      slot& current = _slots[c % _slots.size()];
+
+      std::size_t offset = c * _chunk_size;
+      std::size_t size = std::min(_chunk_size, num_elements - offset);
+
+      // The input buffer may only be overwritten once the kernel
+      // of the previous chunk in this slot has completed
+      dependencies.clear();
+      if(current.busy)
+        dependencies.push_back(current.compute_event);
+
+      current.input.write_async(input + offset,
+                                current.input.begin(),
+                                current.input.begin() + size,
+                                &current.upload_event,
+                                &dependencies,
+                                upload_queue);
+
+      // The output buffer may only be overwritten once the results
+      // of the previous chunk in this slot have been downloaded
+      dependencies.clear();
+      dependencies.push_back(current.upload_event);
+      if(current.busy)
+        dependencies.push_back(current.download_event);
+
+      chunk_type chunk{current.input, current.output,
+                       offset, size,
+                       &current.compute_event,
+                       &dependencies,
+                       compute_queue};
+      check_cl_error(launcher(chunk), "Could not enqueue kernel of pipeline chunk!");
+
+      dependencies.clear();
+      dependencies.push_back(current.compute_event);
+
+      current.output.read_async(output + offset,
+                                current.output.begin(),
+                                current.output.begin() + size,
+                                &current.download_event,
+                                &dependencies,
+                                download_queue);
+      current.busy = true;
+
+      // Make sure that all stages are submitted to the device
+      // immediately, such that they can overlap
+      _ctx->get_command_queue(upload_queue).flush();
+      _ctx->get_command_queue(compute_queue).flush();
+      _ctx->get_command_queue(download_queue).flush();
+    }
+
+    this->wait();
+  }
+
+  /// Streams a host range through the device and waits until
+  /// all results have arrived in host memory.
+  /// \param input The input data
+  /// \param output The output data. Will be resized to the size
+  /// of the input data.
+  /// \param launcher The kernel launcher, see \c run()
+  template<class Launcher>
+  void run(const std::vector<T_in>& input,
+           std::vector<T_out>& output,
+           Launcher launcher)
+  {
+    output.resize(input.size());
+    run(input.data(), output.data(), input.size(), launcher);
+  }
+
+  /// Streams a range in page-locked host memory through the device and waits
+  /// until all results have arrived in host memory. With page-locked memory,
+  /// the transfers overlap with the computation.
+  /// \param input The input data
+  /// \param output The output data. Must hold at least as many elements
+  /// as the input.
+  /// \param launcher The kernel launcher, see \c run()
+  template<class Launcher>
+  void run(const pinned_host_array<T_in>& input,
+           pinned_host_array<T_out>& output,
+           Launcher launcher)
+  {
+    assert(output.size() >= input.size());
+    run(input.data(), output.data(), input.size(), launcher);
+  }
+private:
+  /// Waits until the downloads of all slots have completed
+  void wait()
+  {
+    for(slot& s : _slots)
+    {
+      if(s.busy)
+      {
+        check_cl_error(s.download_event.wait(),
+                       "Could not wait for pipeline chunk!");
+        s.busy = false;
+      }
+    }
+  }
+
+  /// A pair of device buffers together with the events of the
+  /// last chunk that has been processed with them
+  struct slot
+  {
+    slot(const device_array<T_in>& in, const device_array<T_out>& out)
+      : input{in}, output{out}, busy{false}
+    {}
+
+    device_array<T_in> input;
+    device_array<T_out> output;
+
+    cl::Event upload_event;
+    cl::Event compute_event;
+    cl::Event download_event;
+
+    /// Whether the events belong to a chunk of the current run
+    bool busy;
+  };
+
+  device_context_ptr _ctx;
+  std::size_t _chunk_size;
+
+  std::vector<slot> _slots;
+};
+
+}
+
+#endif
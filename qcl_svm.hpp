@@ -0,0 +1,447 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_SVM_HPP
+#define QCL_SVM_HPP
+
+#include <memory>
+#include <vector>
+#include <cassert>
+#include <stdexcept>
+
+#include "qcl.hpp"
+
+#if CL_HPP_TARGET_OPENCL_VERSION < 200
+#error "qcl_svm.hpp requires OpenCL 2.0: Define CL_HPP_TARGET_OPENCL_VERSION as 200 or higher before including QCL."
+#endif
+
+/// \file Arrays in shared virtual memory (SVM). Unlike buffers, SVM
+/// allocations have the same address on the host and the device, such that
+/// pointer-based data structures can be built on the host and used by
+/// kernels without serialization. Arrays that a kernel only reaches through
+/// pointers stored in other SVM memory must be registered with
+/// \c kernel_call::use_svm(). Requires an OpenCL 2.0 device.
+
+namespace qcl {
+
+/// The SVM granularities
+enum class svm_granularity
+{
+  /// Host accesses must be enclosed in \c svm_array::map() and unmapping
+  coarse_grained,
+  /// The host can access the memory at any time when no kernel works on it,
+  /// maps only synchronize.
+  fine_grained,
+  /// Fine-grained if the device supports fine-grained buffers,
+  /// coarse-grained otherwise
+  finest_available
+};
+
+/// \return The SVM capabilities of the device of a device context
+inline cl_device_svm_capabilities get_svm_capabilities(const device_context_ptr& ctx)
+{
+  cl_device_svm_capabilities capabilities = 0;
+  check_cl_error(ctx->get_device().getInfo(CL_DEVICE_SVM_CAPABILITIES, &capabilities),
+                 "Could not obtain device information!");
+  return capabilities;
+}
+
+namespace detail {
+
+/// Owns an SVM allocation. The memory is freed once all tracked commands
+/// accessing it have completed.
+class svm_allocation
+{
+public:
+  svm_allocation(const device_context_ptr& ctx,
+                 cl_svm_mem_flags flags,
+                 std::size_t num_bytes,
+                 const std::shared_ptr<access_tracker>& tracker)
+    : _ctx{ctx}, _tracker{tracker}
+  {
+    _data = clSVMAlloc(_ctx->get_context()(), flags, num_bytes, 0);
+    if(!_data)
+      throw std::runtime_error("Could not allocate shared virtual memory!");
+  }
+
+  svm_allocation(const svm_allocation&) = delete;
+  svm_allocation& operator=(const svm_allocation&) = delete;
+
+  /// Errors while waiting for the pending commands are ignored, since
+  /// destructors must not throw.
+  ~svm_allocation()
+  {
+    try
+    {
+      _tracker->wait();
+    }
+    catch(...)
+    {}
+    clSVMFree(_ctx->get_context()(), _data);
+  }
+
+  void* get_data() const noexcept
+  {
+    return _data;
+  }
+private:
+  device_context_ptr _ctx;
+  std::shared_ptr<access_tracker> _tracker;
+  void* _data;
+};
+
+inline const cl_event* get_event_handles(const std::vector<cl::Event>& events)
+{
+  static_assert(sizeof(cl::Event) == sizeof(cl_event),
+                "cl::Event must be a plain wrapper of cl_event");
+  return events.empty() ? nullptr : reinterpret_cast<const cl_event*>(events.data());
+}
+
+}
+
+template<class T>
+class mapped_svm_array;
+
+/// An array in shared virtual memory. Copies of the array refer to the same
+/// memory, which is freed when the last copy has been destroyed and all
+/// tracked commands accessing it have completed. The array can be passed
+/// directly to kernels (as a global pointer), and kernel calls, maps and
+/// unmaps are tracked like accesses of \c device_array objects.
+/// Note that element constructors and destructors are not invoked, hence
+/// \c T should be a trivial type.
+template<class T>
+class svm_array
+{
+public:
+  /// Creates an empty array. It has its own tracker, such that
+  /// it can be handled like any other array.
+  svm_array()
+    : _data{nullptr}, _num_elements{0}, _fine_grained{false},
+      _tracker{std::make_shared<detail::access_tracker>()}
+  {}
+
+  /// Allocates the array
+  /// \param ctx The device context
+  /// \param num_elements The number of elements
+  /// \param granularity The requested granularity. Throws
+  /// \c std::runtime_error if fine-grained memory is requested but the device
+  /// does not support it.
+  /// \param flags Additional memory flags, e.g. \c CL_MEM_READ_ONLY or
+  /// \c CL_MEM_SVM_ATOMICS
+  svm_array(const device_context_ptr& ctx,
+            std::size_t num_elements,
+            svm_granularity granularity = svm_granularity::coarse_grained,
+            cl_svm_mem_flags flags = CL_MEM_READ_WRITE)
+    : _ctx{ctx},
+      _num_elements{num_elements},
+      _tracker{std::make_shared<detail::access_tracker>()}
+  {
+    assert(num_elements > 0);
+
+    cl_device_svm_capabilities capabilities = get_svm_capabilities(ctx);
+    if((capabilities & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) == 0)
+      throw std::runtime_error("The device does not support shared virtual memory!");
+
+    bool supports_fine_grain = (capabilities & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+    if(granularity == svm_granularity::fine_grained && !supports_fine_grain)
+      throw std::runtime_error("The device does not support fine-grained "
+                               "shared virtual memory!");
+
+    _fine_grained = (granularity == svm_granularity::fine_grained) ||
+        (granularity == svm_granularity::finest_available && supports_fine_grain);
+    if(_fine_grained)
+      flags |= CL_MEM_SVM_FINE_GRAIN_BUFFER;
+
+    _allocation = std::make_shared<detail::svm_allocation>(ctx, flags,
+                                                           num_elements * sizeof(T),
+                                                           _tracker);
+    _data = static_cast<T*>(_allocation->get_data());
+  }
+
+  /// \return A pointer to the first element, which is valid on the host
+  /// and in kernels. For coarse-grained arrays, the host may only access
+  /// the memory while it is mapped.
+  T* data() const noexcept
+  {
+    return _data;
+  }
+
+  std::size_t size() const noexcept
+  {
+    return _num_elements;
+  }
+
+  bool is_fine_grained() const noexcept
+  {
+    return _fine_grained;
+  }
+
+  const device_context_ptr& get_context() const
+  {
+    return _ctx;
+  }
+
+  /// Maps the array for host access until the returned object is destroyed.
+  /// Blocks until the conflicting tracked commands have completed. For
+  /// fine-grained arrays, no map command is required and only the
+  /// synchronization takes place.
+  /// \param flags \c CL_MAP_READ, \c CL_MAP_WRITE or
+  /// \c CL_MAP_WRITE_INVALIDATE_REGION, or a combination of them
+  /// \param queue The command queue used for the mapping
+  mapped_svm_array<T> map(cl_map_flags flags, command_queue_id queue = 0) const
+  {
+    return mapped_svm_array<T>{*this, flags, queue};
+  }
+
+  /// Copies data from the host into the array asynchronously. The copy
+  /// waits for all previous tracked commands accessing the array.
+  /// \param data The source, must remain valid until the copy has completed
+  /// \param num_elements The number of elements, at most \c size()
+  void write_async(const T* data,
+                   std::size_t num_elements,
+                   cl::Event* evt = nullptr,
+                   command_queue_id queue = 0)
+  {
+    assert(num_elements <= _num_elements);
+    std::vector<cl::Event> dependencies;
+    _tracker->get_write_dependencies(dependencies);
+
+    cl_event handle;
+    check_cl_error(clEnqueueSVMMemcpy(_ctx->get_command_queue(queue)(), CL_FALSE,
+                                      _data, data, num_elements * sizeof(T),
+                                      static_cast<cl_uint>(dependencies.size()),
+                                      detail::get_event_handles(dependencies),
+                                      &handle),
+                   "Could not enqueue SVM copy!");
+    cl::Event copy_evt{handle};
+    _tracker->record_write(copy_evt);
+    if(evt)
+      *evt = copy_evt;
+  }
+
+  /// Copies data from the array to the host asynchronously. The copy
+  /// waits for the last tracked command writing the array.
+  /// \param out The destination, must remain valid until the copy has completed
+  /// \param num_elements The number of elements, at most \c size()
+  void read_async(T* out,
+                  std::size_t num_elements,
+                  cl::Event* evt = nullptr,
+                  command_queue_id queue = 0) const
+  {
+    assert(num_elements <= _num_elements);
+    std::vector<cl::Event> dependencies;
+    _tracker->get_read_dependencies(dependencies);
+
+    cl_event handle;
+    check_cl_error(clEnqueueSVMMemcpy(_ctx->get_command_queue(queue)(), CL_FALSE,
+                                      out, _data, num_elements * sizeof(T),
+                                      static_cast<cl_uint>(dependencies.size()),
+                                      detail::get_event_handles(dependencies),
+                                      &handle),
+                   "Could not enqueue SVM copy!");
+    cl::Event copy_evt{handle};
+    _tracker->record_read(copy_evt);
+    if(evt)
+      *evt = copy_evt;
+  }
+
+  /// \return The tracker of the commands accessing this array
+  const std::shared_ptr<detail::access_tracker>& get_access_tracker() const
+  {
+    return _tracker;
+  }
+
+  /// Blocks until all tracked commands accessing the array have completed
+  void wait() const
+  {
+    _tracker->wait();
+  }
+private:
+  device_context_ptr _ctx;
+  std::shared_ptr<detail::svm_allocation> _allocation;
+  T* _data;
+  std::size_t _num_elements;
+  bool _fine_grained;
+  std::shared_ptr<detail::access_tracker> _tracker;
+};
+
+/// Host access to an \c svm_array for the lifetime of the object,
+/// as created by \c svm_array::map().
+template<class T>
+class mapped_svm_array
+{
+public:
+  using iterator = T*;
+
+  mapped_svm_array(const svm_array<T>& array,
+                   cl_map_flags flags,
+                   command_queue_id queue)
+    : _array{array}, _flags{flags}, _queue{queue}, _mapped{true}
+  {
+    std::vector<cl::Event> dependencies;
+    if(is_writing())
+      _array.get_access_tracker()->get_write_dependencies(dependencies);
+    else
+      _array.get_access_tracker()->get_read_dependencies(dependencies);
+
+    if(_array.is_fine_grained())
+      check_cl_error(cl::Event::waitForEvents(dependencies),
+                     "Could not wait for commands accessing the SVM array!");
+    else
+      check_cl_error(clEnqueueSVMMap(command_queue(), CL_TRUE, _flags,
+                                     _array.data(), _array.size() * sizeof(T),
+                                     static_cast<cl_uint>(dependencies.size()),
+                                     detail::get_event_handles(dependencies),
+                                     nullptr),
+                     "Could not map SVM array!");
+  }
+
+  mapped_svm_array(const mapped_svm_array&) = delete;
+  mapped_svm_array& operator=(const mapped_svm_array&) = delete;
+
+  mapped_svm_array(mapped_svm_array&& other)
+    : _array{std::move(other._array)},
+      _flags{other._flags},
+      _queue{other._queue},
+      _mapped{other._mapped}
+  {
+    other._mapped = false;
+  }
+
+  /// Ends the mapping. Errors are ignored; call \c unmap() before
+  /// destruction to handle them.
+  ~mapped_svm_array()
+  {
+    try
+    {
+      unmap();
+    }
+    catch(...)
+    {}
+  }
+
+  /// Ends the mapping. Afterwards, the host must no longer access
+  /// the memory of coarse-grained arrays. Does nothing if the mapping
+  /// has already ended.
+  void unmap()
+  {
+    if(!_mapped)
+      return;
+    _mapped = false;
+
+    if(_array.is_fine_grained())
+      return;
+
+    cl_event handle;
+    check_cl_error(clEnqueueSVMUnmap(command_queue(), _array.data(), 0, nullptr, &handle),
+                   "Could not unmap SVM array!");
+    cl::Event evt{handle};
+    if(is_writing())
+      _array.get_access_tracker()->record_write(evt);
+    else
+      _array.get_access_tracker()->record_read(evt);
+  }
+
+  T* data() const noexcept
+  {
+    return _array.data();
+  }
+
+  std::size_t size() const noexcept
+  {
+    return _array.size();
+  }
+
+  T& operator[](std::size_t i) const noexcept
+  {
+    assert(i < size());
+    return data()[i];
+  }
+
+  iterator begin() const noexcept
+  {
+    return data();
+  }
+
+  iterator end() const noexcept
+  {
+    return data() + size();
+  }
+private:
+  cl_command_queue command_queue() const
+  {
+    return _array.get_context()->get_command_queue(_queue)();
+  }
+
+  bool is_writing() const noexcept
+  {
+    return (_flags & (CL_MAP_WRITE | CL_MAP_WRITE_INVALIDATE_REGION)) != 0;
+  }
+
+  svm_array<T> _array;
+  cl_map_flags _flags;
+  command_queue_id _queue;
+  bool _mapped;
+};
+
+namespace detail {
+
+/// This overload allows passing \c svm_array objects directly to
+/// qcl kernel calls. The kernel receives a global pointer.
+template<class T>
+cl_int set_kernel_arg(std::size_t pos,
+                      const kernel_ptr& kernel,
+                      const svm_array<T>& array)
+{
+  return clSetKernelArgSVMPointer((*kernel)(), static_cast<cl_uint>(pos), array.data());
+}
+
+/// SVM arrays are identified by their address
+template<class T>
+bool get_kernel_arg_identity(const svm_array<T>& array,
+                             kernel_arg_identity& identity)
+{
+  assign_kernel_arg_identity(array.data(), identity);
+  return true;
+}
+
+/// Kernels are assumed to read and write SVM arrays
+template<class T>
+void collect_tracked_access(const svm_array<T>& array,
+                            std::vector<tracked_access>& accesses)
+{
+  if(array.get_access_tracker())
+    accesses.push_back(tracked_access{array.get_access_tracker(), true});
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,558 @@
+/*
+ * This file is part of QCL, a small OpenCL interface which makes it quick and
+ * easy to use OpenCL.
+ *
+ * Copyright (c) 2016,2017, Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef QCL_TRANSFER_BATCH_HPP
+#define QCL_TRANSFER_BATCH_HPP
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#include "qcl.hpp"
+#include "qcl_module.hpp"
+#include "qcl_array.hpp"
+
+namespace qcl {
+
+namespace detail {
+
+/// Copy kernels of \c transfer_batch. Each launch copies up to eight
+/// segments between the staging buffer and the buffers \c b0 to \c b7,
+/// the offsets and sizes in bytes of the segments are passed as
+/// vector arguments. Unused slots have a size of 0.
+QCL_STANDALONE_MODULE(transfer_batch_module)
+QCL_ENTRYPOINT(qcl_batch_scatter)
+QCL_ENTRYPOINT(qcl_batch_gather)
+QCL_STANDALONE_SOURCE
+(
+  R"(
+  #define QCL_BATCH_BUFFERS __global uchar* b0, __global uchar* b1, \
+                            __global uchar* b2, __global uchar* b3, \
+                            __global uchar* b4, __global uchar* b5, \
+                            __global uchar* b6, __global uchar* b7
+
+  #define QCL_BATCH_SELECT(slot) ((slot) == 0 ? b0 : (slot) == 1 ? b1 : \
+                                  (slot) == 2 ? b2 : (slot) == 3 ? b3 : \
+                                  (slot) == 4 ? b4 : (slot) == 5 ? b5 : \
+                                  (slot) == 6 ? b6 : b7)
+
+  ulong qcl_batch_component(ulong8 v, uint slot)
+  {
+    switch(slot)
+    {
+    case 0: return v.s0;
+    case 1: return v.s1;
+    case 2: return v.s2;
+    case 3: return v.s3;
+    case 4: return v.s4;
+    case 5: return v.s5;
+    case 6: return v.s6;
+    default: return v.s7;
+    }
+  }
+
+  // Copies word-wise if all positions are multiples of the word size
+  void qcl_batch_copy(__global uchar* dst, ulong dst_offset,
+                      __global const uchar* src, ulong src_offset,
+                      ulong num_bytes)
+  {
+    ulong first = get_global_id(0);
+    ulong stride = get_global_size(0);
+
+    if(((dst_offset | src_offset | num_bytes) & 3) == 0)
+    {
+      __global uint* dst_words = (__global uint*)(dst + dst_offset);
+      __global const uint* src_words = (__global const uint*)(src + src_offset);
+      for(ulong i = first; i < num_bytes / 4; i += stride)
+        dst_words[i] = src_words[i];
+    }
+    else
+    {
+      for(ulong i = first; i < num_bytes; i += stride)
+        dst[dst_offset + i] = src[src_offset + i];
+    }
+  }
+
+  __kernel void qcl_batch_scatter(__global const uchar* staging,
+                                  ulong8 staging_offsets,
+                                  ulong8 buffer_offsets,
+                                  ulong8 sizes,
+                                  QCL_BATCH_BUFFERS)
+  {
+    uint slot = get_global_id(1);
+    qcl_batch_copy(QCL_BATCH_SELECT(slot),
+                   qcl_batch_component(buffer_offsets, slot),
+                   staging,
+                   qcl_batch_component(staging_offsets, slot),
+                   qcl_batch_component(sizes, slot));
+  }
+
+  __kernel void qcl_batch_gather(__global uchar* staging,
+                                 ulong8 staging_offsets,
+                                 ulong8 buffer_offsets,
+                                 ulong8 sizes,
+                                 QCL_BATCH_BUFFERS)
+  {
+    uint slot = get_global_id(1);
+    qcl_batch_copy(staging,
+                   qcl_batch_component(staging_offsets, slot),
+                   QCL_BATCH_SELECT(slot),
+                   qcl_batch_component(buffer_offsets, slot),
+                   qcl_batch_component(sizes, slot));
+  }
+  )"
+)
+
+}
+
+/// Coalesces many small transfers between host memory and \c device_array
+/// objects. Instead of one transfer per array, the data of all writes is
+/// gathered in a page-locked staging buffer and uploaded with a single
+/// transfer into a device-side staging buffer, from which it is distributed
+/// to the arrays by copy kernels. Each kernel launch handles up to eight
+/// arrays, such that n transfers only cost one upload and n/8 launches
+/// instead of n enqueued commands. Reads work the other way round.
+/// The transfers hence run at full bandwidth instead of being dominated by
+/// the latency of small transfers.
+///
+/// Example:
+/// \code
+/// qcl::transfer_batch batch{ctx};
+/// for(std::size_t i = 0; i < params.size(); ++i)
+///   batch.add_write(device_params[i], host_params[i]);
+/// batch.add_read(device_result, host_result.data(), host_result.size());
+///
+/// cl::Event evt;
+/// batch.submit(&evt);
+/// // ... enqueue more work that waits for evt ...
+/// batch.wait(); // host_result now contains the data
+/// \endcode
+///
+/// The data of writes is copied into the staging buffer by \c add_write(),
+/// i.e. the source memory can be reused immediately. Like the transfer
+/// functions of \c device_array, the copies wait for conflicting commands
+/// tracked by the arrays and are tracked as accesses of the arrays.
+/// The staging buffers are reused by subsequent batches; adding transfers
+/// after \c submit() first waits for the submitted batch.
+class transfer_batch
+{
+public:
+  /// \param ctx The device context of the arrays
+  /// \param queue The command queue into which the transfers are enqueued
+  explicit transfer_batch(const device_context_ptr& ctx,
+                          command_queue_id queue = 0)
+    : _ctx{ctx}, _queue{queue}, _host_capacity{0}, _device_capacity{0},
+      _write_bytes{0}, _read_bytes{0}, _is_submitted{false}
+  {}
+
+  transfer_batch(const transfer_batch&) = delete;
+  transfer_batch& operator=(const transfer_batch&) = delete;
+
+  /// Waits for the submitted transfers and delivers the data of reads.
+  /// Errors are ignored; call \c wait() before destruction to handle them.
+  ~transfer_batch()
+  {
+    try
+    {
+      finish_submission();
+    }
+    catch(...)
+    {}
+  }
+
+  /// Adds a write of host data into an array.
+  /// \param dst The destination array
+  /// \param data The source data, which is copied immediately
+  /// \param num_elements The number of elements
+  /// \param dst_offset The position in \c dst of the first written element
+  template<class T>
+  void add_write(device_array<T>& dst,
+                 const T* data,
+                 std::size_t num_elements,
+                 std::size_t dst_offset = 0)
+  {
+    assert(dst.get_context() == _ctx);
+    assert(dst_offset + num_elements <= dst.size());
+
+    if(num_elements == 0)
+      return;
+
+    finish_submission();
+
+    segment s;
+    s.buffer = dst.get_buffer();
+    s.root = dst.get_root_buffer()();
+    s.tracker = dst.get_access_tracker();
+    s.buffer_offset = dst_offset * sizeof(T);
+    s.staging_offset = align(_write_bytes);
+    s.num_bytes = num_elements * sizeof(T);
+    s.host_data = nullptr;
+
+    reserve_host_staging(s.staging_offset + s.num_bytes, _write_bytes);
+    std::memcpy(get_host_staging() + s.staging_offset, data, s.num_bytes);
+
+    _write_bytes = s.staging_offset + s.num_bytes;
+    _writes.push_back(s);
+  }
+
+  /// Adds a write of host data to the beginning of an array.
+  /// \param dst The destination array
+  /// \param data The source data, which is copied immediately
+  template<class T>
+  void add_write(device_array<T>& dst, const std::vector<T>& data)
+  {
+    add_write(dst, data.data(), data.size());
+  }
+
+  /// Adds a read of array elements into host memory.
+  /// \param src The source array
+  /// \param out The destination, must remain valid until \c wait() has
+  /// returned. The data is only available after \c wait().
+  /// \param num_elements The number of elements
+  /// \param src_offset The position in \c src of the first read element
+  template<class T>
+  void add_read(const device_array<T>& src,
+                T* out,
+                std::size_t num_elements,
+                std::size_t src_offset = 0)
+  {
+    assert(src.get_context() == _ctx);
+    assert(src_offset + num_elements <= src.size());
+
+    if(num_elements == 0)
+      return;
+
+    finish_submission();
+
+    segment s;
+    s.buffer = src.get_buffer();
+    s.root = src.get_root_buffer()();
+    s.tracker = src.get_access_tracker();
+    s.buffer_offset = src_offset * sizeof(T);
+    // Relative to the beginning of the read section, which
+    // follows the data of the writes
+    s.staging_offset = align(_read_bytes);
+    s.num_bytes = num_elements * sizeof(T);
+    s.host_data = out;
+
+    _read_bytes = s.staging_offset + s.num_bytes;
+    _reads.push_back(s);
+  }
+
+  /// Enqueues all added transfers. The batch is empty afterwards and can be
+  /// reused for new transfers.
+  /// \param evt If not \c nullptr, will contain an event that completes
+  /// once all device-side work of the transfers has completed. The data of
+  /// reads is only copied to its final destination by \c wait().
+  /// \param dependencies Additional events the transfers wait for
+  void submit(cl::Event* evt = nullptr,
+              const std::vector<cl::Event>* dependencies = nullptr)
+  {
+    finish_submission();
+
+    std::size_t read_section = align(_write_bytes);
+    std::size_t total_bytes = read_section + _read_bytes;
+
+    std::vector<cl::Event> final_events;
+    if(total_bytes > 0)
+    {
+      reserve_host_staging(total_bytes, _write_bytes);
+      reserve_device_staging(total_bytes);
+    }
+
+    if(!_writes.empty())
+    {
+      cl::Event upload;
+      _ctx->memcpy_h2d_async<unsigned char>(_device_staging,
+                                            get_host_staging(),
+                                            0, _write_bytes,
+                                            &upload, dependencies, _queue);
+
+      enqueue_copy_kernels(_writes, true, 0,
+                           std::vector<cl::Event>{upload}, final_events);
+    }
+
+    if(!_reads.empty())
+    {
+      std::vector<cl::Event> copies;
+      enqueue_copy_kernels(_reads, false, read_section,
+                           dependencies ? *dependencies : std::vector<cl::Event>{},
+                           copies);
+
+      cl::Event download;
+      _ctx->memcpy_d2h_async<unsigned char>(get_host_staging() + read_section,
+                                            _device_staging,
+                                            read_section, read_section + _read_bytes,
+                                            &download, &copies, _queue);
+      final_events.push_back(download);
+    }
+
+    if(final_events.size() == 1)
+      _completion = final_events[0];
+    else
+      check_cl_error(_ctx->get_command_queue(_queue).enqueueMarkerWithWaitList(
+                       final_events.empty() ? dependencies : &final_events,
+                       &_completion),
+                     "Could not enqueue marker!");
+    if(evt)
+      *evt = _completion;
+
+    _submitted_reads = std::move(_reads);
+    _submitted_read_section = read_section;
+    _reads.clear();
+    _writes.clear();
+    _write_bytes = 0;
+    _read_bytes = 0;
+    _is_submitted = true;
+  }
+
+  /// Waits until the submitted transfers have completed and copies the
+  /// data of reads to their destinations
+  void wait()
+  {
+    finish_submission();
+  }
+
+  /// \return The number of transfers that have been added since
+  /// the last submission
+  std::size_t get_num_transfers() const
+  {
+    return _writes.size() + _reads.size();
+  }
+private:
+  struct segment
+  {
+    cl::Buffer buffer;
+    /// The buffer of the original array if the array is a view
+    cl_mem root;
+    std::shared_ptr<detail::access_tracker> tracker;
+    /// The offset in bytes in the array's buffer
+    std::size_t buffer_offset;
+    /// The offset in bytes in the write or read section of the staging buffers
+    std::size_t staging_offset;
+    std::size_t num_bytes;
+    /// The destination of reads
+    void* host_data;
+  };
+
+  /// Segments are aligned, such that the device-side copies
+  /// operate on aligned addresses.
+  static std::size_t align(std::size_t offset)
+  {
+    const std::size_t alignment = 128;
+    return ((offset + alignment - 1) / alignment) * alignment;
+  }
+
+  /// The number of segments handled by one launch of a copy kernel
+  static const std::size_t max_group_size = 8;
+
+  /// \return Whether a segment must not be copied by the same kernel launch
+  /// as the segments in <tt>[begin, end)</tt>: OpenCL does not permit the
+  /// concurrent use of a buffer and its sub-buffers, and writes to
+  /// overlapping memory must keep their order.
+  static bool conflicts_with_group(const std::vector<segment>& segments,
+                                   std::size_t begin, std::size_t end,
+                                   const segment& s, bool is_write)
+  {
+    for(std::size_t i = begin; i < end; ++i)
+    {
+      const segment& other = segments[i];
+      if(other.root != s.root)
+        continue;
+      if(other.buffer() != s.buffer())
+        return true;
+      if(is_write &&
+         other.buffer_offset < s.buffer_offset + s.num_bytes &&
+         s.buffer_offset < other.buffer_offset + other.num_bytes)
+        return true;
+    }
+    return false;
+  }
+
+  /// Copies the segments between the staging buffer and the arrays by
+  /// launching a copy kernel for each group of up to \c max_group_size
+  /// consecutive segments.
+  /// \param is_write Whether the segments are copied from the staging buffer
+  /// into the arrays (writes) or the other way round (reads)
+  /// \param staging_section The offset of the segments' section in the
+  /// staging buffer
+  /// \param dependencies The events the copies wait for in addition to
+  /// the conflicting accesses tracked by the arrays
+  /// \param events Receives the events of the kernel launches
+  void enqueue_copy_kernels(const std::vector<segment>& segments,
+                            bool is_write,
+                            std::size_t staging_section,
+                            const std::vector<cl::Event>& dependencies,
+                            std::vector<cl::Event>& events)
+  {
+    std::size_t begin = 0;
+    while(begin < segments.size())
+    {
+      std::size_t end = begin + 1;
+      while(end < segments.size() && end - begin < max_group_size &&
+            !conflicts_with_group(segments, begin, end, segments[end], is_write))
+        ++end;
+
+      cl_ulong8 staging_offsets;
+      cl_ulong8 buffer_offsets;
+      cl_ulong8 sizes;
+      cl::Buffer buffers[max_group_size];
+      std::vector<cl::Event> copy_dependencies = dependencies;
+      std::size_t max_words = 0;
+
+      for(std::size_t slot = 0; slot < max_group_size; ++slot)
+      {
+        staging_offsets.s[slot] = 0;
+        buffer_offsets.s[slot] = 0;
+        sizes.s[slot] = 0;
+        buffers[slot] = _device_staging;
+
+        if(begin + slot < end)
+        {
+          const segment& s = segments[begin + slot];
+          staging_offsets.s[slot] = staging_section + s.staging_offset;
+          buffer_offsets.s[slot] = s.buffer_offset;
+          sizes.s[slot] = s.num_bytes;
+          buffers[slot] = s.buffer;
+          max_words = std::max(max_words, (s.num_bytes + 3) / 4);
+
+          if(is_write)
+            s.tracker->get_write_dependencies(copy_dependencies);
+          else
+            s.tracker->get_read_dependencies(copy_dependencies);
+        }
+      }
+
+      // Large segments are processed with a grid-stride loop
+      const std::size_t max_items_per_segment = 16384;
+      std::size_t items_per_segment =
+          std::min(((max_words + 63) / 64) * 64, max_items_per_segment);
+
+      cl::Event copy;
+      cl::NDRange work_dim{items_per_segment, end - begin};
+      std::vector<cl::Event>* copy_wait_list =
+          copy_dependencies.empty() ? nullptr : &copy_dependencies;
+      kernel_call call = is_write
+          ? detail::transfer_batch_module::qcl_batch_scatter(_ctx, work_dim, cl::NullRange,
+                                                             &copy, copy_wait_list)
+          : detail::transfer_batch_module::qcl_batch_gather(_ctx, work_dim, cl::NullRange,
+                                                            &copy, copy_wait_list);
+      call.set_command_queue(_queue);
+      check_cl_error(call(_device_staging, staging_offsets, buffer_offsets, sizes,
+                          buffers[0], buffers[1], buffers[2], buffers[3],
+                          buffers[4], buffers[5], buffers[6], buffers[7]),
+                     "Could not enqueue transfer batch copy kernel!");
+
+      for(std::size_t i = begin; i < end; ++i)
+      {
+        if(is_write)
+          segments[i].tracker->record_write(copy);
+        else
+          segments[i].tracker->record_read(copy);
+      }
+      events.push_back(copy);
+
+      begin = end;
+    }
+  }
+
+  /// If a batch has been submitted, waits for it to complete and
+  /// delivers the data of its reads.
+  void finish_submission()
+  {
+    if(!_is_submitted)
+      return;
+    _is_submitted = false;
+
+    check_cl_error(_completion.wait(), "Could not wait for transfer batch!");
+
+    for(const segment& s : _submitted_reads)
+      std::memcpy(s.host_data,
+                  get_host_staging() + _submitted_read_section + s.staging_offset,
+                  s.num_bytes);
+    _submitted_reads.clear();
+  }
+
+  unsigned char* get_host_staging() const
+  {
+    return static_cast<unsigned char*>(_host_staging->get_data());
+  }
+
+  /// Grows the page-locked staging memory geometrically, preserving its
+  /// first \c num_bytes_in_use bytes
+  void reserve_host_staging(std::size_t num_bytes, std::size_t num_bytes_in_use)
+  {
+    if(num_bytes <= _host_capacity)
+      return;
+
+    std::size_t capacity = std::max(num_bytes, 2 * _host_capacity);
+    std::shared_ptr<detail::pinned_host_region> staging =
+        std::make_shared<detail::pinned_host_region>(_ctx, capacity);
+    if(num_bytes_in_use > 0)
+      std::memcpy(staging->get_data(), _host_staging->get_data(), num_bytes_in_use);
+
+    _host_staging = staging;
+    _host_capacity = capacity;
+  }
+
+  void reserve_device_staging(std::size_t num_bytes)
+  {
+    if(num_bytes <= _device_capacity)
+      return;
+
+    std::size_t capacity = std::max(num_bytes, 2 * _device_capacity);
+    _ctx->create_buffer<unsigned char>(_device_staging, capacity);
+    _device_capacity = capacity;
+  }
+
+  device_context_ptr _ctx;
+  command_queue_id _queue;
+
+  std::shared_ptr<detail::pinned_host_region> _host_staging;
+  std::size_t _host_capacity;
+  cl::Buffer _device_staging;
+  std::size_t _device_capacity;
+
+  std::vector<segment> _writes;
+  std::vector<segment> _reads;
+  std::size_t _write_bytes;
+  std::size_t _read_bytes;
+
+  /// The state of the last submitted batch
+  bool _is_submitted;
+  cl::Event _completion;
+  std::vector<segment> _submitted_reads;
+  std::size_t _submitted_read_section;
+};
+
+}
+
+#endif